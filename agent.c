@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent.h"
+
+/**
+ * agent_socket_path() - path of the user's agent socket
+ * @path:	buffer to fill
+ * @len:	size of @path
+ *
+ * Return: 0 on success, -ENAMETOOLONG if @path is too small
+ */
+int agent_socket_path(char *path, size_t len)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	if (dir)
+		n = snprintf(path, len, "%s/cdba-agent.sock", dir);
+	else
+		n = snprintf(path, len, "/tmp/cdba-agent-%lu.sock",
+			     (unsigned long)getuid());
+
+	return n < len ? 0 : -ENAMETOOLONG;
+}
+
+static int agent_open(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int ret;
+	int fd;
+
+	ret = agent_socket_path(addr.sun_path, sizeof(addr.sun_path));
+	if (ret < 0)
+		return ret;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0)
+		goto err;
+
+	/* The agent sees the session in the clear, it must be our own */
+	ret = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+	if (ret < 0)
+		goto err;
+
+	if (cred.uid != getuid()) {
+		close(fd);
+		return -EPERM;
+	}
+
+	return fd;
+
+err:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/**
+ * agent_connect() - run a session on the agent's connection to a host
+ * @host:	host to connect to
+ * @cmd:	command running the server on @host
+ * @pipes:	filled with the session's stdin, stdout and stderr, non-blocking
+ *
+ * Return: 0 on success, negative errno if the agent isn't running or
+ * refused the session
+ */
+int agent_connect(const char *host, const char *cmd, int pipes[3])
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	char req[AGENT_REQUEST_MAX];
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	int remote[3];
+	int local[3];
+	int fds[2];
+	uint8_t status;
+	ssize_t n;
+	int flags;
+	int ret;
+	int fd;
+	int i;
+
+	n = snprintf(req, sizeof(req), "%s%c%s", host, '\0', cmd);
+	if (n >= sizeof(req) - 1)
+		return -ENAMETOOLONG;
+
+	fd = agent_open();
+	if (fd < 0)
+		return fd;
+
+	for (i = 0; i < 3; i++) {
+		if (pipe2(fds, O_CLOEXEC) < 0) {
+			ret = -errno;
+			while (i--) {
+				close(local[i]);
+				close(remote[i]);
+			}
+			close(fd);
+			return ret;
+		}
+
+		/* Our end of stdin is the write end, the others the read end */
+		local[i] = i ? fds[0] : fds[1];
+		remote[i] = i ? fds[1] : fds[0];
+	}
+
+	iov.iov_base = req;
+	iov.iov_len = n + 1;
+
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(remote));
+	memcpy(CMSG_DATA(cmsg), remote, sizeof(remote));
+
+	n = sendmsg(fd, &msg, 0);
+	ret = n < 0 ? -errno : 0;
+
+	for (i = 0; i < 3; i++)
+		close(remote[i]);
+
+	if (!ret) {
+		n = read(fd, &status, 1);
+		if (n < 0)
+			ret = -errno;
+		else if (n == 0)
+			ret = -ECONNRESET;
+		else if (status)
+			ret = -status;
+	}
+
+	close(fd);
+
+	if (ret < 0) {
+		for (i = 0; i < 3; i++)
+			close(local[i]);
+		return ret;
+	}
+
+	for (i = 0; i < 3; i++) {
+		flags = fcntl(local[i], F_GETFL, 0);
+		fcntl(local[i], F_SETFL, flags | O_NONBLOCK);
+		pipes[i] = local[i];
+	}
+
+	return 0;
+}
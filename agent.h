@@ -0,0 +1,21 @@
+#ifndef __AGENT_H__
+#define __AGENT_H__
+
+#include <stddef.h>
+
+/*
+ * cdba-agent keeps ssh connections to recently used hosts open, each carrying
+ * the sessions of any number of cdba invocations over channels of its own,
+ * see mux.h.
+ *
+ * A client connects to the agent's socket and sends "<host>\0<command>\0",
+ * along with the remote ends of its stdin, stdout and stderr pipes, just like
+ * those of an ssh process. The agent replies with a single byte, 0 once the
+ * session is on its way, otherwise an errno.
+ */
+#define AGENT_REQUEST_MAX 1024
+
+int agent_socket_path(char *path, size_t len);
+int agent_connect(const char *host, const char *cmd, int pipes[3]);
+
+#endif
@@ -62,8 +62,10 @@ void *alpaca_open(struct device *dev)
 	alpaca = calloc(1, sizeof(*alpaca));
 
 	alpaca->alpaca_fd = tty_open(dev->control_dev, &alpaca->alpaca_tios);
-	if (alpaca->alpaca_fd < 0)
-		err(1, "failed to open %s", dev->control_dev);
+	if (alpaca->alpaca_fd < 0) {
+		free(alpaca);
+		return NULL;
+	}
 
 	alpaca_device_power(alpaca, 0);
 
@@ -77,6 +79,16 @@ void *alpaca_open(struct device *dev)
 	return alpaca;
 }
 
+void alpaca_close(struct device *dev)
+{
+	struct alpaca *alpaca = dev->cdb;
+
+	tcsetattr(alpaca->alpaca_fd, TCSAFLUSH, &alpaca->alpaca_tios);
+	close(alpaca->alpaca_fd);
+	free(alpaca);
+	dev->cdb = NULL;
+}
+
 static int alpaca_device_power(struct alpaca *alpaca, int on)
 {
 	char buf[32];
@@ -6,6 +6,7 @@
 struct alpaca;
 
 void *alpaca_open(struct device *dev);
+void alpaca_close(struct device *dev);
 int alpaca_power(struct device *dev, bool on);
 void alpaca_usb(struct device *dev, bool on);
 void alpaca_key(struct device *dev, int key, bool on);
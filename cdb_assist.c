@@ -249,16 +249,22 @@ static void cdb_parser_push(struct cdb_assist *cdb, char ch)
 	}
 }
 
-static int cdb_assist_ctrl_data(int fd, void *data)
+static int cdb_assist_ctrl_data(int fd, unsigned int revents, void *data)
 {
-	struct cdb_assist *cdb = data;
+	struct device *dev = data;
+	struct cdb_assist *cdb = dev->cdb;
 	char buf[10];
 	ssize_t n;
 	ssize_t k;
 
 	n = read(fd, buf, sizeof(buf) - 1);
-	if (n < 0)
-		return n;
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+
+	if (n <= 0) {
+		board_lost(dev, n < 0 ? strerror(errno) : "hung up");
+		return 0;
+	}
 
 	for (k = 0; k < n; k++)
 		cdb_parser_push(cdb, tolower(buf[k]));
@@ -279,14 +285,21 @@ void *cdb_assist_open(struct device *dev)
 	cdb = calloc(1, sizeof(*cdb));
 
 	cdb->control_tty = tty_open(dev->control_dev, &cdb->control_tios);
-	if (cdb->control_tty < 0)
+	if (cdb->control_tty < 0) {
+		free(cdb);
 		return NULL;
-
-	watch_add_readfd(cdb->control_tty, cdb_assist_ctrl_data, cdb);
+	}
 
 	ret = cdb_ctrl_write(cdb, "vpabc", 5);
-	if (ret < 0)
+	if (ret < 0) {
+		warn("failed to configure %s", dev->control_dev);
+		close(cdb->control_tty);
+		free(cdb);
 		return NULL;
+	}
+
+	/* The callback finds cdb as dev->cdb, which is set once we return */
+	watch_add(cdb->control_tty, WATCH_READ, cdb_assist_ctrl_data, dev);
 
 	cdb_set_voltage(cdb, dev->voltage);
 
@@ -297,9 +310,12 @@ void cdb_assist_close(struct device *dev)
 {
 	struct cdb_assist *cdb = dev->cdb;
 
+	watch_del(cdb->control_tty);
 	tcflush(cdb->control_tty, TCIFLUSH);
 
 	close(cdb->control_tty);
+	free(cdb);
+	dev->cdb = NULL;
 }
 
 static void cdb_power(struct cdb_assist *cdb, bool on)
@@ -344,7 +360,6 @@ unsigned int cdb_vref(struct cdb_assist *cdb)
 void cdb_assist_print_status(struct device *dev)
 {
 	struct cdb_assist *cdb = dev->cdb;
-	struct msg hdr;
 	char buf[128];
 	int n;
 
@@ -358,10 +373,7 @@ void cdb_assist_print_status(struct device *dev)
 			 cdb->btn[2] ? " btn3" : "",
 			 cdb->vref);
 
-	hdr.type = MSG_STATUS_UPDATE;
-	hdr.len = n;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
-	write(STDOUT_FILENO, buf, n);
+	cdba_send(dev->session, MSG_STATUS_UPDATE, buf, n);
 }
 
 void cdb_set_voltage(struct cdb_assist *cdb, unsigned mV)
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "list.h"
+#include "mux.h"
+#include "watch.h"
+
+/* An ssh connection to a host, carrying a channel per client session */
+struct host {
+	char *name;
+	char *cmd;
+
+	/* ssh's stdin, stdout and stderr */
+	int ssh_fds[3];
+	struct mux *mux;
+
+	/* The clients' stderr, by channel, for messages of ssh */
+	int err_fds[MUX_CHANNELS];
+	unsigned int channels;
+
+	/* Closed after idling for idle_timeout seconds */
+	struct timer *idle_timer;
+	bool closing;
+
+	struct list_head node;
+};
+
+static struct list_head hosts = LIST_INIT(hosts);
+static unsigned int idle_timeout = 600;
+
+static void host_idle(void *data)
+{
+	struct host *host = data;
+
+	host->idle_timer = NULL;
+	host->closing = true;
+
+	mux_close(host->mux);
+}
+
+static int host_mux_open(struct mux *mux, int fd, int err_fd, void *data)
+{
+	/* The server never opens channels of its own */
+	return -1;
+}
+
+static void host_mux_hangup(struct mux *mux, int channel, void *data)
+{
+	struct host *host = data;
+
+	/* Lets the client see the session end, as it would with ssh exiting */
+	close(host->err_fds[channel]);
+	host->err_fds[channel] = -1;
+
+	if (--host->channels || host->closing)
+		return;
+
+	host->idle_timer = watch_timer_add(idle_timeout * 1000, host_idle, host);
+}
+
+static void host_mux_closed(struct mux *mux, void *data)
+{
+	struct host *host = data;
+	int i;
+
+	if (host->idle_timer)
+		watch_timer_cancel(host->idle_timer);
+
+	/* ssh exits as its stdin is closed */
+	close(host->ssh_fds[0]);
+	close(host->ssh_fds[1]);
+	if (host->ssh_fds[2] >= 0) {
+		watch_del(host->ssh_fds[2]);
+		close(host->ssh_fds[2]);
+	}
+
+	for (i = 0; i < MUX_CHANNELS; i++) {
+		if (host->err_fds[i] >= 0)
+			close(host->err_fds[i]);
+	}
+
+	if (!host->closing)
+		warnx("connection to %s lost", host->name);
+
+	list_del(&host->node);
+	free(host->name);
+	free(host->cmd);
+	free(host);
+}
+
+static const struct mux_ops host_mux_ops = {
+	.open = host_mux_open,
+	.hangup = host_mux_hangup,
+	.closed = host_mux_closed,
+};
+
+/*
+ * Output of ssh itself isn't tied to a channel, so it's shown by all clients
+ * of the host.
+ */
+static int host_stderr(int fd, unsigned int revents, void *data)
+{
+	struct host *host = data;
+	char buf[4096];
+	ssize_t n;
+	int i;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n <= 0) {
+		watch_del(fd);
+		close(fd);
+		host->ssh_fds[2] = -1;
+		return 0;
+	}
+
+	for (i = 0; i < MUX_CHANNELS; i++) {
+		if (host->err_fds[i] >= 0)
+			write(host->err_fds[i], buf, n);
+	}
+
+	return 0;
+}
+
+static struct host *host_connect(const char *name, const char *cmd)
+{
+	int piped_stdin[2];
+	int piped_stdout[2];
+	int piped_stderr[2];
+	struct host *host;
+	pid_t pid;
+	int flags;
+	int i;
+
+	list_for_each_entry(host, &hosts, node) {
+		if (!host->closing && !strcmp(host->name, name) &&
+		    !strcmp(host->cmd, cmd))
+			return host;
+	}
+
+	if (pipe2(piped_stdin, O_CLOEXEC) < 0)
+		return NULL;
+	if (pipe2(piped_stdout, O_CLOEXEC) < 0)
+		goto close_stdin;
+	if (pipe2(piped_stderr, O_CLOEXEC) < 0)
+		goto close_stdout;
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		goto close_stderr;
+	case 0:
+		dup2(piped_stdin[0], STDIN_FILENO);
+		dup2(piped_stdout[1], STDOUT_FILENO);
+		dup2(piped_stderr[1], STDERR_FILENO);
+
+		signal(SIGCHLD, SIG_DFL);
+
+		execl("/usr/bin/ssh", "ssh", name, cmd, NULL);
+		err(1, "launching ssh failed");
+	default:
+		close(piped_stdin[0]);
+		close(piped_stdout[1]);
+		close(piped_stderr[1]);
+	}
+
+	host = calloc(1, sizeof(*host));
+	if (!host)
+		err(1, "failed to allocate host");
+
+	host->name = strdup(name);
+	host->cmd = strdup(cmd);
+	host->ssh_fds[0] = piped_stdin[1];
+	host->ssh_fds[1] = piped_stdout[0];
+	host->ssh_fds[2] = piped_stderr[0];
+
+	for (i = 0; i < MUX_CHANNELS; i++)
+		host->err_fds[i] = -1;
+
+	flags = fcntl(host->ssh_fds[2], F_GETFL, 0);
+	fcntl(host->ssh_fds[2], F_SETFL, flags | O_NONBLOCK);
+	watch_add(host->ssh_fds[2], WATCH_READ, host_stderr, host);
+
+	host->mux = mux_new(host->ssh_fds[1], host->ssh_fds[0], &host_mux_ops, host);
+
+	list_add(&hosts, &host->node);
+
+	return host;
+
+close_stderr:
+	close(piped_stderr[0]);
+	close(piped_stderr[1]);
+close_stdout:
+	close(piped_stdout[0]);
+	close(piped_stdout[1]);
+close_stdin:
+	close(piped_stdin[0]);
+	close(piped_stdin[1]);
+
+	return NULL;
+}
+
+static int client_session(const char *req, size_t len, int fds[3])
+{
+	const char *name = req;
+	const char *cmd;
+	struct host *host;
+	int channel;
+	int err_fd;
+
+	cmd = memchr(req, '\0', len);
+	if (!cmd || ++cmd == req + len || !memchr(cmd, '\0', req + len - cmd))
+		return -EINVAL;
+
+	host = host_connect(name, cmd);
+	if (!host)
+		return -errno;
+
+	/* The mux owns the client's pipes, keep stderr for ssh's own messages */
+	err_fd = dup(fds[2]);
+	if (err_fd < 0)
+		return -errno;
+
+	channel = mux_channel_open(host->mux, fds[0], fds[1], fds[2]);
+	if (channel < 0) {
+		close(err_fd);
+		return channel;
+	}
+
+	host->err_fds[channel] = err_fd;
+	host->channels++;
+
+	if (host->idle_timer) {
+		watch_timer_cancel(host->idle_timer);
+		host->idle_timer = NULL;
+	}
+
+	return 0;
+}
+
+static int client_request(int fd, unsigned int revents, void *data)
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	char req[AGENT_REQUEST_MAX];
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	uint8_t status;
+	int fds[3];
+	ssize_t n;
+	int ret = -EINVAL;
+	int i;
+
+	iov.iov_base = req;
+	iov.iov_len = sizeof(req);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (n > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+		ret = client_session(req, n, fds);
+		if (ret < 0) {
+			for (i = 0; i < 3; i++)
+				close(fds[i]);
+		}
+	}
+
+	if (ret < 0)
+		warnx("refused session: %s", strerror(-ret));
+
+	status = -ret;
+	write(fd, &status, 1);
+
+	watch_del(fd);
+	close(fd);
+
+	return 0;
+}
+
+static int client_accept(int lfd, unsigned int revents, void *data)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int ret;
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	/* Sessions run on our ssh credentials, serve none but our own user */
+	ret = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+	if (ret < 0 || cred.uid != getuid()) {
+		close(fd);
+		return 0;
+	}
+
+	watch_add(fd, WATCH_READ, client_request, NULL);
+
+	return 0;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int ret;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path \"%s\" too long", path);
+
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	/* Don't pull the socket from under a running agent */
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret == 0 || errno == EAGAIN)
+		errx(1, "an agent is already listening on \"%s\"", path);
+
+	unlink(path);
+
+	umask(0077);
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0)
+		err(1, "failed to bind \"%s\"", path);
+
+	ret = listen(fd, 16);
+	if (ret < 0)
+		err(1, "failed to listen on \"%s\"", path);
+
+	return fd;
+}
+
+static void quit_handler(int signo)
+{
+	watch_quit();
+}
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-t <idle-timeout>]\n", __progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int opt;
+	int lfd;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			idle_timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (agent_socket_path(path, sizeof(path)) < 0)
+		errx(1, "agent socket path too long");
+
+	/* Clients and ssh processes come and go */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGINT, quit_handler);
+	signal(SIGTERM, quit_handler);
+
+	lfd = listen_socket(path);
+	watch_add(lfd, WATCH_READ, client_accept, NULL);
+
+	watch_run();
+
+	unlink(path);
+
+	return 0;
+}
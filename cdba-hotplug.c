@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2016-2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <libudev.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hotplug.h"
+#include "list.h"
+
+struct usb_dev {
+	char *devpath;
+	char *devnode;
+	char *serial;
+
+	struct list_head node;
+};
+
+struct client {
+	int fd;
+	char *serial;
+
+	char buf[HOTPLUG_LINE_MAX];
+	size_t len;
+
+	struct list_head node;
+};
+
+static struct list_head usb_devs = LIST_INIT(usb_devs);
+static struct list_head clients = LIST_INIT(clients);
+static unsigned int num_clients;
+
+static struct usb_dev *usb_dev_find(const char *devpath)
+{
+	struct usb_dev *ud;
+
+	list_for_each_entry(ud, &usb_devs, node) {
+		if (!strcmp(ud->devpath, devpath))
+			return ud;
+	}
+
+	return NULL;
+}
+
+static void client_close(struct client *client)
+{
+	list_del(&client->node);
+	num_clients--;
+
+	close(client->fd);
+	free(client->serial);
+	free(client);
+}
+
+static int client_send(struct client *client, const char *line, size_t len)
+{
+	ssize_t n;
+
+	n = write(client->fd, line, len);
+	if (n != len) {
+		/* Slow or dead client, it will fall back to its own monitor */
+		warnx("dropping client for %s", client->serial);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void notify(const char *serial, const char *line, size_t len)
+{
+	struct client *client;
+	struct client *tmp;
+
+	list_for_each_entry_safe(client, tmp, &clients, node) {
+		if (!client->serial || strcmp(client->serial, serial))
+			continue;
+
+		if (client_send(client, line, len) < 0)
+			client_close(client);
+	}
+}
+
+static void usb_dev_add(struct udev_device *dev)
+{
+	char line[HOTPLUG_LINE_MAX];
+	const char *devpath;
+	const char *devnode;
+	const char *serial;
+	struct usb_dev *ud;
+	int n;
+
+	devpath = udev_device_get_devpath(dev);
+	devnode = udev_device_get_devnode(dev);
+	serial = udev_device_get_sysattr_value(dev, "serial");
+	if (!devpath || !devnode || !serial)
+		return;
+
+	ud = usb_dev_find(devpath);
+	if (ud) {
+		list_del(&ud->node);
+		free(ud->devpath);
+		free(ud->devnode);
+		free(ud->serial);
+		free(ud);
+	}
+
+	ud = calloc(1, sizeof(*ud));
+	if (!ud)
+		err(1, "failed to allocate usb device");
+
+	ud->devpath = strdup(devpath);
+	ud->devnode = strdup(devnode);
+	ud->serial = strdup(serial);
+
+	list_add(&usb_devs, &ud->node);
+
+	n = snprintf(line, sizeof(line), "add %s %s\n", devpath, devnode);
+	if (n < sizeof(line))
+		notify(serial, line, n);
+}
+
+static void usb_dev_remove(struct udev_device *dev)
+{
+	char line[HOTPLUG_LINE_MAX];
+	const char *devpath;
+	struct usb_dev *ud;
+	int n;
+
+	devpath = udev_device_get_devpath(dev);
+	if (!devpath)
+		return;
+
+	ud = usb_dev_find(devpath);
+	if (!ud)
+		return;
+
+	n = snprintf(line, sizeof(line), "remove %s\n", devpath);
+	if (n < sizeof(line))
+		notify(ud->serial, line, n);
+
+	list_del(&ud->node);
+	free(ud->devpath);
+	free(ud->devnode);
+	free(ud->serial);
+	free(ud);
+}
+
+static void handle_udev_event(struct udev_monitor *mon)
+{
+	struct udev_device *dev;
+	const char *action;
+
+	dev = udev_monitor_receive_device(mon);
+	if (!dev)
+		return;
+
+	action = udev_device_get_action(dev);
+	if (!action)
+		goto unref_dev;
+
+	if (!strcmp(action, "add"))
+		usb_dev_add(dev);
+	else if (!strcmp(action, "remove"))
+		usb_dev_remove(dev);
+
+unref_dev:
+	udev_device_unref(dev);
+}
+
+static void scan_devices(struct udev *udev)
+{
+	struct udev_enumerate *udev_enum;
+	struct udev_list_entry *first;
+	struct udev_list_entry *item;
+	struct udev_device *dev;
+
+	udev_enum = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(udev_enum, "usb");
+	udev_enumerate_add_match_sysattr(udev_enum, "serial", NULL);
+	udev_enumerate_scan_devices(udev_enum);
+
+	first = udev_enumerate_get_list_entry(udev_enum);
+	udev_list_entry_foreach(item, first) {
+		dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(item));
+		if (!dev)
+			continue;
+
+		usb_dev_add(dev);
+		udev_device_unref(dev);
+	}
+
+	udev_enumerate_unref(udev_enum);
+}
+
+static void client_register(struct client *client, const char *serial)
+{
+	char line[HOTPLUG_LINE_MAX];
+	struct usb_dev *ud;
+	int n;
+
+	client->serial = strdup(serial);
+
+	list_for_each_entry(ud, &usb_devs, node) {
+		if (strcmp(ud->serial, serial))
+			continue;
+
+		n = snprintf(line, sizeof(line), "add %s %s\n", ud->devpath, ud->devnode);
+		if (n >= sizeof(line))
+			continue;
+
+		if (client_send(client, line, n) < 0) {
+			client_close(client);
+			return;
+		}
+	}
+}
+
+static void handle_client(struct client *client)
+{
+	char *eol;
+	ssize_t n;
+
+	n = read(client->fd, client->buf + client->len,
+		 sizeof(client->buf) - client->len - 1);
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN)
+			return;
+
+		client_close(client);
+		return;
+	}
+
+	/* Clients send nothing beyond their serial number */
+	if (client->serial) {
+		client_close(client);
+		return;
+	}
+
+	client->len += n;
+	client->buf[client->len] = '\0';
+
+	eol = strchr(client->buf, '\n');
+	if (!eol) {
+		if (client->len == sizeof(client->buf) - 1)
+			client_close(client);
+		return;
+	}
+	*eol = '\0';
+
+	client_register(client, client->buf);
+}
+
+static void handle_accept(int lfd)
+{
+	struct client *client;
+	int flags;
+	int fd;
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		err(1, "failed to allocate client");
+
+	client->fd = fd;
+
+	list_add(&clients, &client->node);
+	num_clients++;
+}
+
+/*
+ * Clients open the device nodes we announce, so nobody else may be able to
+ * put a socket in our place.
+ */
+static void socket_dir_check(const char *path)
+{
+	char dir[PATH_MAX];
+	struct stat st;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	dirname(dir);
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		err(1, "failed to create \"%s\"", dir);
+
+	if (lstat(dir, &st) < 0)
+		err(1, "failed to stat \"%s\"", dir);
+
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 022))
+		errx(1, "\"%s\" must be a directory only writable by us", dir);
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int ret;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "socket path \"%s\" too long", path);
+
+	strcpy(addr.sun_path, path);
+
+	socket_dir_check(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(1, "failed to create socket");
+
+	unlink(path);
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0)
+		err(1, "failed to bind \"%s\"", path);
+
+	/* cdba-server runs as the ssh user, so let anyone subscribe */
+	chmod(path, 0666);
+
+	ret = listen(fd, 16);
+	if (ret < 0)
+		err(1, "failed to listen on \"%s\"", path);
+
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = CDBA_HOTPLUG_SOCKET;
+	struct udev_monitor *mon;
+	struct client *client;
+	struct client *tmp;
+	struct pollfd *pfds = NULL;
+	struct udev *udev;
+	unsigned int i;
+	int lfd;
+	int ret;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [socket]\n", argv[0]);
+		exit(1);
+	} else if (argc == 2) {
+		path = argv[1];
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	udev = udev_new();
+	if (!udev)
+		err(1, "udev_new() failed");
+
+	mon = udev_monitor_new_from_netlink(udev, "udev");
+	udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", "usb_device");
+	udev_monitor_enable_receiving(mon);
+
+	scan_devices(udev);
+
+	lfd = listen_socket(path);
+
+	for (;;) {
+		pfds = realloc(pfds, (2 + num_clients) * sizeof(*pfds));
+		if (!pfds)
+			err(1, "failed to allocate poll set");
+
+		pfds[0].fd = udev_monitor_get_fd(mon);
+		pfds[0].events = POLLIN;
+		pfds[1].fd = lfd;
+		pfds[1].events = POLLIN;
+
+		i = 2;
+		list_for_each_entry(client, &clients, node) {
+			pfds[i].fd = client->fd;
+			pfds[i].events = POLLIN;
+			i++;
+		}
+
+		ret = poll(pfds, i, -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0)
+			err(1, "poll");
+
+		/* Walk clients in the same order they were added to pfds */
+		i = 2;
+		list_for_each_entry_safe(client, tmp, &clients, node) {
+			if (pfds[i++].revents)
+				handle_client(client);
+		}
+
+		if (pfds[0].revents)
+			handle_udev_event(mon);
+
+		if (pfds[1].revents)
+			handle_accept(lfd);
+	}
+
+	return 0;
+}
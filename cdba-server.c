@@ -28,28 +28,149 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-#include <sys/time.h>
-#include <alloca.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/random.h>
 
 #include "cdba-server.h"
 #include "circ_buf.h"
 #include "device.h"
 #include "device_parser.h"
 #include "fastboot.h"
-#include "list.h"
+#include "filter.h"
+#include "msg_queue.h"
+#include "mux.h"
+#include "relay.h"
+#include "reload.h"
+#include "replay.h"
+#include "shard.h"
 
-static bool quit_invoked;
+/*
+ * A client session, either on the server's own stdio or on the stdio of a
+ * relay handed over to the daemon.
+ */
+struct session {
+	int in_fd;
+	int out_fd;
+	int err_fd;
+
+	/* Connection to the relay, -1 when running standalone */
+	int conn_fd;
+
+	/* Served on a channel of a multiplexed connection, see session_mux() */
+	bool channel;
+
+	struct circ_buf recv_buf;
+	struct msg_queue queue;
+
+	struct device *device;
+
+	/* Board requested, but in use by another session or process */
+	struct device *waiting;
+	struct timer *lock_timer;
+
+	/* Board requested, served by another shard */
+	struct device *migrating;
+
+	void *fastboot_payload;
+	size_t fastboot_size;
+	size_t fastboot_alloc;
+
+	bool closing;
+
+	/* Console filter requested by the client, see msg_console_filter() */
+	struct filter *filter;
+	bool record;
+
+	/* Renewed by the client's heartbeats, see msg_heartbeat() */
+	unsigned int lease_ms;
+	struct timer *lease_timer;
+
+	/* Console output sent so far, the tail kept once the session may be held */
+	uint64_t console_offset;
+	struct replay *replay;
+
+	/* Held for the client to resume after losing it, see session_hold() */
+	char token[SESSION_TOKEN_LEN + 1];
+	unsigned int grace_ms;
+	struct timer *grace_timer;
+	bool held;
+	struct list_head held_node;
+
+	/* A resuming client's connection is on its way, see msg_session_resume() */
+	bool claimed;
+
+	struct list_head node;
+};
+
+/* Sessions served by this thread's event loop */
+static __thread struct list_head sessions;
+
+/* Sessions held after losing their client, looked up by token from any thread */
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head held_sessions = LIST_INIT(held_sessions);
+
+/* Connection of a resuming client, handed to the thread of the held session */
+struct session_handover {
+	struct session *session;
+
+	int in_fd;
+	int out_fd;
+	int err_fd;
+	int conn_fd;
+	bool channel;
+
+	struct circ_buf recv_buf;
+	struct filter *filter;
+	bool record;
+	bool compress;
+
+	uint64_t offset;
+};
+
+/* A connection carrying several sessions, each on a channel of its own */
+struct session_mux {
+	struct mux *mux;
+
+	int in_fd;
+	int out_fd;
+	int err_fd;
+	int conn_fd;
+};
 
-struct device *selected_device;
+static bool daemon_mode;
+static int console_latency = -1;
+static int lease_timeout = -1;
+static const char *record_dir;
+static int hold_max = 3600;
 
+/* Interval of retries to lock a board held by another cdba-server */
+#define SESSION_LOCK_POLL_MS	500
+
+/* Console output kept for a resuming client */
+#define SESSION_REPLAY_SIZE	(256 * 1024)
+
+/* Interval of checks for the outcome of a resume, after the grace period */
+#define SESSION_CLAIM_POLL_MS	100
+
+/**
+ * tty_open() - open a tty and configure it for 115200 8N1, raw
+ * @tty:	path of the tty
+ * @old:	receives the original configuration
+ *
+ * Return: file descriptor, or -1 if the tty can't be used
+ */
 int tty_open(const char *tty, struct termios *old)
 {
 	struct termios tios;
@@ -57,12 +178,17 @@ int tty_open(const char *tty, struct termios *old)
 	int fd;
 
 	fd = open(tty, O_RDWR | O_NOCTTY | O_EXCL);
-	if (fd < 0)
-		err(1, "unable to open \"%s\"", tty);
+	if (fd < 0) {
+		warn("unable to open \"%s\"", tty);
+		return -1;
+	}
 
 	ret = tcgetattr(fd, old);
-	if (ret < 0)
-		err(1, "unable to retrieve \"%s\" tios", tty);
+	if (ret < 0) {
+		warn("unable to retrieve \"%s\" tios", tty);
+		close(fd);
+		return -1;
+	}
 
 	memset(&tios, 0, sizeof(tios));
 	tios.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
@@ -72,25 +198,119 @@ int tty_open(const char *tty, struct termios *old)
 	tcflush(fd, TCIFLUSH);
 
 	ret = tcsetattr(fd, TCSANOW, &tios);
-	if (ret < 0)
-		err(1, "unable to update \"%s\" tios", tty);
+	if (ret < 0) {
+		warn("unable to update \"%s\" tios", tty);
+		close(fd);
+		return -1;
+	}
 
 	return fd;
 }
 
+void session_warnx(struct session *session, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!session)
+		return;
+
+	va_start(ap, fmt);
+	dprintf(session->err_fd, "cdba-server: ");
+	vdprintf(session->err_fd, fmt, ap);
+	dprintf(session->err_fd, "\n");
+	va_end(ap);
+}
+
+/* Start recording the console of the session's board, once it produces any */
+static void session_record(struct session *session)
+{
+	char path[PATH_MAX];
+	char stamp[32];
+	struct timespec ts;
+	struct tm tm;
+	int fd;
+
+	session->record = false;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+	snprintf(path, sizeof(path), "%s/%s-%s.%03ld.log", record_dir,
+		 session->device->board, stamp, ts.tv_nsec / 1000000);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		session_warnx(session, "failed to record console to %s: %s",
+			      path, strerror(errno));
+		return;
+	}
+
+	filter_record(session->filter, fd);
+	session_warnx(session, "recording console to %s", path);
+}
+
+static int session_console(struct session *session, const void *data, size_t len)
+{
+	if (session->replay)
+		replay_write(session->replay, data, len);
+	session->console_offset += len;
+
+	/* Kept in the replay buffer alone while the client is gone */
+	if (session->held)
+		return -ENOTCONN;
+
+	return msg_queue_push(&session->queue, MSG_CONSOLE, data, len);
+}
+
+static void session_filter_emit(const void *data, size_t len, void *ctx)
+{
+	session_console(ctx, data, len);
+}
+
+/**
+ * cdba_send() - queue a message to a client
+ * @session:	session to send the message to, may be NULL
+ * @type:	message type
+ * @data:	payload, copied
+ * @len:	length of @data
+ *
+ * Return: 0 on success, negative errno if the message was dropped
+ */
+int cdba_send(struct session *session, int type, const void *data, size_t len)
+{
+	if (!session)
+		return -ENOTCONN;
+
+	/* Console output of all kinds of boards passes here */
+	if (type == MSG_CONSOLE && session->filter) {
+		if (session->record && session->device)
+			session_record(session);
+
+		filter_feed(session->filter, data, len, session_filter_emit, session);
+		return 0;
+	}
+
+	if (type == MSG_CONSOLE)
+		return session_console(session, data, len);
+
+	if (session->held)
+		return -ENOTCONN;
+
+	return msg_queue_push(&session->queue, type, data, len);
+}
+
+static void session_close(struct session *session);
+static void session_lost(struct session *session);
+
 static void fastboot_opened(struct fastboot *fb, void *data)
 {
+	struct device *device = data;
 	const uint8_t one = 1;
-	struct msg *msg;
 
 	warnx("fastboot connection opened");
 
-	msg = alloca(sizeof(*msg) + 1);
-	msg->type = MSG_FASTBOOT_PRESENT;
-	msg->len = 1;
-	memcpy(msg->data, &one, 1);
-
-	write(STDOUT_FILENO, msg, sizeof(*msg) + 1);
+	cdba_send(device->session, MSG_FASTBOOT_PRESENT, &one, 1);
 }
 
 static void fastboot_info(struct fastboot *fb, const void *buf, size_t len)
@@ -100,15 +320,10 @@ static void fastboot_info(struct fastboot *fb, const void *buf, size_t len)
 
 static void fastboot_disconnect(void *data)
 {
+	struct device *device = data;
 	const uint8_t zero = 0;
-	struct msg *msg;
 
-	msg = alloca(sizeof(*msg) + 1);
-	msg->type = MSG_FASTBOOT_PRESENT;
-	msg->len = 1;
-	memcpy(msg->data, &zero, 1);
-
-	write(STDOUT_FILENO, msg, sizeof(*msg) + 1);
+	cdba_send(device->session, MSG_FASTBOOT_PRESENT, &zero, 1);
 }
 
 static struct fastboot_ops fastboot_ops = {
@@ -117,306 +332,1287 @@ static struct fastboot_ops fastboot_ops = {
 	.info = fastboot_info,
 };
 
-static void msg_select_board(const void *param)
+static void session_attach(struct session *session, struct device *device);
+
+static void session_lock_cancel(struct session *session)
+{
+	if (session->lock_timer) {
+		watch_timer_cancel(session->lock_timer);
+		session->lock_timer = NULL;
+	}
+}
+
+static void session_lock_retry(void *data)
+{
+	struct session *session = data;
+	struct device *device = session->waiting;
+
+	session->lock_timer = NULL;
+
+	/* Taken by a session of ours meanwhile, handed over on release */
+	if (!device || device->session || device->booting)
+		return;
+
+	session_attach(session, device);
+}
+
+static void session_attach(struct session *session, struct device *device)
+{
+	struct device *opened;
+
+	opened = device_open(device->board, &fastboot_ops);
+	if (!opened && errno == EBUSY &&
+	    !__atomic_load_n(&device->retired, __ATOMIC_ACQUIRE)) {
+		/*
+		 * Locked by another cdba-server, poll for it rather than stall
+		 * the event loop, and with it any other sessions it serves.
+		 */
+		if (session->waiting != device)
+			session_warnx(session, "board is in use, waiting...");
+
+		session->waiting = device;
+		session->lock_timer = watch_timer_add(SESSION_LOCK_POLL_MS,
+						      session_lock_retry, session);
+		return;
+	}
+
+	if (!opened) {
+		session_warnx(session, "failed to open board");
+		cdba_send(session, MSG_SELECT_BOARD, NULL, 0);
+		session_close(session);
+		return;
+	}
+
+	session->waiting = NULL;
+
+	device = opened;
+	device->session = session;
+	session->device = device;
+
+	cdba_send(session, MSG_SELECT_BOARD, NULL, 0);
+}
+
+/*
+ * Close a board removed from the board database, failing the sessions
+ * waiting for it. Invoked in the board's thread.
+ */
+static void board_retire(void *data)
+{
+	struct device *device = data;
+	struct session *session;
+
+	/* Added back since, or still in use, see board_released() */
+	if (!__atomic_load_n(&device->retired, __ATOMIC_ACQUIRE) ||
+	    device->session || device->booting)
+		return;
+
+	if (!sessions.next)
+		list_init(&sessions);
+
+	list_for_each_entry(session, &sessions, node) {
+		if (session->waiting == device && !session->closing) {
+			session_warnx(session, "board %s was removed", device->board);
+			cdba_send(session, MSG_SELECT_BOARD, NULL, 0);
+			session_close(session);
+		}
+	}
+
+	if (device->opened)
+		device_close(device);
+}
+
+/* Retire a board no longer in use, or hand it to the longest waiting session */
+static void board_released(struct device *device)
+{
+	struct session *next;
+
+	if (__atomic_load_n(&device->retired, __ATOMIC_ACQUIRE)) {
+		board_retire(device);
+		return;
+	}
+
+	list_for_each_entry(next, &sessions, node) {
+		if (next->waiting == device && !next->closing) {
+			next->waiting = NULL;
+			session_attach(next, device);
+			break;
+		}
+	}
+}
+
+/**
+ * board_lost() - close a board whose controller failed
+ * @device:	device of the controller
+ * @reason:	what happened, reported to the board's session
+ *
+ * Invoked from the controller's watch callback, the controller is closed on
+ * return. The board's session is ended, the next session to select the board
+ * opens it from scratch.
+ */
+void board_lost(struct device *device, const char *reason)
+{
+	struct session *session = device->session;
+	bool claimed = false;
+
+	warnx("%s: controller lost: %s", device->board, reason);
+
+	if (session) {
+		session_warnx(session, "controller lost: %s", reason);
+
+		/* A resuming client finds it gone, see session_reattach() */
+		pthread_mutex_lock(&held_lock);
+		claimed = session->claimed;
+		if (session->held && !claimed)
+			list_del(&session->held_node);
+		session->device = NULL;
+		pthread_mutex_unlock(&held_lock);
+	}
+
+	device_close(device);
+
+	/* A claimed session is closed once reattached, or once it expires */
+	if (session && !claimed)
+		session_close(session);
+
+	board_released(device);
+}
+
+static void session_detach(struct session *session)
+{
+	struct device *device = session->device;
+
+	if (!device)
+		return;
+
+	session->device = NULL;
+	device_release(device);
+
+	/* An aborted boot is still winding down, see fastboot_boot_done() */
+	if (device->booting)
+		return;
+
+	board_released(device);
+}
+
+static int session_input(int fd, unsigned int revents, void *data);
+static int session_hangup(int fd, unsigned int revents, void *data);
+
+static void session_track(struct session *session)
+{
+	if (!sessions.next)
+		list_init(&sessions);
+
+	list_add(&sessions, &session->node);
+}
+
+static void session_watch(struct session *session)
+{
+	if (watch_add(session->in_fd, WATCH_READ, session_input, session) < 0)
+		errx(1, "unable to watch client input");
+
+	if (session->conn_fd >= 0)
+		watch_add(session->conn_fd, WATCH_READ, session_hangup, session);
+}
+
+static void session_unwatch(struct session *session)
+{
+	watch_del(session->in_fd);
+	if (session->conn_fd >= 0)
+		watch_del(session->conn_fd);
+}
+
+/*
+ * The client is considered gone once its heartbeats stop, even if the
+ * connection never reports so, e.g. a half-open ssh session.
+ */
+static void session_lease_expired(void *data)
+{
+	struct session *session = data;
+
+	session->lease_timer = NULL;
+
+	if (session->device)
+		warnx("client of %s stopped responding, releasing the board",
+		      session->device->board);
+	else
+		warnx("client stopped responding");
+
+	/* Nothing queued will ever be read, don't wait for it to drain */
+	msg_queue_abort(&session->queue);
+	session_lost(session);
+}
+
+static void session_lease_renew(struct session *session)
+{
+	if (session->lease_timer)
+		watch_timer_cancel(session->lease_timer);
+
+	session->lease_timer = watch_timer_add(session->lease_ms,
+					       session_lease_expired, session);
+}
+
+/* Timers belong to the event loop, drop the lease's as the session moves */
+static void session_lease_suspend(struct session *session)
+{
+	if (session->lease_timer) {
+		watch_timer_cancel(session->lease_timer);
+		session->lease_timer = NULL;
+	}
+}
+
+static void session_lease_resume(struct session *session)
+{
+	if (session->lease_ms)
+		session_lease_renew(session);
+}
+
+/*
+ * Move the session to the event loop thread serving its board, so that
+ * console data flows between board and client without crossing threads.
+ *
+ * Return: true if the session now belongs to the other thread
+ */
+static void session_resume(void *data);
+
+static bool session_migrate(struct session *session, struct device *device)
+{
+	int ret;
+
+	session_unwatch(session);
+	session_lease_suspend(session);
+	msg_queue_detach(&session->queue);
+	list_del(&session->node);
+
+	session->migrating = device;
+
+	ret = shard_submit(device->shard, session_resume, session);
+	if (!ret)
+		return true;
+
+	session->migrating = NULL;
+
+	session_track(session);
+	session_watch(session);
+	session_lease_resume(session);
+	msg_queue_attach(&session->queue);
+
+	session_warnx(session, "failed to hand over session: %s", strerror(-ret));
+	cdba_send(session, MSG_SELECT_BOARD, NULL, 0);
+	session_close(session);
+
+	return false;
+}
+
+/*
+ * Return: true if the session was handed over to another thread, which must
+ * then be left to process the rest of its input
+ */
+static bool msg_select_board(struct session *session, const void *param)
 {
-	struct msg reply = { MSG_SELECT_BOARD, 0 };
+	struct device *device;
+
+	device = device_find(param);
+	if (!device) {
+		session_warnx(session, "failed to open %s", (const char *)param);
+		cdba_send(session, MSG_SELECT_BOARD, NULL, 0);
+		session_close(session);
+		return false;
+	}
+
+	session_detach(session);
+	session_lock_cancel(session);
+	session->waiting = NULL;
+
+	/* Only the main thread hands sessions over */
+	if (device->shard != shard_self()) {
+		if (!shard_self())
+			return session_migrate(session, device);
+
+		session_warnx(session, "board %s is served by another shard",
+			      device->board);
+		cdba_send(session, MSG_SELECT_BOARD, NULL, 0);
+		session_close(session);
+		return false;
+	}
 
-	selected_device = device_open(param, &fastboot_ops);
-	if (!selected_device) {
-		fprintf(stderr, "failed to open %s\n", (const char *)param);
-		quit_invoked = true;
+	if (device->session || device->booting) {
+		session_warnx(session, "board is in use, waiting...");
+		session->waiting = device;
+		return false;
 	}
 
-	write(STDOUT_FILENO, &reply, sizeof(reply));
+	session_attach(session, device);
+
+	return false;
 }
 
-static void *fastboot_payload;
-static size_t fastboot_size;
+static void fastboot_boot_done(struct device *device, void *payload)
+{
+	cdba_send(device->session, MSG_FASTBOOT_DOWNLOAD, NULL, 0);
+	free(payload);
+
+	/* The session ended during the boot, the board is free now */
+	if (!device->session && device->opened)
+		board_released(device);
+}
+
+/*
+ * Received image data is acknowledged every FASTBOOT_ACK_INTERVAL bytes, so
+ * the client can keep the amount in flight, ahead of its console input, low.
+ * Clients unaware of this ignore the acknowledgements.
+ */
+#define FASTBOOT_ACK_INTERVAL	(16 * 1024)
 
-static void msg_fastboot_download(const void *data, size_t len)
+static void msg_fastboot_download(struct session *session,
+				  const void *data, size_t len)
 {
-	struct msg reply = { MSG_FASTBOOT_DOWNLOAD, };
-	size_t new_size = fastboot_size + len;
+	size_t new_size = session->fastboot_size + len;
+	uint32_t acked = new_size;
+	size_t new_alloc;
 	void *newp;
+	int ret;
+
+	/* Grow geometrically, rather than reallocating for every chunk */
+	if (new_size > session->fastboot_alloc) {
+		new_alloc = MAX(new_size, MAX(session->fastboot_alloc * 2, 1024 * 1024));
 
-	newp = realloc(fastboot_payload, new_size);
-	if (!newp)
-		err(1, "failed too expant fastboot scratch area");
+		newp = realloc(session->fastboot_payload, new_alloc);
+		if (!newp)
+			err(1, "failed too expant fastboot scratch area");
+
+		session->fastboot_payload = newp;
+		session->fastboot_alloc = new_alloc;
+	}
 
-	memcpy(newp + fastboot_size, data, len);
+	memcpy(session->fastboot_payload + session->fastboot_size, data, len);
 
-	fastboot_payload = newp;
-	fastboot_size = new_size;
+	if (len && new_size / FASTBOOT_ACK_INTERVAL !=
+		   session->fastboot_size / FASTBOOT_ACK_INTERVAL)
+		cdba_send(session, MSG_FASTBOOT_DOWNLOAD, &acked, sizeof(acked));
+
+	session->fastboot_size = new_size;
 
 	if (!len) {
-		device_boot(selected_device, fastboot_payload, fastboot_size);
+		if (!session->device) {
+			cdba_send(session, MSG_FASTBOOT_DOWNLOAD, NULL, 0);
+			free(session->fastboot_payload);
+			goto out;
+		}
+
+		/* The payload is handed over to the boot thread */
+		ret = device_boot(session->device, session->fastboot_payload,
+				  session->fastboot_size, fastboot_boot_done,
+				  session->fastboot_payload);
+		if (ret < 0) {
+			warnx("unable to boot the board: %s", strerror(-ret));
+			fastboot_boot_done(session->device, session->fastboot_payload);
+		}
 
-		write(STDOUT_FILENO, &reply, sizeof(reply));
-		free(fastboot_payload);
-		fastboot_payload = NULL;
-		fastboot_size = 0;
+out:
+		session->fastboot_payload = NULL;
+		session->fastboot_size = 0;
+		session->fastboot_alloc = 0;
 	}
 }
 
-static void invoke_reply(int reply)
+/*
+ * The first heartbeat puts the session on a lease, by default three times the
+ * client's heartbeat interval. Once it expires the board is powered off and
+ * released to the next session.
+ */
+static void msg_heartbeat(struct session *session, const void *data, size_t len)
+{
+	uint32_t interval_ms;
+
+	if (len < sizeof(interval_ms))
+		return;
+
+	memcpy(&interval_ms, data, sizeof(interval_ms));
+
+	if (lease_timeout >= 0)
+		session->lease_ms = lease_timeout * 1000;
+	else
+		session->lease_ms = 3 * interval_ms;
+
+	if (session->lease_ms)
+		session_lease_renew(session);
+	else
+		session_lease_suspend(session);
+}
+
+static struct session *session_new(int in_fd, int out_fd, int err_fd, int conn_fd);
+
+static int session_mux_open(struct mux *mux, int fd, int err_fd, void *data)
 {
-	struct msg msg = { reply, };
+	struct session *session;
+	int out_fd;
+
+	/* The queue and the input each need a watch of their own */
+	out_fd = dup(fd);
+	if (out_fd < 0) {
+		warn("failed to open channel");
+		return -1;
+	}
 
-	write(STDOUT_FILENO, &msg, sizeof(msg));
+	session = session_new(fd, out_fd, err_fd, -1);
+	session->channel = true;
+
+	return 0;
 }
 
-static int handle_stdin(int fd, void *buf)
+static void session_mux_closed(struct mux *mux, void *data)
 {
-	static struct circ_buf recv_buf = { 0 };
-	struct msg *msg;
-	struct msg hdr;
+	struct session_mux *sm = data;
+
+	if (sm->conn_fd >= 0) {
+		watch_del(sm->conn_fd);
+
+		close(sm->in_fd);
+		close(sm->out_fd);
+		close(sm->err_fd);
+		close(sm->conn_fd);
+	} else {
+		watch_quit();
+	}
+
+	free(sm);
+}
+
+static const struct mux_ops session_mux_ops = {
+	.open = session_mux_open,
+	.closed = session_mux_closed,
+};
+
+static int session_mux_hangup(int fd, unsigned int revents, void *data)
+{
+	struct session_mux *sm = data;
+
+	mux_close(sm->mux);
+
+	return 0;
+}
+
+/*
+ * A client opening with MSG_CHANNEL drives several boards over the one
+ * connection. The connection is handed to a mux, which serves each channel
+ * as a session of its own.
+ *
+ * Return: true if the session was replaced by the mux
+ */
+static bool session_mux(struct session *session)
+{
+	static __thread uint8_t buf[CIRC_BUF_SIZE];
+	struct session_mux *sm;
+	size_t n;
+
+	if (session->device || session->waiting || session->lease_ms ||
+	    !msg_queue_empty(&session->queue)) {
+		session_warnx(session, "channels must be opened before anything else");
+		session_close(session);
+		return false;
+	}
+
+	sm = calloc(1, sizeof(*sm));
+	if (!sm)
+		err(1, "failed to allocate mux");
+
+	sm->in_fd = session->in_fd;
+	sm->out_fd = session->out_fd;
+	sm->err_fd = session->err_fd;
+	sm->conn_fd = session->conn_fd;
+
+	session_unwatch(session);
+	msg_queue_release(&session->queue);
+	list_del(&session->node);
+
+	sm->mux = mux_new(sm->in_fd, sm->out_fd, &session_mux_ops, sm);
+	if (sm->conn_fd >= 0)
+		watch_add(sm->conn_fd, WATCH_READ, session_mux_hangup, sm);
+
+	/* Everything read from here on belongs to the mux */
+	while ((n = CIRC_AVAIL(&session->recv_buf))) {
+		n = circ_read(&session->recv_buf, buf, MIN(n, sizeof(buf)));
+		mux_feed(sm->mux, buf, n);
+	}
+
+	circ_free(&session->recv_buf);
+	free(session);
+
+	return true;
+}
+
+/*
+ * The client offers the compression methods it supports, the reply holds the
+ * one picked, or nothing to keep the console uncompressed.
+ */
+static void msg_compress(struct session *session, const void *data, size_t len)
+{
+	const uint8_t method = COMPRESS_DEFLATE;
+
+	if (!memchr(data, method, len) || msg_queue_compress(&session->queue) < 0) {
+		cdba_send(session, MSG_COMPRESS, NULL, 0);
+		return;
+	}
+
+	cdba_send(session, MSG_COMPRESS, &method, 1);
+}
+
+/*
+ * Forward only the console lines matching the client's patterns, possibly with
+ * context, and optionally record the complete console on the server.
+ */
+static void msg_console_filter(struct session *session, const void *data, size_t len)
+{
+	const struct console_filter *req = data;
+	struct filter *filter;
+	char errbuf[128];
+
+	if (len < sizeof(*req)) {
+		session_warnx(session, "malformed console filter");
+		session_close(session);
+		return;
+	}
+
+	filter = filter_new(req->mode, req->context, req->patterns,
+			    len - sizeof(*req), errbuf, sizeof(errbuf));
+	if (!filter) {
+		session_warnx(session, "invalid console filter: %s", errbuf);
+		session_close(session);
+		return;
+	}
+
+	if (session->filter)
+		filter_free(session->filter);
+	session->filter = filter;
+
+	session->record = false;
+	if (req->flags & FILTER_RECORD) {
+		if (record_dir)
+			session->record = true;
+		else
+			session_warnx(session, "console recording not enabled, see cdba-server -R");
+	}
+}
+
+/*
+ * The client asks for the session to be held, for up to the given time, if
+ * the connection to it is lost; the reply holds the token to resume it with.
+ * A time of zero, sent by the client as it ends the session, cancels this.
+ */
+static void msg_session_keep(struct session *session, const void *data, size_t len)
+{
+	uint8_t bytes[SESSION_TOKEN_LEN / 2];
+	uint32_t grace_ms;
+	int i;
+
+	if (len < sizeof(grace_ms))
+		return;
+
+	memcpy(&grace_ms, data, sizeof(grace_ms));
+
+	/* A standalone server exits along with the connection */
+	if (!daemon_mode || !hold_max) {
+		session->grace_ms = 0;
+		if (grace_ms)
+			cdba_send(session, MSG_SESSION_KEEP, NULL, 0);
+		return;
+	}
+
+	session->grace_ms = MIN(grace_ms, hold_max * 1000U);
+	if (!session->grace_ms)
+		return;
+
+	if (!session->token[0]) {
+		if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+			err(1, "failed to generate session token");
+
+		for (i = 0; i < sizeof(bytes); i++)
+			sprintf(session->token + 2 * i, "%02x", bytes[i]);
+	}
+
+	if (!session->replay)
+		session->replay = replay_new(SESSION_REPLAY_SIZE, session->console_offset);
+
+	cdba_send(session, MSG_SESSION_KEEP, session->token, sizeof(session->token));
+}
+
+static void session_hold_expired(void *data)
+{
+	struct session *session = data;
+	bool claimed;
+
+	session->grace_timer = NULL;
+
+	pthread_mutex_lock(&held_lock);
+	claimed = session->claimed;
+	if (!claimed) {
+		list_del(&session->held_node);
+	}
+	pthread_mutex_unlock(&held_lock);
+
+	/*
+	 * The client's connection is being handed over, session_reattach()
+	 * cancels this timer. Check back, in case the handover fails.
+	 */
+	if (claimed) {
+		session->grace_timer = watch_timer_add(SESSION_CLAIM_POLL_MS,
+						       session_hold_expired, session);
+		return;
+	}
+
+	if (session->device)
+		warnx("client of %s did not return, releasing the board",
+		      session->device->board);
+	session_close(session);
+}
+
+/*
+ * Keep the board, powered, for the client to resume the session with its
+ * token. Console output goes to the replay buffer alone meanwhile.
+ */
+static void session_hold(struct session *session)
+{
+	session_unwatch(session);
+	session_lease_suspend(session);
+	session->lease_ms = 0;
+
+	msg_queue_release(&session->queue);
+	/* The fd is closed below, and may be reused by the time we're freed */
+	session->queue.fd = -1;
+
+	close(session->in_fd);
+	close(session->out_fd);
+	close(session->err_fd);
+	if (session->conn_fd >= 0)
+		close(session->conn_fd);
+
+	session->in_fd = -1;
+	session->out_fd = -1;
+	session->err_fd = -1;
+	session->conn_fd = -1;
+	session->channel = false;
+
+	/* Whatever the client sent last may be incomplete */
+	circ_skip(&session->recv_buf, CIRC_AVAIL(&session->recv_buf));
+
+	free(session->fastboot_payload);
+	session->fastboot_payload = NULL;
+	session->fastboot_size = 0;
+	session->fastboot_alloc = 0;
+
+	session->held = true;
+
+	pthread_mutex_lock(&held_lock);
+	list_add(&held_sessions, &session->held_node);
+	pthread_mutex_unlock(&held_lock);
+
+	session->grace_timer = watch_timer_add(session->grace_ms,
+					       session_hold_expired, session);
+
+	warnx("lost client of %s, holding the board for %u seconds",
+	      session->device->board, session->grace_ms / 1000);
+}
+
+/*
+ * The connection to the client is gone, hold the session if the client asked
+ * for it, close it otherwise.
+ */
+static void session_lost(struct session *session)
+{
+	if (!session->grace_ms || !session->device || session->closing) {
+		session_close(session);
+		return;
+	}
+
+	session_hold(session);
+}
+
+static void session_process(struct session *session);
+
+/* Invoked in the held session's thread, with the resuming client's connection */
+static void session_reattach(void *data)
+{
+	struct session_handover *handover = data;
+	struct session *session = handover->session;
+	char buf[4096];
+	uint64_t offset;
+	uint64_t start;
 	size_t n;
+
+	if (session->grace_timer) {
+		watch_timer_cancel(session->grace_timer);
+		session->grace_timer = NULL;
+	}
+
+	pthread_mutex_lock(&held_lock);
+	list_del(&session->held_node);
+	session->claimed = false;
+	pthread_mutex_unlock(&held_lock);
+
+	session->in_fd = handover->in_fd;
+	session->out_fd = handover->out_fd;
+	session->err_fd = handover->err_fd;
+	session->conn_fd = handover->conn_fd;
+	session->channel = handover->channel;
+
+	/* Holds anything the client sent after its request */
+	circ_free(&session->recv_buf);
+	session->recv_buf = handover->recv_buf;
+
+	if (handover->filter) {
+		if (session->filter)
+			filter_free(session->filter);
+		session->filter = handover->filter;
+		session->record = handover->record;
+	}
+
+	session->held = false;
+
+	msg_queue_init(&session->queue, session->out_fd);
+	if (console_latency >= 0)
+		msg_queue_set_latency(&session->queue, console_latency);
+	if (handover->compress)
+		msg_queue_compress(&session->queue);
+
+	session_watch(session);
+
+	/* The board failed while the client was away, see board_lost() */
+	if (!session->device) {
+		free(handover);
+		session_warnx(session, "board was lost, unable to resume");
+		cdba_send(session, MSG_SESSION_RESUME, NULL, 0);
+		session_close(session);
+		return;
+	}
+
+	start = MAX(handover->offset, replay_start(session->replay));
+	start = MIN(start, session->console_offset);
+	if (start > handover->offset)
+		session_warnx(session, "%llu bytes of console output lost",
+			      (unsigned long long)(start - handover->offset));
+
+	free(handover);
+
+	cdba_send(session, MSG_SESSION_RESUME, &start, sizeof(start));
+
+	/* Replayed as is, it was filtered when first sent */
+	for (offset = start; (n = replay_read(session->replay, offset, buf, sizeof(buf))); offset += n)
+		msg_queue_push(&session->queue, MSG_CONSOLE, buf, n);
+
+	warnx("client of %s resumed", session->device->board);
+
+	session_process(session);
+}
+
+/*
+ * Resume a held session, the client's connection is handed over to it and
+ * this session ends.
+ *
+ * Return: true if the session is gone, false if it failed to resume
+ */
+static bool msg_session_resume(struct session *session, const void *data, size_t len)
+{
+	const struct session_resume *req = data;
+	struct session_handover *handover;
+	struct session *held = NULL;
+	struct session *iter;
+	unsigned int shard;
 	int ret;
 
-	ret = circ_fill(STDIN_FILENO, &recv_buf);
-	if (ret < 0 && errno != EAGAIN) {
-		fprintf(stderr, "read %d\n", ret);
-		return -1;
+	if (len <= sizeof(*req) || !memchr(req->token, '\0', len - sizeof(*req))) {
+		session_warnx(session, "malformed session resume request");
+		session_close(session);
+		return false;
+	}
+
+	/* Replies, e.g. to MSG_COMPRESS, must not be cut short by the handover */
+	msg_queue_flush(&session->queue);
+	if (session->device || session->waiting || !msg_queue_empty(&session->queue)) {
+		session_warnx(session, "sessions must be resumed before anything else");
+		session_close(session);
+		return false;
+	}
+
+	pthread_mutex_lock(&held_lock);
+	list_for_each_entry(iter, &held_sessions, held_node) {
+		/* Sessions whose board was lost await expiry, see board_lost() */
+		if (!iter->claimed && iter->device &&
+		    !strcmp(iter->token, req->token)) {
+			held = iter;
+			held->claimed = true;
+			shard = held->device->shard;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&held_lock);
+
+	if (!held) {
+		session_warnx(session, "no session to resume");
+		cdba_send(session, MSG_SESSION_RESUME, NULL, 0);
+		session_close(session);
+		return false;
+	}
+
+	handover = calloc(1, sizeof(*handover));
+	if (!handover)
+		err(1, "failed to allocate session handover");
+
+	handover->session = held;
+	handover->in_fd = session->in_fd;
+	handover->out_fd = session->out_fd;
+	handover->err_fd = session->err_fd;
+	handover->conn_fd = session->conn_fd;
+	handover->channel = session->channel;
+	handover->recv_buf = session->recv_buf;
+	handover->filter = session->filter;
+	handover->record = session->record;
+	handover->compress = session->queue.deflate != NULL;
+	handover->offset = req->offset;
+
+	session_unwatch(session);
+	session_lease_suspend(session);
+	msg_queue_release(&session->queue);
+	list_del(&session->node);
+	free(session->fastboot_payload);
+	free(session);
+
+	if (shard == shard_self()) {
+		session_reattach(handover);
+		return true;
 	}
 
-	for (;;) {
-		n = circ_peak(&recv_buf, &hdr, sizeof(hdr));
+	ret = shard_submit(shard, session_reattach, handover);
+	if (ret < 0) {
+		dprintf(handover->err_fd, "cdba-server: failed to resume session: %s\n",
+			strerror(-ret));
+
+		close(handover->in_fd);
+		close(handover->out_fd);
+		close(handover->err_fd);
+		if (handover->conn_fd >= 0)
+			close(handover->conn_fd);
+		circ_free(&handover->recv_buf);
+		if (handover->filter)
+			filter_free(handover->filter);
+		free(handover);
+
+		/*
+		 * Left for the client to try again, the held session's thread
+		 * expires it otherwise, see session_hold_expired().
+		 */
+		pthread_mutex_lock(&held_lock);
+		held->claimed = false;
+		pthread_mutex_unlock(&held_lock);
+	}
+
+	return true;
+}
+
+static void invoke_reply(struct session *session, int reply)
+{
+	cdba_send(session, reply, NULL, 0);
+}
+
+static void session_process(struct session *session)
+{
+	static __thread uint8_t scratch[CIRC_BUF_SIZE];
+	struct circ_buf *recv_buf = &session->recv_buf;
+	struct device *device;
+	struct msg *msg;
+	struct msg hdr;
+	size_t n;
+
+	while (!session->closing) {
+		n = circ_peak(recv_buf, &hdr, sizeof(hdr));
 		if (n != sizeof(hdr))
-			return 0;
+			return;
+
+		/* Taken on the header alone, frames may exceed our buffer */
+		if (hdr.type == MSG_CHANNEL) {
+			if (session_mux(session))
+				return;
+			continue;
+		}
+
+		if (sizeof(*msg) + hdr.len >= sizeof(scratch)) {
+			session_warnx(session, "message too large: %d", hdr.len);
+			session_close(session);
+			return;
+		}
 
-		if (CIRC_AVAIL(&recv_buf) < sizeof(*msg) + hdr.len)
-			return 0;
+		if (CIRC_AVAIL(recv_buf) < sizeof(*msg) + hdr.len)
+			return;
+
+		/*
+		 * Parse the message in place when it's contiguous in the ring,
+		 * it remains valid until the next circ_fill().
+		 */
+		msg = circ_linear(recv_buf, sizeof(*msg) + hdr.len);
+		if (msg) {
+			circ_skip(recv_buf, sizeof(*msg) + hdr.len);
+		} else {
+			msg = (struct msg *)scratch;
+			circ_read(recv_buf, msg, sizeof(*msg) + hdr.len);
+		}
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(&recv_buf, msg, sizeof(*msg) + hdr.len);
+		device = session->device;
 
 		switch (msg->type) {
 		case MSG_CONSOLE:
-			device_write(selected_device, msg->data, msg->len);
+			device_write(device, msg->data, msg->len);
 			break;
 		case MSG_FASTBOOT_PRESENT:
 			break;
 		case MSG_SELECT_BOARD:
-			msg_select_board(msg->data);
+			if (msg_select_board(session, msg->data))
+				return;
 			break;
 		case MSG_HARDRESET:
 			// fprintf(stderr, "hard reset\n");
 			break;
 		case MSG_POWER_ON:
-			device_power(selected_device, true);
+			device_power(device, true);
 
-			invoke_reply(MSG_POWER_ON);
+			invoke_reply(session, MSG_POWER_ON);
 			break;
 		case MSG_POWER_OFF:
-			device_power(selected_device, false);
+			device_power(device, false);
 
-			invoke_reply(MSG_POWER_OFF);
+			invoke_reply(session, MSG_POWER_OFF);
 			break;
 		case MSG_FASTBOOT_DOWNLOAD:
-			msg_fastboot_download(msg->data, msg->len);
+			msg_fastboot_download(session, msg->data, msg->len);
 			break;
 		case MSG_FASTBOOT_BOOT:
 			// fprintf(stderr, "fastboot boot\n");
 			break;
 		case MSG_STATUS_UPDATE:
-			device_print_status(selected_device);
+			if (device)
+				device_print_status(device);
 			break;
 		case MSG_VBUS_ON:
-			device_usb(selected_device, true);
+			if (device)
+				device_usb(device, true);
 			break;
 		case MSG_VBUS_OFF:
-			device_usb(selected_device, false);
+			if (device)
+				device_usb(device, false);
 			break;
 		case MSG_SEND_BREAK:
-			device_send_break(selected_device);
+			if (device)
+				device_send_break(device);
 			break;
 		case MSG_LIST_DEVICES:
-			device_list_devices();
+			device_list_devices(session);
 			break;
 		case MSG_BOARD_INFO:
-			device_info(msg->data, msg->len);
+			device_info(session, msg->data, msg->len);
+			break;
+		case MSG_HEARTBEAT:
+			msg_heartbeat(session, msg->data, msg->len);
+			break;
+		case MSG_COMPRESS:
+			msg_compress(session, msg->data, msg->len);
+			break;
+		case MSG_CONSOLE_FILTER:
+			msg_console_filter(session, msg->data, msg->len);
+			break;
+		case MSG_SESSION_KEEP:
+			msg_session_keep(session, msg->data, msg->len);
+			break;
+		case MSG_SESSION_RESUME:
+			if (msg_session_resume(session, msg->data, msg->len))
+				return;
 			break;
 		default:
-			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
-			exit(1);
+			session_warnx(session, "unk %d len %d", msg->type, msg->len);
+			session_close(session);
+			break;
 		}
+	}
+}
+
+static int session_input(int fd, unsigned int revents, void *data)
+{
+	struct session *session = data;
+	int ret;
 
-		free(msg);
+	ret = circ_fill(fd, &session->recv_buf);
+	if (ret < 0 && errno != EAGAIN) {
+		session_lost(session);
+		return 0;
 	}
 
+	session_process(session);
+
 	return 0;
 }
 
-struct watch {
-	struct list_head node;
+/* Invoked in the shard's thread for sessions handed over by session_migrate() */
+static void session_resume(void *data)
+{
+	struct session *session = data;
+	struct device *device = session->migrating;
 
-	int fd;
-	int (*cb)(int, void*);
-	void *data;
-};
+	session->migrating = NULL;
 
-struct timer {
-	struct list_head node;
-	struct timeval tv;
+	session_track(session);
+	session_watch(session);
+	session_lease_resume(session);
+	msg_queue_attach(&session->queue);
 
-	void (*cb)(void *);
-	void *data;
-};
+	msg_select_board(session, device->board);
 
-static struct list_head read_watches = LIST_INIT(read_watches);
-static struct list_head timer_watches = LIST_INIT(timer_watches);
+	/* Anything the client sent after selecting the board */
+	session_process(session);
+}
 
-void watch_add_readfd(int fd, int (*cb)(int, void*), void *data)
+static void shard_stopped(void)
 {
-	struct watch *w;
-
-	w = calloc(1, sizeof(*w));
-	w->fd = fd;
-	w->cb = cb;
-	w->data = data;
-
-	list_add(&read_watches, &w->node);
+	device_close_all(shard_self());
 }
 
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+static void board_removed(struct device *device)
 {
-	struct timeval tv_timeout;
-	struct timeval now;
-	struct timer *t;
+	int ret;
 
-	t = calloc(1, sizeof(*t));
+	if (!device->shard) {
+		board_retire(device);
+		return;
+	}
 
-	gettimeofday(&now, NULL);
+	ret = shard_submit(device->shard, board_retire, device);
+	if (ret < 0)
+		warnx("failed to retire %s: %s", device->board, strerror(-ret));
+}
 
-	tv_timeout.tv_sec = timeout_ms / 1000;
-	tv_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+static int session_hangup(int fd, unsigned int revents, void *data)
+{
+	struct session *session = data;
 
-	t->cb = cb;
-	t->data = data;
-	timeradd(&now, &tv_timeout, &t->tv);
+	/* The relay went away, taking the client with it */
+	session_lost(session);
 
-	list_add(&timer_watches, &t->node);
+	return 0;
 }
 
-static struct timeval *watch_timer_next(void)
+static struct session *session_new(int in_fd, int out_fd, int err_fd, int conn_fd)
 {
-	static struct timeval timeout;
-	struct timeval now;
-	struct timer *next;
-	struct timer *t;
-	int count = 0;
+	struct session *session;
+	int flags;
 
-	if (list_empty(&timer_watches))
-		return NULL;
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		err(1, "failed to allocate session");
 
-	next = list_entry_first(&timer_watches, struct timer, node);
+	session->in_fd = in_fd;
+	session->out_fd = out_fd;
+	session->err_fd = err_fd;
+	session->conn_fd = conn_fd;
 
-	list_for_each_entry(t, &timer_watches, node) {
-		if (timercmp(&t->tv, &next->tv, <))
-			next = t;
-		count++;
-	}
+	circ_init(&session->recv_buf, CIRC_BUF_SIZE);
 
-	gettimeofday(&now, NULL);
-	timersub(&next->tv, &now, &timeout);
-	if (timeout.tv_sec < 0) {
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
+	flags = fcntl(in_fd, F_GETFL, 0);
+	fcntl(in_fd, F_SETFL, flags | O_NONBLOCK);
+
+	session_watch(session);
+
+	msg_queue_init(&session->queue, out_fd);
+	if (console_latency >= 0)
+		msg_queue_set_latency(&session->queue, console_latency);
+
+	session_track(session);
+
+	return session;
+}
+
+static void session_free(void *data)
+{
+	struct session *session = data;
+
+	session_lease_suspend(session);
+	session_lock_cancel(session);
+	msg_queue_release(&session->queue);
+
+	if (session->grace_timer)
+		watch_timer_cancel(session->grace_timer);
+
+	list_del(&session->node);
+
+	if (session->held) {
+		/* The client's connection went away earlier */
+	} else if (session->channel) {
+		/* Hangs up the channel, the mux tells the client */
+		close(session->in_fd);
+		close(session->out_fd);
+		close(session->err_fd);
+	} else if (session->conn_fd >= 0) {
+		close(session->in_fd);
+		close(session->out_fd);
+		close(session->err_fd);
+
+		/* Lets the relay, and with it the ssh session, exit */
+		close(session->conn_fd);
+	} else {
+		watch_quit();
 	}
 
-	return &timeout;
+	if (session->filter)
+		filter_free(session->filter);
+	if (session->replay)
+		replay_free(session->replay);
+
+	circ_free(&session->recv_buf);
+	free(session->fastboot_payload);
+	free(session);
 }
 
-static void watch_timer_invoke(void)
+/*
+ * Release the session's board and stop reading from the client, the session
+ * is freed once the replies queued so far have been written out.
+ */
+static void session_close(struct session *session)
 {
-	struct timeval now;
-	struct timer *tmp;
-	struct timer *t;
+	if (session->closing)
+		return;
 
-	gettimeofday(&now, NULL);
+	session->closing = true;
+	session->waiting = NULL;
+	session_lock_cancel(session);
 
-	list_for_each_entry_safe(t, tmp, &timer_watches, node) {
-		if (timercmp(&t->tv, &now, <)) {
-			t->cb(t->data);
+	session_unwatch(session);
 
-			list_del(&t->node);
-			free(t);
-		}
-	}
+	session_detach(session);
+
+	msg_queue_close(&session->queue, session_free, session);
+}
+
+static void relay_attached(int conn, int fds[3])
+{
+	session_new(fds[0], fds[1], fds[2], conn);
 }
 
-static void sigpipe_handler(int signo)
+static void quit_handler(int signo)
 {
-	quit_invoked = true;
+	watch_quit();
 }
 
-void watch_quit(void)
+static void reload_handler(int signo)
 {
-	quit_invoked = true;
+	reload_request();
+}
+
+static void usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-d [-j <threads>] [-a]] [-s <socket>] [-L <console-latency-ms>] [-H <lease-timeout>] [-R <record-dir>] [-G <max-hold>]\n",
+		__progname);
+	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	struct timeval *timeoutp;
-	struct watch *w;
-	fd_set rfds;
-	int flags;
-	int nfds;
+	const char *socket_path = NULL;
+	const char *config_path = ".cdba";
+	char default_socket[PATH_MAX];
+	unsigned int shards = 0;
+	bool affinity = false;
+	int opt;
 	int ret;
 
-	signal(SIGPIPE, sigpipe_handler);
+	while ((opt = getopt(argc, argv, "adG:H:j:L:R:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			affinity = true;
+			break;
+		case 'd':
+			daemon_mode = true;
+			break;
+		case 'G':
+			hold_max = atoi(optarg);
+			break;
+		case 'H':
+			lease_timeout = atoi(optarg);
+			break;
+		case 'j':
+			shards = atoi(optarg);
+			break;
+		case 'L':
+			console_latency = atoi(optarg);
+			break;
+		case 'R':
+			record_dir = optarg;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!socket_path) {
+		ret = relay_socket_path(default_socket, sizeof(default_socket));
+		if (ret < 0 && daemon_mode)
+			errx(1, "no safe place for the daemon socket: %s", strerror(-ret));
+
+		socket_path = ret < 0 ? NULL : default_socket;
+	}
 
-	ret = device_parser(".cdba");
+	/* Hand the session to a running daemon, if there is one */
+	if (!daemon_mode && socket_path)
+		relay_run(socket_path);
+
+	if (daemon_mode) {
+		/* Sessions come and go, a dead client must not take us down */
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGINT, quit_handler);
+		signal(SIGTERM, quit_handler);
+	} else {
+		signal(SIGPIPE, quit_handler);
+	}
+
+	ret = device_parser(config_path);
 	if (ret) {
-		ret = device_parser("/etc/cdba");
+		config_path = "/etc/cdba";
+		ret = device_parser(config_path);
 		if (ret) {
 			fprintf(stderr, "device parser: unable to open config file\n");
 			exit(1);
 		}
 	}
 
-	watch_add_readfd(STDIN_FILENO, handle_stdin, NULL);
-
-	flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
-
-	while (!quit_invoked) {
-		nfds = 0;
+	if (daemon_mode && shards) {
+		device_distribute(shards);
+		shard_init(shards, affinity, shard_stopped);
+	}
 
-		list_for_each_entry(w, &read_watches, node) {
-			nfds = MAX(nfds, w->fd);
-			FD_SET(w->fd, &rfds);
-		}
+	if (daemon_mode) {
+		ret = reload_init(config_path, board_removed);
+		if (ret < 0)
+			warnx("board database reload unavailable: %s", strerror(-ret));
 
-		if (!FD_ISSET(STDIN_FILENO, &rfds)) {
-			fprintf(stderr, "rfds is trash!\n");
-			goto done;
-		}
+		signal(SIGHUP, reload_handler);
+	}
 
-		timeoutp = watch_timer_next();
-		ret = select(nfds + 1, &rfds, NULL, NULL, timeoutp);
-		if (ret < 0 && errno == EINTR)
-			continue;
-		else if (ret < 0)
-			break;
+	if (daemon_mode) {
+		ret = relay_listen(socket_path, relay_attached);
+		if (ret < 0)
+			errx(1, "unable to listen on %s: %s", socket_path, strerror(-ret));
+	} else {
+		session_new(STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1);
+	}
 
-		watch_timer_invoke();
+	watch_run();
 
-		list_for_each_entry(w, &read_watches, node) {
-			if (FD_ISSET(w->fd, &rfds)) {
-				ret = w->cb(w->fd, w->data);
-				if (ret < 0) {
-					fprintf(stderr, "cb returned %d\n", ret);
-					goto done;
-				}
-			}
-		}
-	}
+	if (daemon_mode && shards)
+		shard_stop();
 
-done:
+	device_close_all(0);
 
-	if (selected_device)
-		device_close(selected_device);
+	if (daemon_mode)
+		unlink(socket_path);
 
 	return 0;
 }
@@ -5,13 +5,14 @@
 #include <termios.h>
 
 #include "cdba.h"
+#include "watch.h"
 
-void watch_add_readfd(int fd, int (*cb)(int, void*), void *data);
-int watch_add_quit(int (*cb)(int, void*), void *data);
-void watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
-void watch_quit(void);
-int watch_run(void);
+struct device;
+struct session;
 
 int tty_open(const char *tty, struct termios *old);
+int cdba_send(struct session *session, int type, const void *data, size_t len);
+void session_warnx(struct session *session, const char *fmt, ...);
+void board_lost(struct device *device, const char *reason);
 
 #endif
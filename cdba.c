@@ -28,10 +28,12 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <alloca.h>
 #include <err.h>
@@ -40,18 +42,32 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "agent.h"
 #include "cdba.h"
 #include "circ_buf.h"
 #include "list.h"
+#include "sink.h"
+
+#define ARRAY_SIZE(x) ((sizeof(x)/sizeof((x)[0])))
 
 static bool quit;
 static bool fastboot_repeat;
 static bool fastboot_done;
 
+/* Token of the session held by the server for us to resume, see -D */
+static char session_token[SESSION_TOKEN_LEN + 1];
+static uint64_t console_received;
+static bool detach;
+
 static const char *fastboot_file;
 
 static struct termios *tty_unbuffer(void)
@@ -93,8 +109,37 @@ static void tty_reset(struct termios *orig_tios)
 		warn("unable to reset tty tios");
 }
 
+/*
+ * Boards attached to this machine are reached by running the server directly,
+ * sparing the ssh handshake, encryption and the extra process relaying every
+ * byte. A host naming another user is left to ssh.
+ */
+static bool host_is_local(const char *host)
+{
+	char name[256];
+	size_t len;
+
+	if (!strcmp(host, "localhost") || !strcmp(host, "127.0.0.1") ||
+	    !strcmp(host, "::1"))
+		return true;
+
+	if (gethostname(name, sizeof(name)) < 0)
+		return false;
+	name[sizeof(name) - 1] = '\0';
+
+	if (!strcmp(host, name))
+		return true;
+
+	/* The short form of our name */
+	len = strcspn(name, ".");
+	return strlen(host) == len && !strncmp(host, name, len);
+}
+
 static int fork_ssh(const char *host, const char *cmd, int *pipes)
 {
+	const char *home;
+	bool local = host_is_local(host);
+
 	int piped_stdin[2];
 	int piped_stdout[2];
 	int piped_stderr[2];
@@ -124,6 +169,16 @@ static int fork_ssh(const char *host, const char *cmd, int *pipes)
 		close(piped_stderr[0]);
 		close(piped_stderr[1]);
 
+		if (local) {
+			/* Like ssh, run the command from the home directory */
+			home = getenv("HOME");
+			if (home && chdir(home) < 0)
+				err(1, "unable to enter \"%s\"", home);
+
+			execl("/bin/sh", "sh", "-c", cmd, NULL);
+			err(1, "launching server failed");
+		}
+
 		execl("/usr/bin/ssh", "ssh", host, cmd, NULL);
 		err(1, "launching ssh failed");
 	default:
@@ -144,11 +199,334 @@ static int fork_ssh(const char *host, const char *cmd, int *pipes)
 	return 0;
 }
 
-static int tty_callback(int *ssh_fds)
+/*
+ * Requests to the server are queued by class. Control requests always go
+ * first, console input and bulk transfers share what's left, see
+ * work_dispatch().
+ */
+enum {
+	WORK_CONTROL,
+	WORK_CONSOLE,
+	WORK_BULK,
+	WORK_CLASS_COUNT,
+};
+
+/* Bytes per round of the console and bulk classes, split by bulk_share */
+#define WORK_QUANTUM		4096
+
+/* Without acknowledgements, bulk data waits while this much is in the pipe */
+#define WORK_BULK_BACKLOG	(16 * 1024)
+
+/*
+ * Unacknowledged bulk data allowed in flight, once the server acknowledges;
+ * kept small while the user is typing, so keystrokes don't queue behind it
+ */
+#define WORK_BULK_WINDOW	(32 * 1024)
+#define WORK_BULK_WINDOW_IDLE	(1024 * 1024)
+#define WORK_INTERACTIVE_MS	1000
+
+/* Retry interval for bulk data held back by WORK_BULK_BACKLOG */
+#define WORK_BULK_POLL_MS	10
+
+struct work {
+	/*
+	 * Return: 0 when done, 1 if there's more to send, -EAGAIN if nothing
+	 * was sent; the work is freed, or reused, by the callee when done
+	 */
+	int (*fn)(struct work *work, int ssh_stdin);
+
+	struct list_head node;
+};
+
+static struct list_head work_items[WORK_CLASS_COUNT] = {
+	LIST_INIT(work_items[WORK_CONTROL]),
+	LIST_INIT(work_items[WORK_CONSOLE]),
+	LIST_INIT(work_items[WORK_BULK]),
+};
+
+/* Percentage of the link given to bulk transfers while console input waits */
+static unsigned int bulk_share = 50;
+
+static uint32_t bulk_sent;
+static uint32_t bulk_acked;
+static bool bulk_acks;
+
+/* Time of the last console input */
+static struct timeval console_tv;
+
+static size_t work_sent;
+static bool work_blocked;
+
+static void work_queue(struct work *work, int class)
+{
+	list_add(&work_items[class], &work->node);
+}
+
+static ssize_t work_write(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	n = write(fd, buf, len);
+	if (n > 0)
+		work_sent += n;
+	else if (n < 0 && errno == EAGAIN)
+		work_blocked = true;
+
+	return n;
+}
+
+static uint32_t work_bulk_window(void)
+{
+	struct timeval now;
+	struct timeval tv;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &console_tv, &tv);
+
+	if (tv.tv_sec * 1000 + tv.tv_usec / 1000 < WORK_INTERACTIVE_MS)
+		return WORK_BULK_WINDOW;
+
+	return WORK_BULK_WINDOW_IDLE;
+}
+
+static bool work_bulk_ready(int fd)
+{
+	int queued;
+
+	/* Servers acknowledging bulk data let us bound what's in flight */
+	if (bulk_acks)
+		return bulk_sent - bulk_acked < work_bulk_window();
+
+	if (ioctl(fd, FIONREAD, &queued) < 0)
+		return true;
+
+	return queued < WORK_BULK_BACKLOG;
+}
+
+static bool work_ready(int class, int fd)
+{
+	if (list_empty(&work_items[class]))
+		return false;
+
+	return class != WORK_BULK || work_bulk_ready(fd);
+}
+
+/* True if bulk data is held back only by what's queued in the pipe */
+static bool work_bulk_polled(int fd)
+{
+	return !bulk_acks && !list_empty(&work_items[WORK_BULK]) &&
+	       !work_bulk_ready(fd);
+}
+
+static bool work_pending(int fd)
+{
+	int class;
+
+	for (class = 0; class < WORK_CLASS_COUNT; class++) {
+		if (work_ready(class, fd))
+			return true;
+	}
+
+	return false;
+}
+
+static void work_run(int class, int fd)
+{
+	struct list_head *head = &work_items[class];
+	struct work *work;
+	int ret;
+
+	work = list_entry_first(head, struct work, node);
+	list_del(&work->node);
+
+	ret = work->fn(work, fd);
+
+	/* Keep it at the front of its class, to preserve the order */
+	if (ret)
+		list_add(head->next, &work->node);
+}
+
+/*
+ * Send queued requests, control first. Console input and bulk transfers are
+ * then served by deficit round robin, bulk getting bulk_share percent of the
+ * bytes written while both have data to send.
+ */
+static void work_dispatch(int fd);
+
+/* Push out the control requests still queued, e.g. as we exit */
+static void work_flush_control(int fd)
+{
+	struct timeval tv = { 1, 0 };
+	fd_set wfds;
+
+	while (!list_empty(&work_items[WORK_CONTROL])) {
+		FD_ZERO(&wfds);
+		FD_SET(fd, &wfds);
+
+		if (select(fd + 1, NULL, &wfds, NULL, &tv) <= 0)
+			break;
+
+		work_dispatch(fd);
+	}
+}
+
+static void work_dispatch(int fd)
+{
+	static ssize_t deficit[WORK_CLASS_COUNT];
+	ssize_t quantum[WORK_CLASS_COUNT];
+	bool progress;
+	size_t sent;
+	int class;
+
+	work_blocked = false;
+
+	while (!work_blocked && !list_empty(&work_items[WORK_CONTROL]))
+		work_run(WORK_CONTROL, fd);
+
+	quantum[WORK_CONSOLE] = MAX(1, WORK_QUANTUM * (100 - bulk_share) / 100);
+	quantum[WORK_BULK] = MAX(1, WORK_QUANTUM * bulk_share / 100);
+
+	do {
+		progress = false;
+
+		for (class = WORK_CONSOLE; class < WORK_CLASS_COUNT; class++) {
+			if (work_blocked)
+				return;
+
+			if (!work_ready(class, fd)) {
+				deficit[class] = 0;
+				continue;
+			}
+
+			deficit[class] += quantum[class];
+			while (deficit[class] > 0 && !work_blocked &&
+			       work_ready(class, fd)) {
+				sent = work_sent;
+				work_run(class, fd);
+				deficit[class] -= work_sent - sent;
+				progress = true;
+			}
+		}
+	} while (progress);
+}
+
+struct msg_work {
+	struct work work;
+
+	/* Length of the frame in buf, and room for it to grow */
+	size_t len;
+	size_t size;
+	/* Bytes of the frame already written */
+	size_t offset;
+	uint8_t buf[];
+};
+
+static int msg_work_fn(struct work *work, int ssh_stdin)
+{
+	struct msg_work *mw = container_of(work, struct msg_work, work);
+	ssize_t n;
+
+	n = work_write(ssh_stdin, mw->buf + mw->offset, mw->len - mw->offset);
+	if (n < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (n < 0)
+		err(1, "failed to send request");
+
+	/*
+	 * Frames above PIPE_BUF, such as console filters, may be written in
+	 * parts. Staying at the head of the control class, which is drained
+	 * before any other, nothing gets in between.
+	 */
+	mw->offset += n;
+	if (mw->offset < mw->len)
+		return 1;
+
+	free(mw);
+
+	return 0;
+}
+
+static struct msg_work *msg_work_alloc(int type, size_t size)
+{
+	struct msg_work *mw;
+	struct msg *msg;
+
+	mw = malloc(sizeof(*mw) + sizeof(*msg) + size);
+	if (!mw)
+		err(1, "failed to allocate request");
+
+	mw->work.fn = msg_work_fn;
+	mw->len = sizeof(*msg);
+	mw->size = sizeof(*msg) + size;
+	mw->offset = 0;
+
+	msg = (struct msg *)mw->buf;
+	msg->type = type;
+	msg->len = 0;
+
+	return mw;
+}
+
+static void msg_work_append(struct msg_work *mw, const void *data, size_t len)
+{
+	struct msg *msg = (struct msg *)mw->buf;
+
+	memcpy(mw->buf + mw->len, data, len);
+	mw->len += len;
+	msg->len += len;
+}
+
+static void request_msg(int class, int type, const void *data, size_t len)
+{
+	struct msg_work *mw;
+
+	mw = msg_work_alloc(type, len);
+	msg_work_append(mw, data, len);
+
+	work_queue(&mw->work, class);
+}
+
+/*
+ * Console input is appended to the last console frame still queued, frames
+ * are kept below PIPE_BUF so that they're written atomically.
+ */
+#define CONSOLE_FRAME_MAX	2048
+
+static bool predict_echo;
+static void predict_input(const char *data, size_t len);
+
+static void request_console(const void *data, size_t len)
+{
+	struct list_head *head = &work_items[WORK_CONSOLE];
+	struct msg_work *mw;
+	size_t n;
+
+	if (predict_echo)
+		predict_input(data, len);
+
+	while (len) {
+		mw = NULL;
+		if (!list_empty(head))
+			mw = container_of(head->prev, struct msg_work, work.node);
+
+		if (!mw || mw->len == mw->size) {
+			mw = msg_work_alloc(MSG_CONSOLE, CONSOLE_FRAME_MAX);
+			work_queue(&mw->work, WORK_CONSOLE);
+		}
+
+		n = MIN(len, mw->size - mw->len);
+		msg_work_append(mw, data, n);
+
+		data += n;
+		len -= n;
+	}
+}
+
+static int tty_callback(void)
 {
 	static bool special;
-	struct msg hdr;
-	char buf[32];
+	char buf[4096];
+	ssize_t start = 0;
 	ssize_t k;
 	ssize_t n;
 
@@ -156,202 +534,171 @@ static int tty_callback(int *ssh_fds)
 	if (n < 0)
 		return n;
 
+	gettimeofday(&console_tv, NULL);
+
+	/* Runs of ordinary input between escapes are sent as one frame */
 	for (k = 0; k < n; k++) {
-		if (buf[k] == 0x1) {
-			special = true;
-		} else if (special) {
+		if (special) {
 			switch (buf[k]) {
 			case 'q':
 				quit = true;
 				break;
+			case 'd':
+				detach = true;
+				quit = true;
+				break;
 			case 'P':
-				hdr.type = MSG_POWER_ON;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(WORK_CONTROL, MSG_POWER_ON, NULL, 0);
 				break;
 			case 'p':
-				hdr.type = MSG_POWER_OFF;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(WORK_CONTROL, MSG_POWER_OFF, NULL, 0);
 				break;
 			case 's':
-				hdr.type = MSG_STATUS_UPDATE;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(WORK_CONTROL, MSG_STATUS_UPDATE, NULL, 0);
 				break;
 			case 'V':
-				hdr.type = MSG_VBUS_ON;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(WORK_CONTROL, MSG_VBUS_ON, NULL, 0);
 				break;
 			case 'v':
-				hdr.type = MSG_VBUS_OFF;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(WORK_CONTROL, MSG_VBUS_OFF, NULL, 0);
 				break;
 			case 'a':
-				hdr.type = MSG_CONSOLE;
-				hdr.len = 1;
-
-				write(ssh_fds[0], &hdr, sizeof(hdr));
-				write(ssh_fds[0], "\001", 1);
+				request_console("\001", 1);
 				break;
 			case 'B':
-				hdr.type = MSG_SEND_BREAK;
-				hdr.len = 0;
-				write(ssh_fds[0], &hdr, sizeof(hdr));
+				request_msg(WORK_CONTROL, MSG_SEND_BREAK, NULL, 0);
 				break;
 			}
 
 			special = false;
-		} else {
-			hdr.type = MSG_CONSOLE;
-			hdr.len = 1;
-
-			write(ssh_fds[0], &hdr, sizeof(hdr));
-			write(ssh_fds[0], buf + k, 1);
+			start = k + 1;
+		} else if (buf[k] == 0x1) {
+			request_console(buf + start, k - start);
+			special = true;
 		}
 	}
 
+	if (!special)
+		request_console(buf + start, n - start);
+
 	return 0;
 }
 
-struct work {
-	void (*fn)(struct work *work, int ssh_stdin);
-
-	struct list_head node;
-};
-
-static struct list_head work_items = LIST_INIT(work_items);
-
-static void list_boards_fn(struct work *work, int ssh_stdin)
+static void request_board_list(void)
 {
-	struct msg msg;
-	ssize_t n;
-
-	msg.type = MSG_LIST_DEVICES;
-	msg.len = 0;
-
-	n = write(ssh_stdin, &msg, sizeof(msg));
-	if (n < 0)
-		err(1, "failed to send board list request");
-
-	free(work);
+	request_msg(WORK_CONTROL, MSG_LIST_DEVICES, NULL, 0);
 }
 
-static void request_board_list(void)
+static void request_compress(void)
 {
-	struct work *work;
-
-	work = malloc(sizeof(*work));
-	work->fn = list_boards_fn;
+	const uint8_t method = COMPRESS_DEFLATE;
 
-	list_add(&work_items, &work->node);
+	request_msg(WORK_CONTROL, MSG_COMPRESS, &method, 1);
 }
 
-struct board_info_request {
-	struct work work;
-	const char *board;
-};
+static void request_session_keep(uint32_t grace_ms)
+{
+	request_msg(WORK_CONTROL, MSG_SESSION_KEEP, &grace_ms, sizeof(grace_ms));
+}
 
-static void board_info_fn(struct work *work, int ssh_stdin)
+static void request_session_resume(const char *token, uint64_t offset)
 {
-	struct board_info_request *board = container_of(work, struct board_info_request, work);
-	size_t blen = strlen(board->board) + 1;
-	struct msg *msg;
-	ssize_t n;
+	struct session_resume *req;
+	size_t size = sizeof(*req) + strlen(token) + 1;
 
-	msg = alloca(sizeof(*msg) + blen);
-	msg->type = MSG_BOARD_INFO;
-	msg->len = blen;
-	memcpy(msg->data, board->board, blen);
+	req = malloc(size);
+	if (!req)
+		err(1, "failed to allocate resume request");
 
-	n = write(ssh_stdin, msg, sizeof(*msg) + blen);
-	if (n < 0)
-		err(1, "failed to send board info request");
+	req->offset = offset;
+	strcpy(req->token, token);
 
-	free(work);
+	request_msg(WORK_CONTROL, MSG_SESSION_RESUME, req, size);
+
+	free(req);
 }
 
-static void request_board_info(const char *board)
+static void request_console_filter(int mode, int context, bool record,
+				   const char *patterns, size_t len)
 {
-	struct board_info_request *work;
+	struct console_filter *req;
+	size_t size = sizeof(*req) + len;
+	size_t max = CIRC_BUF_SIZE - sizeof(struct msg) - sizeof(*req) - 1;
 
-	work = malloc(sizeof(*work));
-	work->work.fn = board_info_fn;
-	work->board = board;
+	/* The server drops the session on messages exceeding its buffer */
+	if (len > max)
+		errx(1, "console filter patterns too long, %zu bytes at most", max);
 
-	list_add(&work_items, &work->work.node);
-}
+	req = malloc(size);
+	if (!req)
+		err(1, "failed to allocate console filter");
 
-struct select_board {
-	struct work work;
+	req->mode = mode;
+	req->context = context;
+	req->flags = record ? FILTER_RECORD : 0;
+	memcpy(req->patterns, patterns, len);
 
-	const char *board;
-};
+	request_msg(WORK_CONTROL, MSG_CONSOLE_FILTER, req, size);
 
-static void select_board_fn(struct work *work, int ssh_stdin)
-{
-	struct select_board *board = container_of(work, struct select_board, work);
-	size_t blen = strlen(board->board) + 1;
-	struct msg *msg;
-	ssize_t n;
-
-	msg = alloca(sizeof(*msg) + blen);
-	msg->type = MSG_SELECT_BOARD;
-	msg->len = blen;
-	memcpy(msg->data, board->board, blen);
-
-	n = write(ssh_stdin, msg, sizeof(*msg) + blen);
-	if (n < 0)
-		err(1, "failed to send power on request");
+	free(req);
+}
 
-	free(work);
+static void request_board_info(const char *board)
+{
+	request_msg(WORK_CONTROL, MSG_BOARD_INFO, board, strlen(board) + 1);
 }
 
 static void request_select_board(const char *board)
 {
-	struct select_board *work;
-
-	work = malloc(sizeof(*work));
-	work->work.fn = select_board_fn;
-	work->board = board;
-
-	list_add(&work_items, &work->work.node);
+	request_msg(WORK_CONTROL, MSG_SELECT_BOARD, board, strlen(board) + 1);
 }
 
-static void request_power_on_fn(struct work *work, int ssh_stdin)
+static void request_power_on(void)
 {
-	struct msg msg = { MSG_POWER_ON, };
-	ssize_t n;
+	request_msg(WORK_CONTROL, MSG_POWER_ON, NULL, 0);
+}
 
-	n = write(ssh_stdin, &msg, sizeof(msg));
-	if (n < 0)
-		err(1, "failed to send power on request");
+static void request_power_off(void)
+{
+	request_msg(WORK_CONTROL, MSG_POWER_OFF, NULL, 0);
 }
 
-static void request_power_off_fn(struct work *work, int ssh_stdin)
+static unsigned int heartbeat_interval;
+static bool heartbeat_queued;
+
+static int request_heartbeat_fn(struct work *work, int ssh_stdin)
 {
-	struct msg msg = { MSG_POWER_OFF, };
+	struct {
+		struct msg hdr;
+		uint32_t interval_ms;
+	} __packed msg;
 	ssize_t n;
 
-	n = write(ssh_stdin, &msg, sizeof(msg));
-	if (n < 0)
-		err(1, "failed to send power off request");
-}
+	msg.hdr.type = MSG_HEARTBEAT;
+	msg.hdr.len = sizeof(msg.interval_ms);
+	msg.interval_ms = heartbeat_interval * 1000;
 
-static void request_power_on(void)
-{
-	static struct work work = { request_power_on_fn };
+	n = work_write(ssh_stdin, &msg, sizeof(msg));
+	if (n < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (n < 0)
+		err(1, "failed to send heartbeat");
+
+	heartbeat_queued = false;
 
-	list_add(&work_items, &work.node);
+	return 0;
 }
 
-static void request_power_off(void)
+static struct work heartbeat_work = { request_heartbeat_fn };
+
+/* Keeps the server's lease on the board, see cdba-server's -H */
+static void request_heartbeat(void)
 {
-	static struct work work = { request_power_off_fn };
+	if (heartbeat_queued)
+		return;
 
-	list_add(&work_items, &work.node);
+	heartbeat_queued = true;
+	work_queue(&heartbeat_work, WORK_CONTROL);
 }
 
 struct fastboot_download_work {
@@ -362,7 +709,7 @@ struct fastboot_download_work {
 	size_t size;
 };
 
-static void fastboot_work_fn(struct work *_work, int ssh_stdin)
+static int fastboot_work_fn(struct work *_work, int ssh_stdin)
 {
 	struct fastboot_download_work *work = container_of(_work, struct fastboot_download_work, work);
 	struct msg *msg;
@@ -376,21 +723,23 @@ static void fastboot_work_fn(struct work *_work, int ssh_stdin)
 	msg->len = left;
 	memcpy(msg->data, work->data + work->offset, left);
 
-	n = write(ssh_stdin, msg, sizeof(*msg) + msg->len);
-	if (n < 0 && errno == EAGAIN) {
-		list_add(&work_items, &_work->node);
-		return;
-	} else if (n < 0) {
+	n = work_write(ssh_stdin, msg, sizeof(*msg) + msg->len);
+	if (n < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	else if (n < 0)
 		err(1, "failed to write fastboot message");
-	}
 
 	work->offset += msg->len;
+	bulk_sent += msg->len;
 
 	/* We've sent the entire image, and a zero length packet */
-	if (!msg->len)
+	if (!msg->len) {
+		free(work->data);
 		free(work);
-	else
-		list_add(&work_items, &_work->node);
+		return 0;
+	}
+
+	return 1;
 }
 
 static void request_fastboot_files(void)
@@ -413,7 +762,173 @@ static void request_fastboot_files(void)
 	read(fd, work->data, work->size);
 	close(fd);
 
-	list_add(&work_items, &work->work.node);
+	/* The server counts the bytes of each download from zero */
+	bulk_sent = 0;
+	bulk_acked = 0;
+
+	work_queue(&work->work, WORK_BULK);
+}
+
+/* Acknowledgement of the bulk data received so far by the server */
+static void handle_fastboot_download(const void *data, size_t len)
+{
+	if (len != sizeof(bulk_acked))
+		return;
+
+	memcpy(&bulk_acked, data, sizeof(bulk_acked));
+	bulk_acks = true;
+}
+
+/*
+ * Console output is rendered through a sink, so that a slow terminal doesn't
+ * stall the client, and optionally teed losslessly into a log file. In flood
+ * mode console output is dropped, rather than read from the server at the
+ * terminal's pace, once the terminal falls behind.
+ */
+#define OUTPUT_SIZE		(256 * 1024)
+#define OUTPUT_LATENCY_MS	5
+#define LOG_SIZE		(1024 * 1024)
+#define LOG_LATENCY_MS		100
+
+/* Room kept for output other than the console while flooding */
+#define OUTPUT_RESERVE		(2 * CIRC_BUF_SIZE)
+
+static struct sink *output;
+static struct sink *console_log;
+static bool flood_mode;
+static size_t flood_skipped;
+
+static void output_write(const void *data, size_t len)
+{
+	sink_write(output, data, len);
+}
+
+static void output_console(const void *data, size_t len)
+{
+	char note[64];
+	int n;
+
+	if (console_log)
+		sink_write(console_log, data, len);
+
+	if (flood_mode && sink_space(output) < OUTPUT_RESERVE + len) {
+		flood_skipped += len;
+		return;
+	}
+
+	if (flood_skipped) {
+		n = snprintf(note, sizeof(note), "\r\n[cdba: skipped %zu bytes]\r\n",
+			     flood_skipped);
+		output_write(note, n);
+		flood_skipped = 0;
+	}
+
+	output_write(data, len);
+}
+
+/*
+ * With -E typed characters are shown right away, underlined, until the
+ * board's echo catches up. As in mosh, predictions are only shown once the
+ * board has echoed input since the last newline or control character, so
+ * e.g. passwords typed at a prompt that doesn't echo are never displayed.
+ * Console output not matching the predictions discards them.
+ */
+#define PREDICT_MAX	64
+
+static bool predict_confident;
+static bool predict_shown;
+static char predicted[PREDICT_MAX];
+static size_t predicted_len;
+
+/* Put the cursor back where the predictions started, and erase them */
+static void predict_hide(void)
+{
+	if (!predict_shown)
+		return;
+
+	output_write("\0338\033[K", 5);
+	predict_shown = false;
+}
+
+static void predict_show(void)
+{
+	if (!predict_confident || !predicted_len)
+		return;
+
+	output_write("\0337\033[4m", 6);
+	output_write(predicted, predicted_len);
+	output_write("\033[24m", 5);
+	predict_shown = true;
+}
+
+static void predict_reset(void)
+{
+	predict_hide();
+	predicted_len = 0;
+	predict_confident = false;
+}
+
+static void predict_input(const char *data, size_t len)
+{
+	size_t i;
+
+	predict_hide();
+
+	for (i = 0; i < len; i++) {
+		if (data[i] < 0x20 || data[i] >= 0x7f || predicted_len == PREDICT_MAX) {
+			predict_reset();
+			continue;
+		}
+
+		predicted[predicted_len++] = data[i];
+	}
+
+	predict_show();
+}
+
+/* Match console output against the predictions, before it's written out */
+static void predict_console(const char *data, size_t len)
+{
+	size_t i;
+
+	predict_hide();
+
+	for (i = 0; i < len && predicted_len; i++) {
+		if (data[i] != predicted[0]) {
+			predict_reset();
+			break;
+		}
+
+		memmove(predicted, predicted + 1, --predicted_len);
+		predict_confident = true;
+	}
+}
+
+/*
+ * Any message read from the server must fit in the sinks, every read from the
+ * server is held back until there's room for a full receive buffer.
+ */
+static bool output_ready(fd_set *rfds, int *nfds)
+{
+	struct sink *sinks[] = { output, console_log };
+	bool ready = true;
+	int fd;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sinks); i++) {
+		if (!sinks[i] || sink_space(sinks[i]) >= CIRC_BUF_SIZE)
+			continue;
+
+		sink_wait(sinks[i], CIRC_BUF_SIZE);
+
+		fd = sink_wait_fd(sinks[i]);
+		FD_SET(fd, rfds);
+		*nfds = MAX(*nfds, fd);
+
+		ready = false;
+	}
+
+	return ready;
 }
 
 static void handle_status_update(const void *data, size_t len)
@@ -423,7 +938,7 @@ static void handle_status_update(const void *data, size_t len)
 	memcpy(str, data, len);
 	str[len] = '\n';
 
-	write(STDOUT_FILENO, str, len + 1);
+	output_write(str, len + 1);
 }
 
 static void handle_list_devices(const void *data, size_t len)
@@ -438,7 +953,7 @@ static void handle_list_devices(const void *data, size_t len)
 	board = alloca(len + 1);
 	memcpy(board, data, len);
 	board[len] = '\n';
-	write(STDOUT_FILENO, board, len + 1);
+	output_write(board, len + 1);
 }
 
 static void handle_board_info(const void *data, size_t len)
@@ -448,12 +963,33 @@ static void handle_board_info(const void *data, size_t len)
 	info = alloca(len + 1);
 	memcpy(info, data, len);
 	info[len] = '\n';
-	write(STDOUT_FILENO, info, len + 1);
+	output_write(info, len + 1);
 
 	quit = true;
 }
 
+static void handle_session_keep(const void *data, size_t len)
+{
+	char note[128];
+	int n;
+
+	if (!len || ((const char *)data)[len - 1] != '\0' ||
+	    len > sizeof(session_token)) {
+		n = snprintf(note, sizeof(note),
+			     "[cdba: the server can't hold this session]\r\n");
+	} else {
+		memcpy(session_token, data, len);
+		n = snprintf(note, sizeof(note), "[cdba: session %s]\r\n",
+			     session_token);
+	}
+
+	output_write(note, n);
+}
+
 static bool received_power_off;
+
+/* Matches the sequence of 20 tildes looked for by handle_console() */
+#define POWER_OFF_PATTERN	"~{20}"
 static bool reached_timeout;
 
 static void handle_console(const void *data, size_t len)
@@ -462,6 +998,8 @@ static void handle_console(const void *data, size_t len)
 	const char *p = data;
 	int i;
 
+	console_received += len;
+
 	for (i = 0; i < len; i++) {
 		if (*p++ == '~') {
 			if (power_off_chars++ == 19) {
@@ -473,13 +1011,76 @@ static void handle_console(const void *data, size_t len)
 		}
 	}
 
-	write(STDOUT_FILENO, data, len);
+	if (predict_echo)
+		predict_console(data, len);
+
+	output_console(data, len);
+
+	if (predict_echo)
+		predict_show();
+}
+
+/* Compressed console frames held back until the sinks have room again */
+static bool console_held;
+
+#ifdef HAVE_ZLIB
+static z_stream inflate_stream;
+static bool inflate_ready;
+
+static int handle_console_deflate(const void *data, size_t len)
+{
+	uint8_t buf[4096];
+	int ret;
+
+	if (!inflate_ready) {
+		if (inflateInit(&inflate_stream) != Z_OK)
+			errx(1, "failed to set up console decompression");
+		inflate_ready = true;
+	}
+
+	inflate_stream.next_in = (void *)data;
+	inflate_stream.avail_in = len;
+
+	do {
+		inflate_stream.next_out = buf;
+		inflate_stream.avail_out = sizeof(buf);
+
+		ret = inflate(&inflate_stream, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "corrupt console stream\n");
+			return -1;
+		}
+
+		handle_console(buf, sizeof(buf) - inflate_stream.avail_out);
+	} while (!inflate_stream.avail_out);
+
+	return 0;
+}
+#else
+static int handle_console_deflate(const void *data, size_t len)
+{
+	fprintf(stderr, "compressed console stream not supported\n");
+	return -1;
+}
+#endif
+
+/*
+ * output_ready() ensures room for a receive buffer of console data, which
+ * compressed frames may well exceed once inflated.
+ */
+static bool output_room(void)
+{
+	if (sink_space(output) < CIRC_BUF_SIZE)
+		return false;
+
+	return !console_log || sink_space(console_log) >= CIRC_BUF_SIZE;
 }
 
 static bool auto_power_on;
 
 static int handle_message(struct circ_buf *buf)
 {
+	static uint8_t scratch[CIRC_BUF_SIZE];
 	struct msg *msg;
 	struct msg hdr;
 	size_t n;
@@ -489,13 +1090,29 @@ static int handle_message(struct circ_buf *buf)
 		if (n != sizeof(hdr))
 			return 0;
 
+		if (sizeof(*msg) + hdr.len >= sizeof(scratch)) {
+			fprintf(stderr, "message too large: %d\n", hdr.len);
+			return -1;
+		}
+
 		if (CIRC_AVAIL(buf) < sizeof(*msg) + hdr.len)
 			return 0;
 
+		if (hdr.type == MSG_CONSOLE_DEFLATE && !output_room()) {
+			console_held = true;
+			return 0;
+		}
+
 		// fprintf(stderr, "avail: %zd hdr.len: %d\n", CIRC_AVAIL(buf), hdr.len);
 
-		msg = malloc(sizeof(*msg) + hdr.len);
-		circ_read(buf, msg, sizeof(*msg) + hdr.len);
+		/* Parse in place if contiguous, valid until the next circ_fill() */
+		msg = circ_linear(buf, sizeof(*msg) + hdr.len);
+		if (msg) {
+			circ_skip(buf, sizeof(*msg) + hdr.len);
+		} else {
+			msg = (struct msg *)scratch;
+			circ_read(buf, msg, sizeof(*msg) + hdr.len);
+		}
 
 		switch (msg->type) {
 		case MSG_SELECT_BOARD:
@@ -520,7 +1137,7 @@ static int handle_message(struct circ_buf *buf)
 		case MSG_FASTBOOT_PRESENT:
 			if (*(uint8_t*)msg->data) {
 				// printf("======================================== MSG_FASTBOOT_PRESENT(on)\n");
-				if (!fastboot_done || fastboot_repeat)
+				if (fastboot_file && (!fastboot_done || fastboot_repeat))
 					request_fastboot_files();
 				else
 					quit = true;
@@ -531,6 +1148,7 @@ static int handle_message(struct circ_buf *buf)
 			break;
 		case MSG_FASTBOOT_DOWNLOAD:
 			// printf("======================================== MSG_FASTBOOT_DOWNLOAD\n");
+			handle_fastboot_download(msg->data, msg->len);
 			break;
 		case MSG_FASTBOOT_BOOT:
 			// printf("======================================== MSG_FASTBOOT_BOOT\n");
@@ -545,12 +1163,28 @@ static int handle_message(struct circ_buf *buf)
 			handle_board_info(msg->data, msg->len);
 			return -1;
 			break;
+		case MSG_HEARTBEAT:
+			break;
+		case MSG_COMPRESS:
+			break;
+		case MSG_SESSION_KEEP:
+			handle_session_keep(msg->data, msg->len);
+			break;
+		case MSG_SESSION_RESUME:
+			if (msg->len != sizeof(console_received))
+				return -1;
+
+			/* Replay starts here, or later if output was lost */
+			memcpy(&console_received, msg->data, sizeof(console_received));
+			break;
+		case MSG_CONSOLE_DEFLATE:
+			if (handle_console_deflate(msg->data, msg->len) < 0)
+				return -1;
+			break;
 		default:
 			fprintf(stderr, "unk %d len %d\n", msg->type, msg->len);
 			return -1;
 		}
-
-		free(msg);
 	}
 
 	return 0;
@@ -573,12 +1207,17 @@ static void usage(void)
 	extern const char *__progname;
 
 	fprintf(stderr, "usage: %s -b <board> -h <host> [-t <timeout>] "
-			"[-T <inactivity-timeout>] boot.img\n",
+			"[-T <inactivity-timeout>] [-H <heartbeat-interval>] "
+			"[-B <bulk-share>] [-o <console-log>] [-E] [-F] [-z] "
+			"[-e <pattern> [-N <context-lines>]] [-r] [-D <hold-time>] "
+			"boot.img\n",
 			__progname);
 	fprintf(stderr, "usage: %s -i -b <board> -h <host>\n",
 			__progname);
 	fprintf(stderr, "usage: %s -l -h <host>\n",
 			__progname);
+	fprintf(stderr, "usage: %s -A <token>[:<offset>] -h <host> [boot.img]\n",
+			__progname);
 	exit(1);
 }
 
@@ -586,28 +1225,39 @@ enum {
 	CDBA_BOOT,
 	CDBA_LIST,
 	CDBA_INFO,
+	CDBA_RESUME,
 };
 
 int main(int argc, char **argv)
 {
 	bool power_cycle_on_timeout = true;
+	bool compress = false;
+	bool record = false;
+	unsigned int hold = 0;
+	char *resume_offset;
+	char *patterns = NULL;
+	size_t patterns_len = 0;
+	int context = -1;
 	struct timeval timeout_inactivity_tv;
 	struct timeval timeout_total_tv;
+	struct timeval heartbeat_tv;
+	bool wakeup;
 	struct termios *orig_tios;
 	const char *server_binary = "cdba-server";
 	int timeout_inactivity = 0;
 	int timeout_total = 600;
-	struct work *next;
-	struct work *work;
-	struct circ_buf recv_buf = { 0 };
+	struct circ_buf recv_buf;
 	const char *board = NULL;
 	const char *host = NULL;
+	const char *log_file = NULL;
+	int log_fd;
+	struct timeval delta;
 	struct timeval now;
 	struct timeval tv;
 	int power_cycles = 0;
 	struct stat sb;
 	int ssh_fds[3];
-	char buf[128];
+	char buf[4096];
 	fd_set rfds;
 	fd_set wfds;
 	ssize_t n;
@@ -616,26 +1266,79 @@ int main(int argc, char **argv)
 	int opt;
 	int ret;
 
-	while ((opt = getopt(argc, argv, "b:c:C:h:ilRt:S:T:")) != -1) {
+	while ((opt = getopt(argc, argv, "A:b:B:c:C:D:e:EFh:H:ilN:o:rRt:S:T:z")) != -1) {
 		switch (opt) {
+		case 'A':
+			verb = CDBA_RESUME;
+			resume_offset = strchr(optarg, ':');
+			if (resume_offset) {
+				*resume_offset++ = '\0';
+				console_received = strtoull(resume_offset, NULL, 10);
+			}
+			if (strlen(optarg) >= sizeof(session_token))
+				usage();
+			strcpy(session_token, optarg);
+			break;
 		case 'b':
 			board = optarg;
 			break;
+		case 'B':
+			bulk_share = atoi(optarg);
+			if (bulk_share > 100)
+				usage();
+			break;
 		case 'C':
 			power_cycle_on_timeout = false;
 			/* FALLTHROUGH */
 		case 'c':
 			power_cycles = atoi(optarg);
 			break;
+		case 'D':
+			hold = atoi(optarg);
+			break;
+		case 'e':
+			n = strlen(optarg) + 1;
+			patterns = realloc(patterns, patterns_len + n);
+			if (!patterns)
+				err(1, "failed to allocate console filter");
+			memcpy(patterns + patterns_len, optarg, n);
+			patterns_len += n;
+			break;
+		case 'E':
+			predict_echo = true;
+			break;
+		case 'F':
+			flood_mode = true;
+			break;
+		case 'z':
+#ifndef HAVE_ZLIB
+			errx(1, "built without support for compression");
+#endif
+			compress = true;
+			break;
 		case 'h':
 			host = optarg;
 			break;
+		case 'H':
+			heartbeat_interval = atoi(optarg);
+			break;
 		case 'i':
 			verb = CDBA_INFO;
 			break;
 		case 'l':
 			verb = CDBA_LIST;
 			break;
+		case 'N':
+			context = atoi(optarg);
+			if (context < 0 || context > UINT8_MAX)
+				usage();
+			break;
+		case 'o':
+			log_file = optarg;
+			break;
+		case 'r':
+			record = true;
+			break;
 		case 'R':
 			fastboot_repeat = true;
 			break;
@@ -656,6 +1359,28 @@ int main(int argc, char **argv)
 	if (!host)
 		usage();
 
+	if (compress)
+		request_compress();
+
+	if (hold)
+		request_session_keep(hold * 1000);
+
+	if (patterns) {
+		/* Keep the power off sequence coming, see handle_console() */
+		n = strlen(POWER_OFF_PATTERN) + 1;
+		patterns = realloc(patterns, patterns_len + n);
+		if (!patterns)
+			err(1, "failed to allocate console filter");
+		memcpy(patterns + patterns_len, POWER_OFF_PATTERN, n);
+		patterns_len += n;
+
+		request_console_filter(context < 0 ? FILTER_MATCHED : FILTER_CONTEXT,
+				       MAX(context, 0), record, patterns, patterns_len);
+		free(patterns);
+	} else if (record) {
+		request_console_filter(FILTER_FULL, 0, true, "", 0);
+	}
+
 	switch (verb) {
 	case CDBA_BOOT:
 		if (optind >= argc || !board)
@@ -678,9 +1403,33 @@ int main(int argc, char **argv)
 
 		request_board_info(board);
 		break;
+	case CDBA_RESUME:
+		/* The board is booted already, unless an image is given */
+		if (optind < argc)
+			fastboot_file = argv[optind];
+
+		request_session_resume(session_token, console_received);
+		break;
 	}
 
-	ret = fork_ssh(host, server_binary, ssh_fds);
+	circ_init(&recv_buf, CIRC_BUF_SIZE);
+
+	output = sink_open(STDOUT_FILENO, OUTPUT_SIZE, OUTPUT_LATENCY_MS);
+
+	if (log_file) {
+		log_fd = open(log_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (log_fd < 0)
+			err(1, "failed to open \"%s\"", log_file);
+
+		console_log = sink_open(log_fd, LOG_SIZE, LOG_LATENCY_MS);
+	}
+
+	/* Reuse the agent's connection to the host, if it's running */
+	ret = -1;
+	if (!host_is_local(host))
+		ret = agent_connect(host, server_binary, ssh_fds);
+	if (ret < 0)
+		ret = fork_ssh(host, server_binary, ssh_fds);
 	if (ret)
 		err(1, "failed to connect to \"%s\"", host);
 
@@ -688,6 +1437,7 @@ int main(int argc, char **argv)
 
 	timeout_total_tv = get_timeout(timeout_total);
 	timeout_inactivity_tv = get_timeout(timeout_inactivity);
+	heartbeat_tv = get_timeout(0);
 
 	while (!quit) {
 		if (received_power_off || reached_timeout) {
@@ -697,8 +1447,9 @@ int main(int argc, char **argv)
 			if (reached_timeout && !power_cycle_on_timeout)
 				break;
 
-			printf("power cycle (%d left)\n", power_cycles);
-			fflush(stdout);
+			n = snprintf(buf, sizeof(buf), "power cycle (%d left)\n",
+				     power_cycles);
+			output_write(buf, n);
 
 			auto_power_on = true;
 			power_cycles--;
@@ -710,11 +1461,28 @@ int main(int argc, char **argv)
 			timeout_inactivity_tv = get_timeout(timeout_inactivity);
 		}
 
+		if (heartbeat_interval) {
+			gettimeofday(&now, NULL);
+			if (!timercmp(&now, &heartbeat_tv, <)) {
+				request_heartbeat();
+				heartbeat_tv = get_timeout(heartbeat_interval);
+			}
+		}
+
 		FD_ZERO(&rfds);
-		FD_SET(ssh_fds[1], &rfds);
 		FD_SET(ssh_fds[2], &rfds);
 		nfds = MAX(ssh_fds[1], ssh_fds[2]);
 
+		if (output_ready(&rfds, &nfds)) {
+			if (console_held) {
+				console_held = false;
+				if (handle_message(&recv_buf) < 0)
+					break;
+			}
+
+			FD_SET(ssh_fds[1], &rfds);
+		}
+
 		if (orig_tios) {
 			FD_SET(STDIN_FILENO, &rfds);
 
@@ -722,7 +1490,7 @@ int main(int argc, char **argv)
 		}
 
 		FD_ZERO(&wfds);
-		if (!list_empty(&work_items))
+		if (work_pending(ssh_fds[0]))
 			FD_SET(ssh_fds[0], &wfds);
 
 		gettimeofday(&now, NULL);
@@ -732,6 +1500,26 @@ int main(int argc, char **argv)
 			timersub(&timeout_total_tv, &now, &tv);
 		}
 
+		/* Wake up in time for the next heartbeat */
+		wakeup = false;
+		if (heartbeat_interval && timercmp(&heartbeat_tv, &now, >)) {
+			timersub(&heartbeat_tv, &now, &delta);
+			if (timercmp(&delta, &tv, <)) {
+				tv = delta;
+				wakeup = true;
+			}
+		}
+
+		/* Or to check whether the pipe has room for more bulk data */
+		if (work_bulk_polled(ssh_fds[0])) {
+			delta.tv_sec = 0;
+			delta.tv_usec = WORK_BULK_POLL_MS * 1000;
+			if (timercmp(&delta, &tv, <)) {
+				tv = delta;
+				wakeup = true;
+			}
+		}
+
 		ret = select(nfds + 1, &rfds, &wfds, NULL, &tv);
 #if 0
 		printf("select: %d (%c%c%c)\n", ret, FD_ISSET(STDIN_FILENO, &rfds) ? 'X' : '-',
@@ -740,6 +1528,8 @@ int main(int argc, char **argv)
 #endif
 		if (ret < 0) {
 			err(1, "select");
+		} else if (ret == 0 && wakeup) {
+			continue;
 		} else if (ret == 0) {
 			if (timeout_inactivity && timercmp(&timeout_inactivity_tv, &timeout_total_tv, <))
 				warnx("timeout due to inactivity");
@@ -750,7 +1540,7 @@ int main(int argc, char **argv)
 		}
 
 		if (FD_ISSET(STDIN_FILENO, &rfds))
-			tty_callback(ssh_fds);
+			tty_callback();
 
 		if (FD_ISSET(ssh_fds[2], &rfds)) {
 			n = read(ssh_fds[2], buf, sizeof(buf));
@@ -764,12 +1554,15 @@ int main(int argc, char **argv)
 				break;
 			}
 
-			const char blue[] = "\033[94m";
-			const char reset[] = "\033[0m";
+			char blue[] = "\033[94m";
+			char reset[] = "\033[0m";
+			struct iovec iov[] = {
+				{ blue, sizeof(blue) - 1 },
+				{ buf, n },
+				{ reset, sizeof(reset) - 1 },
+			};
 
-			write(2, blue, sizeof(blue) - 1);
-			write(2, buf, n);
-			write(2, reset, sizeof(reset) - 1);
+			writev(STDERR_FILENO, iov, ARRAY_SIZE(iov));
 		}
 
 		if (FD_ISSET(ssh_fds[1], &rfds)) {
@@ -788,19 +1581,25 @@ int main(int argc, char **argv)
 				timeout_inactivity_tv = get_timeout(timeout_inactivity);
 		}
 
-		if (FD_ISSET(ssh_fds[0], &wfds)) {
-			list_for_each_entry_safe(work, next, &work_items, node) {
-				list_del(&work->node);
+		if (FD_ISSET(ssh_fds[0], &wfds))
+			work_dispatch(ssh_fds[0]);
+	}
 
-				work->fn(work, ssh_fds[0]);
-			}
-		}
+	/* Ending the session on purpose, the server needn't hold it */
+	if (session_token[0] && !detach && (quit || received_power_off || reached_timeout)) {
+		request_session_keep(0);
+		work_flush_control(ssh_fds[0]);
 	}
 
 	close(ssh_fds[0]);
 	close(ssh_fds[1]);
 	close(ssh_fds[2]);
 
+	predict_reset();
+	sink_close(output);
+	if (console_log)
+		sink_close(console_log);
+
 	if (verb == CDBA_BOOT)
 		printf("Waiting for ssh to finish\n");
 
@@ -808,6 +1607,10 @@ int main(int argc, char **argv)
 
 	tty_reset(orig_tios);
 
+	if (session_token[0] && (detach || !(quit || received_power_off || reached_timeout)))
+		warnx("session held by the server, resume with -A %s:%llu",
+		      session_token, (unsigned long long)console_received);
+
 	if (reached_timeout)
 		return fastboot_done ? 110 : 2;
 
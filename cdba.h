@@ -30,6 +30,43 @@ enum {
 	MSG_SEND_BREAK,
 	MSG_LIST_DEVICES,
 	MSG_BOARD_INFO,
+	MSG_HEARTBEAT,
+	MSG_CHANNEL,
+	MSG_CHANNEL_STDERR,
+	MSG_COMPRESS,
+	MSG_CONSOLE_DEFLATE,
+	MSG_CONSOLE_FILTER,
+	MSG_SESSION_KEEP,
+	MSG_SESSION_RESUME,
 };
 
+/* Compression methods, offered by the client in MSG_COMPRESS */
+enum {
+	COMPRESS_DEFLATE = 1,
+};
+
+/* Payload of MSG_CONSOLE_FILTER, followed by NUL terminated patterns */
+struct console_filter {
+	uint8_t mode;
+	uint8_t context;
+	uint8_t flags;
+	char patterns[];
+} __packed;
+
+enum {
+	FILTER_FULL,
+	FILTER_MATCHED,
+	FILTER_CONTEXT,
+};
+
+#define FILTER_RECORD	(1 << 0)
+
+/* Payload of MSG_SESSION_RESUME, offset into the session's console output */
+struct session_resume {
+	uint64_t offset;
+	char token[];
+} __packed;
+
+#define SESSION_TOKEN_LEN	32
+
 #endif
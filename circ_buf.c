@@ -29,77 +29,251 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <err.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "circ_buf.h"
 
+/**
+ * circ_init() - allocate the storage of a circular buffer
+ * @circ:	circ_buf object to initialize
+ * @size:	capacity, rounded up to a power of two; 0 selects CIRC_BUF_SIZE
+ *
+ * One byte of the capacity is used to tell a full buffer from an empty one.
+ */
+void circ_init(struct circ_buf *circ, size_t size)
+{
+	size_t pow2 = 2;
+
+	if (!size)
+		size = CIRC_BUF_SIZE;
+
+	while (pow2 < size)
+		pow2 <<= 1;
+
+	circ->buf = malloc(pow2);
+	if (!circ->buf)
+		err(1, "failed to allocate circular buffer");
+
+	circ->size = pow2;
+	circ->head = 0;
+	circ->tail = 0;
+}
+
+void circ_free(struct circ_buf *circ)
+{
+	free(circ->buf);
+	circ->buf = NULL;
+	circ->size = 0;
+}
+
+/*
+ * The producer only moves head and the consumer only moves tail, so pairing
+ * the loads of the other side's index with the stores of our own makes the
+ * buffer safe for one producer and one consumer thread without locking.
+ */
+static size_t circ_avail(struct circ_buf *circ)
+{
+	size_t head = __atomic_load_n(&circ->head, __ATOMIC_ACQUIRE);
+
+	return (head - circ->tail) & (circ->size - 1);
+}
+
+static size_t circ_space(struct circ_buf *circ)
+{
+	size_t tail = __atomic_load_n(&circ->tail, __ATOMIC_ACQUIRE);
+
+	return (tail - circ->head - 1) & (circ->size - 1);
+}
+
+static void circ_produce(struct circ_buf *circ, size_t len)
+{
+	__atomic_store_n(&circ->head, (circ->head + len) & (circ->size - 1),
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Describe the (up to two) segments of @len bytes starting at @offset,
+ * returns the number of segments.
+ */
+static int circ_segments(struct circ_buf *circ, size_t offset, size_t len,
+			 struct iovec iov[2])
+{
+	size_t first = MIN(len, circ->size - offset);
+
+	iov[0].iov_base = circ->buf + offset;
+	iov[0].iov_len = first;
+
+	if (first == len)
+		return 1;
+
+	iov[1].iov_base = circ->buf;
+	iov[1].iov_len = len - first;
+
+	return 2;
+}
+
 /**
  * circ_fill() - read data into circular buffer
  * @fd:		non-blocking file descriptor to read
  * @circ:	circ_buf object to write to
  *
+ * Both the space to the end of the buffer and the space wrapped around to its
+ * start are filled by a single readv().
+ *
  * Return: 0 if fifo is full or fd depleted, negative errno on failure
  */
 ssize_t circ_fill(int fd, struct circ_buf *circ)
 {
+	struct iovec iov[2];
 	size_t space;
-	size_t count = 0;
-	ssize_t n = 0;
+	ssize_t n;
+	int iovcnt;
 
 	do {
-		space = CIRC_SPACE_TO_END(circ);
+		space = circ_space(circ);
 		if (!space) {
 			errno = EAGAIN;
 			return -1;
 		}
 
-		n = read(fd, circ->buf + circ->head, space);
+		iovcnt = circ_segments(circ, circ->head, space, iov);
+
+		n = readv(fd, iov, iovcnt);
 		if (n == 0) {
 			errno = EPIPE;
 			return -1;
 		} else if (n < 0)
 			return -1;
 
-		count += n;
-
-		circ->head = (circ->head + n) & (CIRC_BUF_SIZE - 1);
-	} while (n != space);
+		circ_produce(circ, n);
+	} while (n == space);
 
 	return 0;
 }
 
+/**
+ * circ_peak() - copy data from the tail of the buffer, without consuming it
+ * @circ:	circ_buf object to read from
+ * @buf:	destination
+ * @len:	number of bytes to copy
+ *
+ * Return: @len, or 0 if fewer than @len bytes are available
+ */
 size_t circ_peak(struct circ_buf *circ, void *buf, size_t len)
 {
-	size_t tail = circ->tail;
-	char *p = buf;
+	size_t first;
 
-	while (len--) {
-		if (tail == circ->head)
-			return 0;
+	if (circ_avail(circ) < len)
+		return 0;
 
-		*p++ = circ->buf[tail];
+	first = MIN(len, circ->size - circ->tail);
 
-		tail = (tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+	memcpy(buf, circ->buf + circ->tail, first);
+	if (first < len)
+		memcpy(buf + first, circ->buf, len - first);
 
-	return (void*)p - buf;
+	return len;
 }
 
+/**
+ * circ_read() - copy and consume data from the tail of the buffer
+ * @circ:	circ_buf object to read from
+ * @buf:	destination
+ * @len:	number of bytes to copy
+ *
+ * Return: @len, or 0 if fewer than @len bytes are available
+ */
 size_t circ_read(struct circ_buf *circ, void *buf, size_t len)
 {
-	char *p = buf;
+	if (!circ_peak(circ, buf, len))
+		return 0;
+
+	circ_skip(circ, len);
+
+	return len;
+}
+
+/**
+ * circ_write() - copy data to the head of the buffer
+ * @circ:	circ_buf object to write to
+ * @buf:	source
+ * @len:	number of bytes to copy
+ *
+ * Return: @len, or 0 if there's no room for all of @buf
+ */
+size_t circ_write(struct circ_buf *circ, const void *buf, size_t len)
+{
+	struct iovec iov[2];
+	int iovcnt;
+
+	if (circ_space(circ) < len)
+		return 0;
+
+	iovcnt = circ_segments(circ, circ->head, len, iov);
+
+	memcpy(iov[0].iov_base, buf, iov[0].iov_len);
+	if (iovcnt == 2)
+		memcpy(iov[1].iov_base, buf + iov[0].iov_len, iov[1].iov_len);
+
+	circ_produce(circ, len);
+
+	return len;
+}
+
+/**
+ * circ_view() - describe all available data, for zero-copy consumers
+ * @circ:	circ_buf object to look into
+ * @iov:	filled with up to two segments pointing into the buffer
+ *
+ * The segments remain valid until data is consumed with circ_skip() or
+ * circ_read().
+ *
+ * Return: number of bytes available
+ */
+size_t circ_view(struct circ_buf *circ, struct iovec iov[2])
+{
+	size_t avail = circ_avail(circ);
 
-	while (len--) {
-		if (circ->tail == circ->head)
-			return 0;
+	iov[0].iov_len = 0;
+	iov[1].iov_len = 0;
 
-		*p++ = circ->buf[circ->tail];
+	if (avail)
+		circ_segments(circ, circ->tail, avail, iov);
 
-		circ->tail = (circ->tail + 1) & (CIRC_BUF_SIZE - 1);
-	}
+	return avail;
+}
 
-	return (void*)p - buf;
+/**
+ * circ_linear() - access data at the tail of the buffer without copying
+ * @circ:	circ_buf object to look into
+ * @len:	number of bytes requested
+ *
+ * Return: pointer to @len bytes at the tail of @circ, NULL if fewer bytes
+ * are available or they wrap around the end of the buffer
+ */
+void *circ_linear(struct circ_buf *circ, size_t len)
+{
+	if (circ_avail(circ) < len)
+		return NULL;
+
+	if (circ->tail + len > circ->size)
+		return NULL;
+
+	return circ->buf + circ->tail;
+}
+
+/**
+ * circ_skip() - consume data from the tail of the buffer
+ * @circ:	circ_buf object to consume from
+ * @len:	number of bytes to consume, no more than CIRC_AVAIL()
+ */
+void circ_skip(struct circ_buf *circ, size_t len)
+{
+	__atomic_store_n(&circ->tail, (circ->tail + len) & (circ->size - 1),
+			 __ATOMIC_RELEASE);
 }
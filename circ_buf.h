@@ -31,27 +31,41 @@
 #ifndef __CIRC_BUF_H__
 #define __CIRC_BUF_H__
 
+#include <sys/uio.h>
 #include <stdlib.h>
 
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
 
+/* Default capacity, see circ_init() */
 #define CIRC_BUF_SIZE 16384
 
+/*
+ * One producer, using circ_fill() and circ_write(), and one consumer may
+ * operate on the buffer concurrently from different threads.
+ */
 struct circ_buf {
-	char buf[CIRC_BUF_SIZE];
+	char *buf;
+	size_t size;
 	size_t head;
 	size_t tail;
 };
 
-#define CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & (CIRC_BUF_SIZE - 1))
-#define CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & (CIRC_BUF_SIZE - 1))
+#define CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & ((circ)->size - 1))
+#define CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & ((circ)->size - 1))
+
+#define CIRC_SPACE_TO_END(circ) MIN(CIRC_SPACE(circ), (circ)->size - (circ)->head)
 
-#define CIRC_SPACE_TO_END(circ) MIN(CIRC_SPACE(circ), CIRC_BUF_SIZE - (circ)->head)
+void circ_init(struct circ_buf *circ, size_t size);
+void circ_free(struct circ_buf *circ);
 
 ssize_t circ_fill(int fd, struct circ_buf *circ);
 size_t circ_peak(struct circ_buf *circ, void *buf, size_t len);
 size_t circ_read(struct circ_buf *circ, void *buf, size_t len);
+size_t circ_write(struct circ_buf *circ, const void *buf, size_t len);
+size_t circ_view(struct circ_buf *circ, struct iovec iov[2]);
+void *circ_linear(struct circ_buf *circ, size_t len);
+void circ_skip(struct circ_buf *circ, size_t len);
 
 #endif
@@ -66,6 +66,7 @@ static void free_response(struct conmux_response *resp)
 	free(resp->title);
 	free(resp->status);
 	free(resp->result);
+	free(resp->state);
 }
 
 static uint8_t nibble(const char ch)
@@ -150,32 +151,49 @@ static int registry_lookup(const char *service, struct conmux_lookup *result)
 	int fd;
 
 	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0)
-		err(1, "failed to create registry socket");
+	if (fd < 0) {
+		warn("failed to create registry socket");
+		return -1;
+	}
 
 	memset(&saddr, 0, sizeof(saddr));
 	saddr.sin_family = AF_INET;
 	saddr.sin_port = htons(63000);
 
 	ret = inet_aton("127.0.0.1", &saddr.sin_addr);
-	if (ret <= 0)
-		err(1, "failed inet_aton");
+	if (ret <= 0) {
+		warn("failed inet_aton");
+		ret = -1;
+		goto out;
+	}
 
 	ret = connect(fd, (struct sockaddr *)&saddr, sizeof(saddr));
-	if (ret < 0)
-		err(1, "failed to connect to registry");
+	if (ret < 0) {
+		warn("failed to connect to registry");
+		ret = -1;
+		goto out;
+	}
 
 	ret = snprintf(buf, sizeof(buf), "LOOKUP service=%s\n", service);
-	if (ret >= sizeof(buf))
-		errx(1, "service name too long for registry lookup request");
+	if (ret >= sizeof(buf)) {
+		warnx("service name too long for registry lookup request");
+		ret = -1;
+		goto out;
+	}
 
 	n = write(fd, buf, ret + 1);
-	if (n < 0)
-		err(1, "failed to send registry lookup request");
+	if (n < 0) {
+		warn("failed to send registry lookup request");
+		ret = -1;
+		goto out;
+	}
 
 	n = read(fd, buf, sizeof(buf) - 1);
-	if (n < 0)
-		err(1, "failed to receive registry lookup response");
+	if (n < 0) {
+		warn("failed to receive registry lookup response");
+		ret = -1;
+		goto out;
+	}
 
 	buf[n] = '\0';
 	buf[strcspn(buf, "\n")] = '\0';
@@ -184,19 +202,23 @@ static int registry_lookup(const char *service, struct conmux_lookup *result)
 	if (ret)
 		goto out;
 
-	p = strchr(resp.result, ':');
-	if (!p) {
+	p = resp.result ? strchr(resp.result, ':') : NULL;
+	if (!p || !resp.status) {
 		warnx("parsing reqistry lookup response: invalid formatting of result");
 		ret = -1;
 		goto out;
 	}
 	*p++ = '\0';
 
+	if (strcmp(resp.status, "OK")) {
+		warnx("registry lookup of \"%s\" failed: %s", service, resp.status);
+		ret = -1;
+		goto out;
+	}
+
 	result->host = strdup(resp.result);
 	result->port = strtol(p, NULL, 10);
 
-	ret = strcmp(resp.status, "OK") ? -1 : 0;
-
 out:
 	close(fd);
 
@@ -205,29 +227,27 @@ out:
 	return ret;
 }
 
-static int conmux_data(int fd, void *data)
+static int conmux_data(int fd, unsigned int revents, void *data)
 {
-	struct msg hdr;
-	char buf[128];
+	struct device *dev = data;
+	char buf[4096];
 	ssize_t n;
 
 	n = read(fd, buf, sizeof(buf));
-	if (n < 0)
-		return n;
-
-	if (!n) {
-		fprintf(stderr, "Received EOF from conmux\n");
-		watch_quit();
-	} else {
-		hdr.type = MSG_CONSOLE;
-		hdr.len = n;
-		write(STDOUT_FILENO, &hdr, sizeof(hdr));
-		write(STDOUT_FILENO, buf, n);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+
+	if (n <= 0) {
+		board_lost(dev, n < 0 ? strerror(errno) : "conmux hung up");
+		return 0;
 	}
 
+	cdba_send(dev->session, MSG_CONSOLE, buf, n);
+
 	return 0;
 }
 
+/* Failures are reported here, the board then fails to open */
 void *conmux_open(struct device *dev)
 {
 	struct conmux_response resp = {};
@@ -248,13 +268,15 @@ void *conmux_open(struct device *dev)
 
 	ret = registry_lookup(service, &lookup);
 	if (ret)
-		exit(1);
+		return NULL;
 
 	fprintf(stderr, "conmux device at %s:%d\n", lookup.host, lookup.port);
 
 	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0)
-		err(1, "failed to create registry socket");
+	if (fd < 0) {
+		warn("failed to create registry socket");
+		goto out_free_host;
+	}
 
 	memset(&saddr, 0, sizeof(saddr));
 	saddr.sin_family = AF_INET;
@@ -262,40 +284,69 @@ void *conmux_open(struct device *dev)
 
 	hent = gethostbyname(lookup.host);
 	if (!hent) {
-		errno = h_errno;
-		err(1, "failed resolve \"%s\"", lookup.host);
+		warnx("failed resolve \"%s\": %s", lookup.host, hstrerror(h_errno));
+		goto out_close;
 	}
 
 	saddr.sin_addr = *(struct in_addr *)hent->h_addr_list[0];
 
 	ret = connect(fd, (struct sockaddr *)&saddr, sizeof(saddr));
-	if (ret < 0)
-		err(1, "failed to connect to conmux instance");
+	if (ret < 0) {
+		warn("failed to connect to conmux instance");
+		goto out_close;
+	}
 
 	ret = snprintf(req, sizeof(req), "CONNECT id=cdba:%s to=console\n", user);
-	if (ret >= sizeof(req))
-		errx(1, "unable to fit connect request in buffer");
+	if (ret >= sizeof(req)) {
+		warnx("unable to fit connect request in buffer");
+		goto out_close;
+	}
 
 	n = write(fd, req, ret + 1);
-	if (n < 0)
-		err(1, "failed to write conmux connect request");
+	if (n < 0) {
+		warn("failed to write conmux connect request");
+		goto out_close;
+	}
 
 	n = read(fd, req, sizeof(req) - 1);
-	if (n < 0)
-		err(1, "failed to read conmux response");
+	if (n < 0) {
+		warn("failed to read conmux response");
+		goto out_close;
+	}
 	req[n] = '\0';
 
 	ret = parse_response(req, &resp);
-	if (ret || strcmp(resp.status, "OK"))
-		errx(1, "failed to connect to conmux instance");
+	if (ret || !resp.status || strcmp(resp.status, "OK")) {
+		warnx("failed to connect to conmux instance");
+		free_response(&resp);
+		goto out_close;
+	}
 	free_response(&resp);
+	free(lookup.host);
 
 	conmux = calloc(1, sizeof(*conmux));
 	conmux->fd = fd;
 
-	watch_add_readfd(conmux->fd, conmux_data, NULL);
+	watch_add(conmux->fd, WATCH_READ, conmux_data, dev);
 
 	return conmux;
+
+out_close:
+	close(fd);
+out_free_host:
+	free(lookup.host);
+
+	return NULL;
+}
+
+void conmux_close(struct device *dev)
+{
+	struct conmux *conmux = dev->cdb;
+
+	watch_del(conmux->fd);
+	close(conmux->fd);
+	free(conmux);
+	dev->cdb = NULL;
 }
 
 int conmux_power_on(struct device *dev)
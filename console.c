@@ -32,36 +32,69 @@
 #include <sys/stat.h>
 
 #include <err.h>
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "cdba-server.h"
+#include "console.h"
 #include "device.h"
 
-static int console_data(int fd, void *data)
+static int console_data(int fd, unsigned int revents, void *data)
 {
-	struct msg hdr;
-	char buf[128];
+	struct device *device = data;
+	const char *err;
+	char buf[4096];
 	ssize_t n;
 
 	n = read(fd, buf, sizeof(buf));
-	if (n < 0)
-		return n;
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
 
-	hdr.type = MSG_CONSOLE;
-	hdr.len = n;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
-	write(STDOUT_FILENO, buf, n);
+	/* A failing or unplugged tty must not take the other boards down */
+	if (n <= 0) {
+		err = n < 0 ? strerror(errno) : "hung up";
+		warnx("%s: console lost: %s", device->board, err);
+		session_warnx(device->session, "console lost: %s", err);
+		console_close(device);
+		return 0;
+	}
+
+	cdba_send(device->session, MSG_CONSOLE, buf, n);
 
 	return 0;
 }
 
-void console_open(struct device *device)
+/**
+ * console_open() - open and start watching a board's console
+ * @device:	device of the console
+ *
+ * Return: 0 on success, -1 if the console can't be opened
+ */
+int console_open(struct device *device)
 {
 	device->console_fd = tty_open(device->console_dev, &device->console_tios);
 	if (device->console_fd < 0)
-		err(1, "failed to open %s", device->console_dev);
+		return -1;
+
+	watch_add(device->console_fd, WATCH_READ, console_data, device);
+
+	return 0;
+}
+
+/**
+ * console_close() - stop watching and close a board's console
+ * @device:	device of the console
+ */
+void console_close(struct device *device)
+{
+	if (device->console_fd < 0)
+		return;
 
-	watch_add_readfd(device->console_fd, console_data, device);
+	watch_del(device->console_fd);
+	tcsetattr(device->console_fd, TCSAFLUSH, &device->console_tios);
+	close(device->console_fd);
+	device->console_fd = -1;
 }
 
 int console_write(struct device *device, const void *buf, size_t len)
@@ -3,7 +3,8 @@
 
 #include "device.h"
 
-void console_open(struct device *device);
+int console_open(struct device *device);
+void console_close(struct device *device);
 int console_write(struct device *device, const void *buf, size_t len);
 void console_send_break(struct device *device);
 
@@ -28,12 +28,15 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/eventfd.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,74 +50,407 @@
 
 #define ARRAY_SIZE(x) ((sizeof(x)/sizeof((x)[0])))
 
+#define DEVICE_HASH_SIZE 1024
+
 static struct list_head devices = LIST_INIT(devices);
 
+/* Boards hashed by name, for lookups on select and info requests */
+static struct device *device_hash[DEVICE_HASH_SIZE];
+
+/*
+ * Protects the list, the hash, and the name and description of the boards;
+ * only the main thread adds or removes boards, see device_update().
+ */
+static pthread_rwlock_t devices_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int devices_generation;
+static unsigned int devices_retired;
+
+static unsigned int devices_shards;
+static unsigned int devices_next_shard;
+
+static unsigned int device_hash_name(const char *board)
+{
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a */
+	while (*board) {
+		hash ^= (uint8_t)*board++;
+		hash *= 16777619u;
+	}
+
+	return hash % DEVICE_HASH_SIZE;
+}
+
+static void device_hash_add(struct device *device)
+{
+	unsigned int bucket = device_hash_name(device->board);
+
+	device->hash_next = device_hash[bucket];
+	device_hash[bucket] = device;
+}
+
+static void device_hash_del(struct device *device)
+{
+	struct device **pp = &device_hash[device_hash_name(device->board)];
+
+	for (; *pp; pp = &(*pp)->hash_next) {
+		if (*pp == device) {
+			*pp = device->hash_next;
+			break;
+		}
+	}
+
+	device->hash_next = NULL;
+}
+
 void device_add(struct device *device)
 {
+	pthread_rwlock_wrlock(&devices_lock);
+
+	device->generation = devices_generation;
+
 	list_add(&devices, &device->node);
+	device_hash_add(device);
+
+	pthread_rwlock_unlock(&devices_lock);
 }
 
-static void device_lock(struct device *device)
+/**
+ * device_free() - free a device that was never opened
+ * @device:	device, as returned by the device parser
+ */
+void device_free(struct device *device)
+{
+	free(device->board);
+	free(device->control_dev);
+	free(device->console_dev);
+	free(device->name);
+	free(device->serial);
+	free(device->description);
+	free(device);
+}
+
+static bool device_strcmp(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a != b;
+
+	return strcmp(a, b);
+}
+
+static bool device_config_changed(struct device *a, struct device *b)
+{
+	return device_strcmp(a->control_dev, b->control_dev) ||
+	       device_strcmp(a->console_dev, b->console_dev) ||
+	       device_strcmp(a->serial, b->serial) ||
+	       a->voltage != b->voltage ||
+	       a->usb_always_on != b->usb_always_on ||
+	       a->set_active != b->set_active ||
+	       a->fastboot_key_timeout != b->fastboot_key_timeout ||
+	       a->boot != b->boot ||
+	       a->open != b->open ||
+	       a->close != b->close ||
+	       a->power != b->power ||
+	       a->usb != b->usb ||
+	       a->print_status != b->print_status ||
+	       a->write != b->write ||
+	       a->key != b->key ||
+	       a->send_break != b->send_break;
+}
+
+#define DEVICE_TAKE(a, b, field) do { \
+		free((a)->field); \
+		(a)->field = (b)->field; \
+		(b)->field = NULL; \
+	} while (0)
+
+/*
+ * Apply the configuration left by device_update(), in the board's own thread
+ * and while no session is using it.
+ */
+static void device_apply(struct device *device)
+{
+	struct device *cfg;
+
+	cfg = __atomic_exchange_n(&device->pending, NULL, __ATOMIC_ACQ_REL);
+	if (!cfg)
+		return;
+
+	if (!device_config_changed(device, cfg))
+		goto out;
+
+	warnx("applying new configuration of %s", device->board);
+
+	if (device->opened)
+		device_close(device);
+
+	DEVICE_TAKE(device, cfg, control_dev);
+	DEVICE_TAKE(device, cfg, console_dev);
+	DEVICE_TAKE(device, cfg, serial);
+
+	device->voltage = cfg->voltage;
+	device->usb_always_on = cfg->usb_always_on;
+	device->set_active = cfg->set_active;
+	device->fastboot_key_timeout = cfg->fastboot_key_timeout;
+	device->boot = cfg->boot;
+	device->open = cfg->open;
+	device->close = cfg->close;
+	device->power = cfg->power;
+	device->usb = cfg->usb;
+	device->print_status = cfg->print_status;
+	device->write = cfg->write;
+	device->key = cfg->key;
+	device->send_break = cfg->send_break;
+
+out:
+	device_free(cfg);
+}
+
+static struct device *device_find_retired(const char *board)
+{
+	struct device *device;
+
+	if (!devices_retired)
+		return NULL;
+
+	list_for_each_entry(device, &devices, node) {
+		if (device->retired && !strcmp(device->board, board))
+			return device;
+	}
+
+	return NULL;
+}
+
+static struct device *device_lookup(const char *board)
+{
+	struct device *device;
+
+	device = device_hash[device_hash_name(board)];
+	for (; device; device = device->hash_next) {
+		if (!strcmp(device->board, board))
+			return device;
+	}
+
+	return NULL;
+}
+
+/**
+ * device_update() - bring the board database in line with a reloaded one
+ * @fresh:	devices returned by device_parser_read(), consumed
+ * @retire:	invoked for each board removed from the database
+ *
+ * New boards are added and name and description changes take effect right
+ * away. Any other change is left for the board's next session, as active
+ * sessions must not lose their board. Removed boards can no longer be
+ * selected, @retire is expected to close them once their session ends.
+ *
+ * Must only be called from the main thread.
+ */
+void device_update(struct list_head *fresh, void (*retire)(struct device *device))
+{
+	struct device *pending;
+	struct device *device;
+	struct device *stale;
+	struct device *tmp;
+	char *str;
+
+	pthread_rwlock_wrlock(&devices_lock);
+
+	devices_generation++;
+
+	list_for_each_entry_safe(device, tmp, fresh, node) {
+		list_del(&device->node);
+
+		stale = device_lookup(device->board);
+		if (!stale)
+			stale = device_find_retired(device->board);
+
+		if (!stale) {
+			if (devices_shards)
+				device->shard = 1 + devices_next_shard++ % devices_shards;
+
+			device->generation = devices_generation;
+			list_add(&devices, &device->node);
+			device_hash_add(device);
+			continue;
+		}
+
+		if (stale->retired) {
+			__atomic_store_n(&stale->retired, false, __ATOMIC_RELEASE);
+			devices_retired--;
+			device_hash_add(stale);
+		}
+
+		stale->generation = devices_generation;
+
+		str = stale->name;
+		stale->name = device->name;
+		device->name = str;
+
+		str = stale->description;
+		stale->description = device->description;
+		device->description = str;
+
+		/* Replaces the configuration of an earlier reload, if not yet applied */
+		pending = __atomic_exchange_n(&stale->pending, device, __ATOMIC_ACQ_REL);
+		if (pending)
+			device_free(pending);
+	}
+
+	list_for_each_entry(device, &devices, node) {
+		if (device->retired || device->generation == devices_generation)
+			continue;
+
+		device_hash_del(device);
+		device->generation = devices_generation;
+		__atomic_store_n(&device->retired, true, __ATOMIC_RELEASE);
+		devices_retired++;
+	}
+
+	pthread_rwlock_unlock(&devices_lock);
+
+	/* Only this thread modifies the list, no need to hold the lock */
+	list_for_each_entry(device, &devices, node) {
+		if (device->retired && device->generation == devices_generation) {
+			warnx("board %s removed", device->board);
+			retire(device);
+		}
+	}
+}
+
+static int device_lock(struct device *device)
 {
 	char lock[PATH_MAX];
 	int fd;
 	int n;
 
 	n = snprintf(lock, sizeof(lock), "/tmp/cdba-%s.lock", device->board);
-	if (n >= sizeof(lock))
-		errx(1, "failed to build lockfile path");
+	if (n >= sizeof(lock)) {
+		warnx("failed to build lockfile path");
+		return -ENAMETOOLONG;
+	}
 
 	fd = open(lock, O_RDONLY | O_CREAT, 0666);
 	if (fd >= 0)
 		close(fd);
 
 	fd = open(lock, O_RDONLY | O_CLOEXEC);
-	if (fd < 0)
-		err(1, "failed to open lockfile %s", lock);
+	if (fd < 0) {
+		warn("failed to open lockfile %s", lock);
+		return -errno;
+	}
 
 	n = flock(fd, LOCK_EX | LOCK_NB);
-	if (!n)
-		return;
+	if (n < 0) {
+		close(fd);
+		return -EBUSY;
+	}
 
-	warnx("board is in use, waiting...");
+	device->lock_fd = fd;
 
-	n = flock(fd, LOCK_EX);
-	if (n < 0)
-		err(1, "failed to lock lockfile %s", lock);
+	return 0;
 }
 
+static void device_fastboot_opened(struct fastboot *fb, void *data);
+static void device_fastboot_disconnect(void *data);
+
+/**
+ * device_find() - look up a board of the board database
+ * @board:	name of the board
+ *
+ * Devices are never freed, but may be retired after the lookup.
+ *
+ * Return: the device, NULL if unknown
+ */
+struct device *device_find(const char *board)
+{
+	struct device *device;
+
+	pthread_rwlock_rdlock(&devices_lock);
+	device = device_lookup(board);
+	pthread_rwlock_unlock(&devices_lock);
+
+	return device;
+}
+
+/**
+ * device_open() - lock and open a board's controller, console and fastboot
+ * @board:		name of the board
+ * @fastboot_ops:	fastboot events are forwarded here
+ *
+ * Opening a device that is already open only rebinds @fastboot_ops, the
+ * controller and console remain open until device_close(), or until a
+ * reloaded configuration changes them.
+ *
+ * Return: the device, NULL with errno set on failure, EBUSY if locked
+ */
 struct device *device_open(const char *board,
 			   struct fastboot_ops *fastboot_ops)
 {
 	struct device *device;
+	int ret;
 
-	list_for_each_entry(device, &devices, node) {
-		if (!strcmp(device->board, board))
-			goto found;
+	device = device_find(board);
+	if (!device) {
+		errno = ENODEV;
+		return NULL;
 	}
 
-	return NULL;
+	device_apply(device);
+
+	if (device->opened) {
+		device->fastboot_ops = fastboot_ops;
+		device->device_fastboot_ops.info = fastboot_ops->info;
+		return device;
+	}
 
-found:
 	assert(device->open || device->console_dev);
 
-	device_lock(device);
+	ret = device_lock(device);
+	if (ret < 0) {
+		errno = -ret;
+		return NULL;
+	}
 
 	if (device->open) {
 		device->cdb = device->open(device);
-		if (!device->cdb)
-			errx(1, "failed to open device controller");
+		if (!device->cdb) {
+			warnx("%s: failed to open device controller", device->board);
+			goto err_unlock;
+		}
 	}
 
-	if (device->console_dev)
-		console_open(device);
+	if (device->console_dev && console_open(device) < 0) {
+		warnx("%s: failed to open console", device->board);
+		goto err_close;
+	}
 
 	if (device->usb_always_on)
 		device_usb(device, true);
 
-	device->fastboot = fastboot_open(device->serial, fastboot_ops, NULL);
+	/* Intercept fastboot events to drive the power sequence */
+	device->fastboot_ops = fastboot_ops;
+	device->device_fastboot_ops.opened = device_fastboot_opened;
+	device->device_fastboot_ops.disconnect = device_fastboot_disconnect;
+	device->device_fastboot_ops.info = fastboot_ops->info;
+
+	device->fastboot = fastboot_open(device->serial,
+					 &device->device_fastboot_ops, device);
+
+	device->opened = true;
 
 	return device;
+
+err_close:
+	if (device->cdb && device->close)
+		device->close(device);
+	device->cdb = NULL;
+err_unlock:
+	close(device->lock_fd);
+	device->lock_fd = -1;
+	errno = EIO;
+
+	return NULL;
 }
 
 static void device_impl_power(struct device *device, bool on)
@@ -137,10 +473,20 @@ enum {
 	DEVICE_STATE_RUNNING,
 };
 
+static void device_tick_cancel(struct device *device)
+{
+	if (device->tick_timer) {
+		watch_timer_cancel(device->tick_timer);
+		device->tick_timer = NULL;
+	}
+}
+
 static void device_tick(void *data)
 {
 	struct device *device = data;
 
+	device->tick_timer = NULL;
+
 	switch (device->state) {
 	case DEVICE_STATE_START:
 		/* Make sure power key is not engaged */
@@ -150,7 +496,7 @@ static void device_tick(void *data)
 			device_key(device, DEVICE_KEY_POWER, false);
 
 		device->state = DEVICE_STATE_CONNECT;
-		watch_timer_add(10, device_tick, device);
+		device->tick_timer = watch_timer_add(10, device_tick, device);
 		break;
 	case DEVICE_STATE_CONNECT:
 		/* Connect power and USB */
@@ -159,10 +505,10 @@ static void device_tick(void *data)
 
 		if (device->has_power_key) {
 			device->state = DEVICE_STATE_PRESS;
-			watch_timer_add(250, device_tick, device);
+			device->tick_timer = watch_timer_add(250, device_tick, device);
 		} else if (device->fastboot_key_timeout) {
 			device->state = DEVICE_STATE_RELEASE_FASTBOOT;
-			watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
+			device->tick_timer = watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
 		} else {
 			device->state = DEVICE_STATE_RUNNING;
 		}
@@ -172,7 +518,7 @@ static void device_tick(void *data)
 		device_key(device, DEVICE_KEY_POWER, true);
 
 		device->state = DEVICE_STATE_RELEASE_PWR;
-		watch_timer_add(100, device_tick, device);
+		device->tick_timer = watch_timer_add(100, device_tick, device);
 		break;
 	case DEVICE_STATE_RELEASE_PWR:
 		/* Release power key */
@@ -180,7 +526,7 @@ static void device_tick(void *data)
 
 		if (device->fastboot_key_timeout) {
 			device->state = DEVICE_STATE_RELEASE_FASTBOOT;
-			watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
+			device->tick_timer = watch_timer_add(device->fastboot_key_timeout * 1000, device_tick, device);
 		} else {
 			device->state = DEVICE_STATE_RUNNING;
 		}
@@ -192,11 +538,39 @@ static void device_tick(void *data)
 	}
 }
 
+static void device_fastboot_opened(struct fastboot *fb, void *data)
+{
+	struct device *device = data;
+
+	/*
+	 * The board made it into fastboot, no need to hold the key for the
+	 * remainder of fastboot_key_timeout.
+	 */
+	if (device->state == DEVICE_STATE_RELEASE_FASTBOOT) {
+		device_tick_cancel(device);
+		device_tick(device);
+	}
+
+	if (device->fastboot_ops->opened)
+		device->fastboot_ops->opened(fb, device);
+}
+
+static void device_fastboot_disconnect(void *data)
+{
+	struct device *device = data;
+
+	if (device->fastboot_ops->disconnect)
+		device->fastboot_ops->disconnect(device);
+}
+
 static int device_power_on(struct device *device)
 {
 	if (!device || !device->power)
 		return 0;
 
+	/* Restart the sequence, dropping any step still pending */
+	device_tick_cancel(device);
+
 	device->state = DEVICE_STATE_START;
 	device_tick(device);
 
@@ -208,6 +582,9 @@ static int device_power_off(struct device *device)
 	if (!device || !device->power)
 		return 0;
 
+	device_tick_cancel(device);
+	device->state = DEVICE_STATE_START;
+
 	device->power(device, false);
 
 	return 0;
@@ -254,13 +631,100 @@ void device_fastboot_flash_reboot(struct device *device)
 	fastboot_reboot(device->fastboot);
 }
 
-void device_boot(struct device *device, const void *data, size_t len)
+static void *device_boot_thread(void *data)
 {
-	warnx("booting the board...");
+	struct device *device = data;
+	const uint64_t one = 1;
+	int ret;
+
 	if (device->set_active)
 		fastboot_set_active(device->fastboot, "a");
-	fastboot_download(device->fastboot, data, len);
-	device->boot(device);
+	ret = fastboot_download(device->fastboot, device->boot_image, device->boot_len);
+	if (ret != -ECANCELED)
+		device->boot(device);
+
+	write(device->boot_fd, &one, sizeof(one));
+
+	return NULL;
+}
+
+/* Join the boot thread, which has finished or is about to */
+static void device_boot_reap(struct device *device)
+{
+	if (!device->booting)
+		return;
+
+	pthread_join(device->boot_thread, NULL);
+	device->booting = false;
+
+	/* What the device had to say, now that we're back on the event loop */
+	fastboot_defer(device->fastboot, false);
+
+	if (device->boot_done)
+		device->boot_done(device, device->boot_data);
+}
+
+static int device_boot_complete(int fd, unsigned int revents, void *data)
+{
+	struct device *device = data;
+	uint64_t count;
+	ssize_t n;
+
+	n = read(fd, &count, sizeof(count));
+	if (n < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	device_boot_reap(device);
+
+	return 0;
+}
+
+/**
+ * device_boot() - download and boot an image, without blocking the event loop
+ * @device:	device to boot
+ * @image:	image to download, must remain valid until @done is invoked
+ * @len:	size of @image
+ * @done:	invoked from the event loop once the boot sequence is complete,
+ *		or aborted by device_release()
+ * @data:	context passed to @done
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int device_boot(struct device *device, const void *image, size_t len,
+		void (*done)(struct device *, void *), void *data)
+{
+	int ret;
+
+	if (device->booting)
+		return -EBUSY;
+
+	if (device->boot_fd < 0) {
+		device->boot_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (device->boot_fd < 0)
+			err(1, "failed to create eventfd");
+
+		watch_add(device->boot_fd, WATCH_READ, device_boot_complete, device);
+	}
+
+	fastboot_abort(device->fastboot, false);
+	fastboot_defer(device->fastboot, true);
+
+	device->boot_image = image;
+	device->boot_len = len;
+	device->boot_done = done;
+	device->boot_data = data;
+
+	warnx("booting the board...");
+
+	ret = pthread_create(&device->boot_thread, NULL, device_boot_thread, device);
+	if (ret) {
+		fastboot_defer(device->fastboot, false);
+		return -ret;
+	}
+
+	device->booting = true;
+
+	return 0;
 }
 
 void device_send_break(struct device *device)
@@ -269,58 +733,140 @@ void device_send_break(struct device *device)
 		device->send_break(device);
 }
 
-void device_list_devices(void)
+void device_list_devices(struct session *session)
 {
 	struct device *device;
-	struct msg hdr;
 	size_t len;
 	char buf[80];
 
+	pthread_rwlock_rdlock(&devices_lock);
+
 	list_for_each_entry(device, &devices, node) {
+		if (device->retired)
+			continue;
+
 		if (device->name)
 			len = snprintf(buf, sizeof(buf), "%-20s %s", device->board, device->name);
 		else
 			len = snprintf(buf, sizeof(buf), "%s", device->board);
 
-		hdr.type = MSG_LIST_DEVICES;
-		hdr.len = len;
-		write(STDOUT_FILENO, &hdr, sizeof(hdr));
-		write(STDOUT_FILENO, buf, len);
+		cdba_send(session, MSG_LIST_DEVICES, buf, MIN(len, sizeof(buf) - 1));
 	}
 
-	hdr.type = MSG_LIST_DEVICES;
-	hdr.len = 0;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
+	pthread_rwlock_unlock(&devices_lock);
+
+	cdba_send(session, MSG_LIST_DEVICES, NULL, 0);
 }
 
-void device_info(const void *data, size_t dlen)
+void device_info(struct session *session, const void *data, size_t dlen)
 {
 	struct device *device;
-	struct msg hdr;
-	char *description;
+	char *description = NULL;
+	char board[256];
 	size_t len = 0;
 
-	list_for_each_entry(device, &devices, node) {
-		if (!strncmp(device->board, data, dlen) && device->description) {
-			description = device->description;
-			len = strlen(device->description);
-			break;
-		}
+	/* The board name may or may not come NUL terminated */
+	len = strnlen(data, MIN(dlen, sizeof(board) - 1));
+	memcpy(board, data, len);
+	board[len] = '\0';
+	len = 0;
+
+	pthread_rwlock_rdlock(&devices_lock);
+
+	device = device_lookup(board);
+	if (device && device->description) {
+		description = device->description;
+		len = strlen(device->description);
 	}
 
-	hdr.type = MSG_BOARD_INFO;
-	hdr.len = len;
-	write(STDOUT_FILENO, &hdr, sizeof(hdr));
-	if (len)
-		write(STDOUT_FILENO, description, len);
+	cdba_send(session, MSG_BOARD_INFO, description, len);
+
+	pthread_rwlock_unlock(&devices_lock);
 }
 
-void device_close(struct device *dev)
+/**
+ * device_release() - power down a board at the end of a session
+ * @dev:	device to release
+ *
+ * The board's controller, console and fastboot monitor remain open, ready
+ * for the next session. A download in progress is aborted, the board stays
+ * busy until its boot thread is reaped and the boot's done callback invoked.
+ */
+void device_release(struct device *dev)
 {
+	if (dev->booting)
+		fastboot_abort(dev->fastboot, true);
+
 	if (!dev->usb_always_on)
 		device_usb(dev, false);
 	device_power(dev, false);
 
-	if (dev->close)
+	dev->session = NULL;
+}
+
+void device_close(struct device *dev)
+{
+	device_release(dev);
+
+	/* The boot thread uses the fastboot device, it's aborted by now */
+	dev->opened = false;
+	device_boot_reap(dev);
+
+	if (dev->boot_fd >= 0) {
+		watch_del(dev->boot_fd);
+		close(dev->boot_fd);
+		dev->boot_fd = -1;
+	}
+
+	if (dev->cdb && dev->close)
 		dev->close(dev);
+	dev->cdb = NULL;
+
+	if (dev->console_dev)
+		console_close(dev);
+
+	if (dev->fastboot) {
+		fastboot_close(dev->fastboot);
+		dev->fastboot = NULL;
+	}
+
+	if (dev->lock_fd >= 0) {
+		close(dev->lock_fd);
+		dev->lock_fd = -1;
+	}
+}
+
+/**
+ * device_close_all() - close the open devices served by a shard
+ * @shard:	shard, or event loop thread, the devices belong to
+ */
+void device_close_all(unsigned int shard)
+{
+	struct device *device;
+
+	pthread_rwlock_rdlock(&devices_lock);
+
+	list_for_each_entry(device, &devices, node) {
+		if (device->opened && device->shard == shard)
+			device_close(device);
+	}
+
+	pthread_rwlock_unlock(&devices_lock);
+}
+
+/**
+ * device_distribute() - spread the devices evenly over a number of shards
+ * @shards:	number of shards, numbered from 1
+ */
+void device_distribute(unsigned int shards)
+{
+	struct device *device;
+	unsigned int i = 0;
+
+	list_for_each_entry(device, &devices, node)
+		device->shard = 1 + i++ % shards;
+
+	/* Boards added by later reloads carry on where these left off */
+	devices_shards = shards;
+	devices_next_shard = i;
 }
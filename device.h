@@ -1,12 +1,14 @@
 #ifndef __DEVICE_H__
 #define __DEVICE_H__
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <termios.h>
+#include "fastboot.h"
 #include "list.h"
 
 struct cdb_assist;
-struct fastboot;
-struct fastboot_ops;
+struct session;
 
 struct device {
 	char *board;
@@ -19,10 +21,28 @@ struct device {
 	bool tickle_mmc;
 	bool usb_always_on;
 	struct fastboot *fastboot;
+	struct fastboot_ops *fastboot_ops;
+	struct fastboot_ops device_fastboot_ops;
 	unsigned int fastboot_key_timeout;
 	int state;
+	struct timer *tick_timer;
 	bool has_power_key;
 
+	/* Controllers and console are kept open between sessions */
+	bool opened;
+	int lock_fd;
+	struct session *session;
+
+	/* Event loop thread serving the board, see shard.h */
+	unsigned int shard;
+
+	/* Removed from the board database by a reload, see device_update() */
+	bool retired;
+	unsigned int generation;
+
+	/* Configuration from a reload, applied as the board is next opened */
+	struct device *pending;
+
 	void (*boot)(struct device *);
 
 	void *(*open)(struct device *dev);
@@ -39,29 +59,48 @@ struct device {
 
 	void *cdb;
 
+	/* Asynchronous fastboot download and boot */
+	pthread_t boot_thread;
+	bool booting;
+	int boot_fd;
+	const void *boot_image;
+	size_t boot_len;
+	void (*boot_done)(struct device *, void *);
+	void *boot_data;
+
 	int console_fd;
 	struct termios console_tios;
 
 	struct list_head node;
+
+	/* Next device in the same bucket of the board name hash */
+	struct device *hash_next;
 };
 
 void device_add(struct device *device);
+void device_free(struct device *device);
+void device_update(struct list_head *fresh, void (*retire)(struct device *device));
 
+struct device *device_find(const char *board);
 struct device *device_open(const char *board, struct fastboot_ops *fastboot_ops);
+void device_release(struct device *dev);
 void device_close(struct device *dev);
+void device_close_all(unsigned int shard);
+void device_distribute(unsigned int shards);
 int device_power(struct device *device, bool on);
 
 void device_print_status(struct device *device);
 void device_usb(struct device *device, bool on);
 int device_write(struct device *device, const void *buf, size_t len);
 
-void device_boot(struct device *device, const void *data, size_t len);
+int device_boot(struct device *device, const void *image, size_t len,
+		void (*done)(struct device *, void *), void *data);
 
 void device_fastboot_boot(struct device *device);
 void device_fastboot_flash_reboot(struct device *device);
 void device_send_break(struct device *device);
-void device_list_devices(void);
-void device_info(const void *data, size_t dlen);
+void device_list_devices(struct session *session);
+void device_info(struct session *session, const void *data, size_t dlen);
 
 enum {
 	DEVICE_KEY_FASTBOOT,
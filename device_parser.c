@@ -28,11 +28,24 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <yaml.h>
 
 #include "device.h"
+#include "device_parser.h"
 #include "alpaca.h"
 #include "cdb_assist.h"
 #include "conmux.h"
@@ -41,17 +54,88 @@
 
 #define TOKEN_LENGTH	16384
 
+/*
+ * The board database is cached in a binary form, keyed by the identity of
+ * the YAML file, so that only the first start after an edit pays for
+ * parsing it. The cache holds the key/value pairs of each board, which are
+ * applied just like the ones read from YAML:
+ *
+ *   struct cache_header
+ *   struct cache_board[nboards]
+ *   struct cache_pair[npairs]
+ *   NUL terminated strings, referenced by offset
+ */
+#define CACHE_MAGIC	0x41424443
+#define CACHE_VERSION	1
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+
+	/* Identity of the YAML file the cache was built from */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+
+	uint32_t nboards;
+	uint32_t npairs;
+	uint32_t strings_len;
+};
+
+struct cache_board {
+	uint32_t first_pair;
+	uint32_t npairs;
+};
+
+struct cache_pair {
+	uint32_t key;
+	uint32_t value;
+};
+
+struct cache_builder {
+	struct cache_board *boards;
+	size_t nboards;
+
+	struct cache_pair *pairs;
+	size_t npairs;
+
+	char *strings;
+	size_t strings_len;
+	size_t strings_alloc;
+};
+
 struct device_parser {
 	yaml_parser_t parser;
 	yaml_event_t event;
+
+	struct cache_builder cache;
+
+	/* Devices parsed so far */
+	struct list_head *devices;
+
+	/* Parse errors unwind to device_parser_read() */
+	jmp_buf error;
 };
 
+static void parse_error(struct device_parser *dp, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "device parser: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	longjmp(dp->error, 1);
+}
+
 static void nextsym(struct device_parser *dp)
 {
-	if (!yaml_parser_parse(&dp->parser, &dp->event)) {
-		fprintf(stderr, "device parser: error %d\n", dp->parser.error);
-		exit(1);
-	}
+	if (!yaml_parser_parse(&dp->parser, &dp->event))
+		parse_error(dp, "error %d", dp->parser.error);
 }
 
 static int accept(struct device_parser *dp, int type, char *scalar)
@@ -76,8 +160,130 @@ static bool expect(struct device_parser *dp, int type, char *scalar)
 		return true;
 	}
 
-	fprintf(stderr, "device parser: expected %d got %d\n", type, dp->event.type);
-	exit(1);
+	parse_error(dp, "expected %d got %d", type, dp->event.type);
+	return false;
+}
+
+static int device_set(struct device *dev, const char *key, const char *value)
+{
+	if (!strcmp(key, "board")) {
+		dev->board = strdup(value);
+	} else if (!strcmp(key, "name")) {
+		dev->name = strdup(value);
+	} else if (!strcmp(key, "cdba")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = cdb_assist_open;
+		dev->close = cdb_assist_close;
+		dev->power = cdb_assist_power;
+		dev->print_status = cdb_assist_print_status;
+		dev->usb = cdb_assist_usb;
+		dev->key = cdb_assist_key;
+	} else if (!strcmp(key, "conmux")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = conmux_open;
+		dev->close = conmux_close;
+		dev->power = conmux_power;
+		dev->write = conmux_write;
+	} else if (!strcmp(key, "alpaca")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = alpaca_open;
+		dev->close = alpaca_close;
+		dev->power = alpaca_power;
+		dev->usb = alpaca_usb;
+		dev->key = alpaca_key;
+	} else if (!strcmp(key, "qcomlt_debug_board")) {
+		dev->control_dev = strdup(value);
+
+		dev->open = qcomlt_dbg_open;
+		dev->close = qcomlt_dbg_close;
+		dev->power = qcomlt_dbg_power;
+		dev->usb = qcomlt_dbg_usb;
+		dev->key = qcomlt_dbg_key;
+	} else if (!strcmp(key, "console")) {
+		dev->console_dev = strdup(value);
+		dev->write = console_write;
+		dev->send_break = console_send_break;
+	} else if (!strcmp(key, "voltage")) {
+		dev->voltage = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "fastboot")) {
+		dev->serial = strdup(value);
+
+		if (!dev->boot)
+			dev->boot = device_fastboot_boot;
+	} else if (!strcmp(key, "fastboot_set_active")) {
+		dev->set_active = !strcmp(value, "true");
+	} else if (!strcmp(key, "broken_fastboot_boot")) {
+		if (!strcmp(value, "true"))
+			dev->boot = device_fastboot_flash_reboot;
+	} else if (!strcmp(key, "description")) {
+		dev->description = strdup(value);
+	} else if (!strcmp(key, "fastboot_key_timeout")) {
+		dev->fastboot_key_timeout = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "usb_always_on")) {
+		dev->usb_always_on = !strcmp(value, "true");
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool device_complete(struct device *dev)
+{
+	return dev->board && dev->serial && (dev->open || dev->console_dev);
+}
+
+static uint32_t cache_string(struct cache_builder *cb, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	size_t offset = cb->strings_len;
+
+	if (cb->strings_len + len > cb->strings_alloc) {
+		cb->strings_alloc = cb->strings_alloc ? cb->strings_alloc * 2 : 4096;
+		if (cb->strings_alloc < cb->strings_len + len)
+			cb->strings_alloc = cb->strings_len + len;
+
+		cb->strings = realloc(cb->strings, cb->strings_alloc);
+		if (!cb->strings)
+			err(1, "failed to allocate board cache strings");
+	}
+
+	memcpy(cb->strings + offset, str, len);
+	cb->strings_len += len;
+
+	return offset;
+}
+
+static void cache_add_board(struct cache_builder *cb)
+{
+	struct cache_board *board;
+
+	cb->boards = realloc(cb->boards, (cb->nboards + 1) * sizeof(*cb->boards));
+	if (!cb->boards)
+		err(1, "failed to allocate board cache");
+
+	board = &cb->boards[cb->nboards++];
+	board->first_pair = cb->npairs;
+	board->npairs = 0;
+}
+
+static void cache_add_pair(struct cache_builder *cb, const char *key,
+			   const char *value)
+{
+	struct cache_pair *pair;
+
+	cb->pairs = realloc(cb->pairs, (cb->npairs + 1) * sizeof(*cb->pairs));
+	if (!cb->pairs)
+		err(1, "failed to allocate board cache");
+
+	pair = &cb->pairs[cb->npairs++];
+	pair->key = cache_string(cb, key);
+	pair->value = cache_string(cb, value);
+
+	cb->boards[cb->nboards - 1].npairs++;
 }
 
 static void parse_board(struct device_parser *dp)
@@ -87,122 +293,333 @@ static void parse_board(struct device_parser *dp)
 	char key[TOKEN_LENGTH];
 
 	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		err(1, "failed to allocate device");
+
+	dev->boot_fd = -1;
+	dev->console_fd = -1;
+	dev->lock_fd = -1;
+
+	/* Collect it right away, to be freed if parsing fails */
+	list_add(dp->devices, &dev->node);
+
+	cache_add_board(&dp->cache);
 
 	while (accept(dp, YAML_SCALAR_EVENT, key)) {
 		expect(dp, YAML_SCALAR_EVENT, value);
 
-		if (!strcmp(key, "board")) {
-			dev->board = strdup(value);
-		} else if (!strcmp(key, "name")) {
-			dev->name = strdup(value);
-		} else if (!strcmp(key, "cdba")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = cdb_assist_open;
-			dev->close = cdb_assist_close;
-			dev->power = cdb_assist_power;
-			dev->print_status = cdb_assist_print_status;
-			dev->usb = cdb_assist_usb;
-			dev->key = cdb_assist_key;
-		} else if (!strcmp(key, "conmux")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = conmux_open;
-			dev->power = conmux_power;
-			dev->write = conmux_write;
-		} else if (!strcmp(key, "alpaca")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = alpaca_open;
-			dev->power = alpaca_power;
-			dev->usb = alpaca_usb;
-			dev->key = alpaca_key;
-		} else if (!strcmp(key, "qcomlt_debug_board")) {
-			dev->control_dev = strdup(value);
-
-			dev->open = qcomlt_dbg_open;
-			dev->power = qcomlt_dbg_power;
-			dev->usb = qcomlt_dbg_usb;
-			dev->key = qcomlt_dbg_key;
-		} else if (!strcmp(key, "console")) {
-			dev->console_dev = strdup(value);
-			dev->write = console_write;
-			dev->send_break = console_send_break;
-		} else if (!strcmp(key, "voltage")) {
-			dev->voltage = strtoul(value, NULL, 10);
-		} else if (!strcmp(key, "fastboot")) {
-			dev->serial = strdup(value);
-
-			if (!dev->boot)
-				dev->boot = device_fastboot_boot;
-		} else if (!strcmp(key, "fastboot_set_active")) {
-			dev->set_active = !strcmp(value, "true");
-		} else if (!strcmp(key, "broken_fastboot_boot")) {
-			if (!strcmp(value, "true"))
-				dev->boot = device_fastboot_flash_reboot;
-		} else if (!strcmp(key, "description")) {
-			dev->description = strdup(value);
-		} else if (!strcmp(key, "fastboot_key_timeout")) {
-			dev->fastboot_key_timeout = strtoul(value, NULL, 10);
-		} else if (!strcmp(key, "usb_always_on")) {
-			dev->usb_always_on = !strcmp(value, "true");
-		} else {
-			fprintf(stderr, "device parser: unknown key \"%s\"\n", key);
-			exit(1);
+		if (device_set(dev, key, value) < 0)
+			parse_error(dp, "unknown key \"%s\"", key);
+
+		cache_add_pair(&dp->cache, key, value);
+	}
+
+	if (!device_complete(dev))
+		parse_error(dp, "insufficiently defined device");
+}
+
+static void cache_path(const struct stat *sb, char *path, size_t len)
+{
+	snprintf(path, len, "/tmp/cdba-%lu-%lx-%lx.cache", (unsigned long)getuid(),
+		 (unsigned long)sb->st_dev, (unsigned long)sb->st_ino);
+}
+
+static bool cache_matches(const struct cache_header *hdr, const struct stat *sb)
+{
+	return hdr->magic == CACHE_MAGIC &&
+	       hdr->version == CACHE_VERSION &&
+	       hdr->dev == sb->st_dev &&
+	       hdr->ino == sb->st_ino &&
+	       hdr->size == sb->st_size &&
+	       hdr->mtime_sec == sb->st_mtim.tv_sec &&
+	       hdr->mtime_nsec == sb->st_mtim.tv_nsec;
+}
+
+static const char *cache_lookup(const char *strings, uint32_t len, uint32_t offset)
+{
+	if (offset >= len || !memchr(strings + offset, '\0', len - offset))
+		return NULL;
+
+	return strings + offset;
+}
+
+/* Return: 0 if the boards were loaded from the cache, -1 to parse the YAML */
+static int cache_load(const struct stat *sb, struct list_head *devices)
+{
+	struct list_head loaded = LIST_INIT(loaded);
+	struct device *tmp;
+	const struct cache_header *hdr;
+	const struct cache_board *boards;
+	const struct cache_pair *pairs;
+	const struct cache_pair *pair;
+	const char *strings;
+	const char *value;
+	const char *key;
+	struct device *dev;
+	struct stat cache_sb;
+	char path[PATH_MAX];
+	size_t expected;
+	uint32_t i;
+	uint32_t j;
+	void *map;
+	int ret = -1;
+	int fd;
+
+	cache_path(sb, path, sizeof(path));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+
+	/* It lives in /tmp, only trust a cache written by ourselves */
+	if (fstat(fd, &cache_sb) < 0 || cache_sb.st_uid != getuid() ||
+	    (cache_sb.st_mode & 022) || cache_sb.st_size < sizeof(*hdr))
+		goto out_close;
+
+	map = mmap(NULL, cache_sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out_close;
+
+	hdr = map;
+	if (!cache_matches(hdr, sb))
+		goto out_unmap;
+
+	expected = sizeof(*hdr) + (size_t)hdr->nboards * sizeof(*boards) +
+		   (size_t)hdr->npairs * sizeof(*pairs) + hdr->strings_len;
+	if (expected != cache_sb.st_size)
+		goto out_unmap;
+
+	boards = (const void *)(hdr + 1);
+	pairs = (const void *)(boards + hdr->nboards);
+	strings = (const void *)(pairs + hdr->npairs);
+
+	/* Validate everything before creating any device */
+	for (i = 0; i < hdr->nboards; i++) {
+		if (boards[i].first_pair > hdr->npairs ||
+		    boards[i].npairs > hdr->npairs - boards[i].first_pair)
+			goto out_unmap;
+	}
+
+	for (i = 0; i < hdr->npairs; i++) {
+		if (!cache_lookup(strings, hdr->strings_len, pairs[i].key) ||
+		    !cache_lookup(strings, hdr->strings_len, pairs[i].value))
+			goto out_unmap;
+	}
+
+	for (i = 0; i < hdr->nboards; i++) {
+		dev = calloc(1, sizeof(*dev));
+		if (!dev)
+			err(1, "failed to allocate device");
+
+		dev->boot_fd = -1;
+		dev->console_fd = -1;
+		dev->lock_fd = -1;
+
+		list_add(&loaded, &dev->node);
+
+		for (j = 0; j < boards[i].npairs; j++) {
+			pair = &pairs[boards[i].first_pair + j];
+			key = strings + pair->key;
+			value = strings + pair->value;
+
+			if (device_set(dev, key, value) < 0)
+				goto out_free;
 		}
+
+		if (!device_complete(dev))
+			goto out_free;
 	}
 
-	if (!dev->board || !dev->serial || !(dev->open || dev->console_dev)) {
-		fprintf(stderr, "device parser: insufficiently defined device\n");
-		exit(1);
+	list_for_each_entry_safe(dev, tmp, &loaded, node) {
+		list_del(&dev->node);
+		list_add(devices, &dev->node);
+	}
+
+	ret = 0;
+
+out_free:
+	list_for_each_entry_safe(dev, tmp, &loaded, node) {
+		list_del(&dev->node);
+		device_free(dev);
 	}
 
-	device_add(dev);
+out_unmap:
+	munmap(map, cache_sb.st_size);
+out_close:
+	close(fd);
+
+	return ret;
 }
 
-int device_parser(const char *path)
+static void cache_store(struct cache_builder *cb, const struct stat *sb)
+{
+	struct cache_header hdr = {};
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	FILE *fh;
+	int fd;
+
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.dev = sb->st_dev;
+	hdr.ino = sb->st_ino;
+	hdr.size = sb->st_size;
+	hdr.mtime_sec = sb->st_mtim.tv_sec;
+	hdr.mtime_nsec = sb->st_mtim.tv_nsec;
+	hdr.nboards = cb->nboards;
+	hdr.npairs = cb->npairs;
+	hdr.strings_len = cb->strings_len;
+
+	cache_path(sb, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+	/* The cache is an optimization, failing to write it is not an error */
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	fh = fdopen(fd, "w");
+	if (!fh) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fh);
+	fwrite(cb->boards, sizeof(*cb->boards), cb->nboards, fh);
+	fwrite(cb->pairs, sizeof(*cb->pairs), cb->npairs, fh);
+	fwrite(cb->strings, 1, cb->strings_len, fh);
+
+	if (fclose(fh) || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+static void cache_free(struct cache_builder *cb)
 {
-	struct device_parser dp;
+	free(cb->boards);
+	free(cb->pairs);
+	free(cb->strings);
+}
+
+/**
+ * device_parser_read() - parse a board database, without registering boards
+ * @path:	path of the YAML file
+ * @devices:	empty list, filled with the parsed devices
+ *
+ * Safe to call from any thread.
+ *
+ * Return: 0 on success, -ENOENT if @path can't be opened, -EINVAL if it
+ * can't be parsed
+ */
+int device_parser_read(const char *path, struct list_head *devices)
+{
+	struct device_parser *dp;
 	char key[TOKEN_LENGTH];
+	struct device *dev;
+	struct device *tmp;
+	bool cacheable;
+	struct stat sb;
 	FILE *fh;
 
 	fh = fopen(path, "r");
 	if (!fh)
-		return -1;
+		return -ENOENT;
+
+	cacheable = !fstat(fileno(fh), &sb);
+	if (cacheable && !cache_load(&sb, devices)) {
+		fclose(fh);
+		return 0;
+	}
 
-	if(!yaml_parser_initialize(&dp.parser)) {
+	/* Allocated, so that it's well defined after a longjmp() */
+	dp = calloc(1, sizeof(*dp));
+	if (!dp)
+		err(1, "failed to allocate device parser");
+
+	if(!yaml_parser_initialize(&dp->parser)) {
 		fprintf(stderr, "device parser: failed to initialize parser\n");
-		return -1;
+		free(dp);
+		fclose(fh);
+		return -EINVAL;
+	}
+
+	dp->devices = devices;
+
+	if (setjmp(dp->error)) {
+		list_for_each_entry_safe(dev, tmp, devices, node) {
+			list_del(&dev->node);
+			device_free(dev);
+		}
+
+		yaml_event_delete(&dp->event);
+		yaml_parser_delete(&dp->parser);
+		cache_free(&dp->cache);
+		free(dp);
+		fclose(fh);
+
+		return -EINVAL;
 	}
 
-	yaml_parser_set_input_file(&dp.parser, fh);
+	yaml_parser_set_input_file(&dp->parser, fh);
 
-	nextsym(&dp);
+	nextsym(dp);
 
-	expect(&dp, YAML_STREAM_START_EVENT, NULL);
+	expect(dp, YAML_STREAM_START_EVENT, NULL);
 
-	expect(&dp, YAML_DOCUMENT_START_EVENT, NULL);
-	expect(&dp, YAML_MAPPING_START_EVENT, NULL);
+	expect(dp, YAML_DOCUMENT_START_EVENT, NULL);
+	expect(dp, YAML_MAPPING_START_EVENT, NULL);
 
-	if (accept(&dp, YAML_SCALAR_EVENT, key)) {
-		expect(&dp, YAML_SEQUENCE_START_EVENT, NULL);
+	if (accept(dp, YAML_SCALAR_EVENT, key)) {
+		expect(dp, YAML_SEQUENCE_START_EVENT, NULL);
 
-		while (accept(&dp, YAML_MAPPING_START_EVENT, NULL)) {
-			parse_board(&dp);
-			expect(&dp, YAML_MAPPING_END_EVENT, NULL);
+		while (accept(dp, YAML_MAPPING_START_EVENT, NULL)) {
+			parse_board(dp);
+			expect(dp, YAML_MAPPING_END_EVENT, NULL);
 		}
 
-		expect(&dp, YAML_SEQUENCE_END_EVENT, NULL);
+		expect(dp, YAML_SEQUENCE_END_EVENT, NULL);
 	}
 
-	expect(&dp, YAML_MAPPING_END_EVENT, NULL);
-	expect(&dp, YAML_DOCUMENT_END_EVENT, NULL);
-	expect(&dp, YAML_STREAM_END_EVENT, NULL);
+	expect(dp, YAML_MAPPING_END_EVENT, NULL);
+	expect(dp, YAML_DOCUMENT_END_EVENT, NULL);
+	expect(dp, YAML_STREAM_END_EVENT, NULL);
 
-	yaml_event_delete(&dp.event);
-	yaml_parser_delete(&dp.parser);
+	yaml_event_delete(&dp->event);
+	yaml_parser_delete(&dp->parser);
 
 	fclose(fh);
 
+	if (cacheable)
+		cache_store(&dp->cache, &sb);
+	cache_free(&dp->cache);
+	free(dp);
+
+	return 0;
+}
+
+/**
+ * device_parser() - parse and register the boards of a board database
+ * @path:	path of the YAML file
+ *
+ * Return: 0 on success, -1 if @path can't be opened; exits on parse errors
+ */
+int device_parser(const char *path)
+{
+	struct list_head devices = LIST_INIT(devices);
+	struct device *dev;
+	struct device *tmp;
+	int ret;
+
+	ret = device_parser_read(path, &devices);
+	if (ret == -ENOENT)
+		return -1;
+	else if (ret < 0)
+		exit(1);
+
+	list_for_each_entry_safe(dev, tmp, &devices, node) {
+		list_del(&dev->node);
+		device_add(dev);
+	}
+
 	return 0;
 }
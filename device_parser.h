@@ -1,6 +1,9 @@
 #ifndef __DEVICE_PARSER_H__
 #define __DEVICE_PARSER_H__
 
+#include "list.h"
+
 int device_parser(const char *path);
+int device_parser_read(const char *path, struct list_head *devices);
 
 #endif
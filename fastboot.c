@@ -28,16 +28,20 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
 #include <linux/usbdevice_fs.h>
 #include <linux/usb/ch9.h>
 
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libudev.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,6 +50,7 @@
 
 #include "cdba-server.h"
 #include "fastboot.h"
+#include "hotplug.h"
 
 #define MAX_USBFS_BULK_SIZE (16*1024)
 
@@ -53,6 +58,14 @@ struct fastboot {
 	const char *serial;
 
 	int fd;
+	/* Serializes use of fd between the boot thread and hotplug removal */
+	pthread_mutex_t fd_lock;
+	/* Text from the device held back while deferred, under fd_lock */
+	bool deferred;
+	char *msgs;
+	size_t msgs_len;
+	/* Set from the event loop to cut a download short */
+	bool aborted;
 	unsigned ep_in;
 	unsigned ep_out;
 
@@ -65,6 +78,10 @@ struct fastboot {
 	int state;
 
 	struct udev_monitor *mon;
+
+	int hotplug_fd;
+	char hotplug_buf[HOTPLUG_LINE_MAX];
+	size_t hotplug_len;
 };
 
 enum {
@@ -73,6 +90,65 @@ enum {
 	FASTBOOT_STATE_CLOSED,
 };
 
+/* Pass text from the device on, or hold it back, see fastboot_defer() */
+static void fastboot_report(struct fastboot *fb, const char *text)
+{
+	size_t len = strlen(text) + 1;
+	char *msgs;
+
+	pthread_mutex_lock(&fb->fd_lock);
+	if (fb->deferred) {
+		msgs = realloc(fb->msgs, fb->msgs_len + len);
+		if (msgs) {
+			memcpy(msgs + fb->msgs_len, text, len);
+			fb->msgs = msgs;
+			fb->msgs_len += len;
+		}
+		pthread_mutex_unlock(&fb->fd_lock);
+		return;
+	}
+	pthread_mutex_unlock(&fb->fd_lock);
+
+	if (fb->ops && fb->ops->info)
+		fb->ops->info(fb, text, len - 1);
+	else
+		fprintf(stderr, "%s\n", text);
+}
+
+/**
+ * fastboot_defer() - hold back, or deliver, text received from the device
+ * @fb:		fastboot device
+ * @defer:	whether to hold back text
+ *
+ * While the device is driven from another thread, its INFO and FAIL text and
+ * status are queued, to be passed to the info callback from the event loop
+ * once deferral is turned off.
+ */
+void fastboot_defer(struct fastboot *fb, bool defer)
+{
+	size_t len;
+	size_t off;
+	char *msgs;
+
+	pthread_mutex_lock(&fb->fd_lock);
+	fb->deferred = defer;
+	msgs = fb->msgs;
+	len = fb->msgs_len;
+	if (!defer) {
+		fb->msgs = NULL;
+		fb->msgs_len = 0;
+	}
+	pthread_mutex_unlock(&fb->fd_lock);
+
+	if (defer)
+		return;
+
+	for (off = 0; off < len; off += strlen(msgs + off) + 1)
+		fastboot_report(fb, msgs + off);
+
+	free(msgs);
+}
+
 static int fastboot_read(struct fastboot *fb, char *buf, size_t len)
 {
 	struct usbdevfs_bulktransfer bulk = {0};
@@ -85,7 +161,9 @@ static int fastboot_read(struct fastboot *fb, char *buf, size_t len)
 		bulk.data = status;
 		bulk.timeout = 1000;
 
+		pthread_mutex_lock(&fb->fd_lock);
 		n = ioctl(fb->fd, USBDEVFS_BULK, &bulk);
+		pthread_mutex_unlock(&fb->fd_lock);
 		if (n < 0) {
 			warn("failed to receive usb bulk transfer");
 			return -ENXIO;
@@ -99,7 +177,7 @@ static int fastboot_read(struct fastboot *fb, char *buf, size_t len)
 		}
 
 		if (strncmp(status, "INFO", 4) == 0) {
-			fb->ops->info(fb, status + 4, n - 4);
+			fastboot_report(fb, status + 4);
 		} else if (strncmp(status, "OKAY", 4) == 0) {
 			if (buf) {
 				strncpy(buf, status + 4, len);
@@ -107,7 +185,7 @@ static int fastboot_read(struct fastboot *fb, char *buf, size_t len)
 			}
 			return n - 4;
 		} else if (strncmp(status, "FAIL", 4) == 0) {
-			fprintf(stderr, "%s\n", status + 4);
+			fastboot_report(fb, status + 4);
 			return -ENXIO;
 		} else if (strncmp(status, "DATA", 4) == 0) {
 			return strtol(status + 4, NULL, 16);
@@ -129,7 +207,9 @@ static int fastboot_write(struct fastboot *fb, const void *data, size_t len)
 		bulk.data = (void*)data;
 		bulk.timeout = 1000;
 
+		pthread_mutex_lock(&fb->fd_lock);
 		n = ioctl(fb->fd, USBDEVFS_BULK, &bulk);
+		pthread_mutex_unlock(&fb->fd_lock);
 		if (n < 0) {
 			warn("failed to send usb bulk transfer");
 			return -1;
@@ -248,17 +328,20 @@ static int parse_usb_desc(int usbfd, unsigned *ep_in, unsigned *ep_out)
 	return -ENOENT;
 }
 
-static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *dev)
+static int handle_fastboot_add(struct fastboot *fastboot, const char *dev_path,
+			       const char *dev_node)
 {
-	const char *dev_path;
-	const char *dev_node;
 	unsigned ep_out;
 	unsigned ep_in;
 	int usbfd;
 	int ret;
 
-	dev_path = udev_device_get_devpath(dev);
-	dev_node = udev_device_get_devnode(dev);
+	if (!dev_path || !dev_node)
+		return -EINVAL;
+
+	/* Announced again, e.g. when enumerating after losing the broker */
+	if (fastboot->state == FASTBOOT_STATE_OPENED)
+		return 0;
 
 	usbfd = open(dev_node, O_RDWR);
 	if (usbfd < 0)
@@ -283,7 +366,26 @@ static int handle_fastboot_add(struct fastboot *fastboot, struct udev_device *de
 	return 0;
 }
 
-static int handle_udev_event(int fd, void *data)
+static void handle_fastboot_remove(struct fastboot *fastboot, const char *dev_path)
+{
+	if (!fastboot->dev_path || strcmp(dev_path, fastboot->dev_path))
+		return;
+
+	pthread_mutex_lock(&fastboot->fd_lock);
+	close(fastboot->fd);
+	fastboot->fd = -1;
+	pthread_mutex_unlock(&fastboot->fd_lock);
+
+	free((void *)fastboot->dev_path);
+	fastboot->dev_path = NULL;
+
+	if (fastboot->ops && fastboot->ops->disconnect)
+		fastboot->ops->disconnect(fastboot->data);
+
+	fastboot->state = FASTBOOT_STATE_CLOSED;
+}
+
+static int handle_udev_event(int fd, unsigned int revents, void *data)
 {
 	struct fastboot *fastboot = data;
 	struct udev_device* dev;
@@ -304,19 +406,9 @@ static int handle_udev_event(int fd, void *data)
 		if (!serial || strcmp(serial, fastboot->serial))
 			goto unref_dev;
 
-		handle_fastboot_add(fastboot, dev);
+		handle_fastboot_add(fastboot, dev_path, udev_device_get_devnode(dev));
 	} else if (!strcmp(action, "remove")) {
-		if (!fastboot->dev_path || strcmp(dev_path, fastboot->dev_path))
-			goto unref_dev;
-
-		close(fastboot->fd);
-		fastboot->fd = -1;
-		fastboot->dev_path = NULL;
-
-		if (fastboot->ops && fastboot->ops->disconnect)
-			fastboot->ops->disconnect(fastboot->data);
-
-		fastboot->state = FASTBOOT_STATE_CLOSED;
+		handle_fastboot_remove(fastboot, dev_path);
 	}
 
 unref_dev:
@@ -324,10 +416,9 @@ unref_dev:
 
 	return 0;
 }
-	
-struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *data)
+
+static void fastboot_udev_open(struct fastboot *fb)
 {
-	struct fastboot *fb;
 	struct udev* udev;
 	int fd;
 	struct udev_enumerate* udev_enum;
@@ -337,27 +428,17 @@ struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, voi
 	if (!udev)
 		err(1, "udev_new() failed");
 
-	fb = calloc(1, sizeof(struct fastboot));
-	if (!fb)
-		err(1, "failed to allocate fastboot structure");
-
-	fb->serial = serial;
-	fb->ops = ops;
-	fb->data = data;
-	
-	fb->state = FASTBOOT_STATE_START;
-	
 	fb->mon = udev_monitor_new_from_netlink(udev, "udev");
 	udev_monitor_filter_add_match_subsystem_devtype(fb->mon, "usb", NULL);
 	udev_monitor_enable_receiving(fb->mon);
 
 	fd = udev_monitor_get_fd(fb->mon);
 
-	watch_add_readfd(fd, handle_udev_event, fb);
+	watch_add(fd, WATCH_READ, handle_udev_event, fb);
 
 	udev_enum = udev_enumerate_new(udev);
 	udev_enumerate_add_match_subsystem(udev_enum, "usb");
-	udev_enumerate_add_match_sysattr(udev_enum, "serial", serial);
+	udev_enumerate_add_match_sysattr(udev_enum, "serial", fb->serial);
 	udev_enumerate_scan_devices(udev_enum);
 
 	first = udev_enumerate_get_list_entry(udev_enum);
@@ -367,14 +448,177 @@ struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, voi
 
 		path = udev_list_entry_get_name(item);
 		dev = udev_device_new_from_syspath(udev, path);
-		handle_fastboot_add(fb, dev);
+		handle_fastboot_add(fb, udev_device_get_devpath(dev),
+				    udev_device_get_devnode(dev));
 	}
 
 	udev_enumerate_unref(udev_enum);
+}
+
+static void handle_hotplug_line(struct fastboot *fb, char *line)
+{
+	char *dev_path;
+	char *dev_node;
+	char *action;
+
+	action = strtok(line, " ");
+	dev_path = strtok(NULL, " ");
+	dev_node = strtok(NULL, " ");
+
+	if (!action || !dev_path)
+		return;
+
+	if (!strcmp(action, "add"))
+		handle_fastboot_add(fb, dev_path, dev_node);
+	else if (!strcmp(action, "remove"))
+		handle_fastboot_remove(fb, dev_path);
+}
+
+static int handle_hotplug_event(int fd, unsigned int revents, void *data)
+{
+	struct fastboot *fb = data;
+	char *line;
+	char *eol;
+	ssize_t n;
+
+	n = read(fd, fb->hotplug_buf + fb->hotplug_len,
+		 sizeof(fb->hotplug_buf) - fb->hotplug_len - 1);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+
+	if (n <= 0) {
+		warnx("lost hotplug broker, falling back to udev");
+
+		watch_del(fd);
+		close(fd);
+		fb->hotplug_fd = -1;
+
+		fastboot_udev_open(fb);
+		return 0;
+	}
+
+	fb->hotplug_len += n;
+	fb->hotplug_buf[fb->hotplug_len] = '\0';
+
+	line = fb->hotplug_buf;
+	while ((eol = strchr(line, '\n')) != NULL) {
+		*eol = '\0';
+		handle_hotplug_line(fb, line);
+		line = eol + 1;
+	}
+
+	fb->hotplug_len -= line - fb->hotplug_buf;
+	memmove(fb->hotplug_buf, line, fb->hotplug_len);
+
+	return 0;
+}
+
+static int fastboot_hotplug_open(struct fastboot *fb)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char req[HOTPLUG_LINE_MAX];
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int flags;
+	int ret;
+	int fd;
+	int n;
+
+	n = snprintf(req, sizeof(req), "%s\n", fb->serial);
+	if (n >= sizeof(req))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	strcpy(addr.sun_path, CDBA_HOTPLUG_SOCKET);
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0)
+		goto err_close;
+
+	/* The broker tells us which device node to open */
+	ret = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+	if (ret < 0)
+		goto err_close;
+
+	if (cred.uid != 0 && cred.uid != getuid()) {
+		warnx("ignoring hotplug broker of uid %u", cred.uid);
+		goto err_close;
+	}
+
+	ret = write(fd, req, n);
+	if (ret != n)
+		goto err_close;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	fb->hotplug_fd = fd;
+	watch_add(fd, WATCH_READ, handle_hotplug_event, fb);
+
+	return 0;
+
+err_close:
+	close(fd);
+	return -1;
+}
+
+struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *data)
+{
+	struct fastboot *fb;
+
+	fb = calloc(1, sizeof(struct fastboot));
+	if (!fb)
+		err(1, "failed to allocate fastboot structure");
+
+	fb->serial = serial;
+	fb->ops = ops;
+	fb->data = data;
+	fb->fd = -1;
+	fb->hotplug_fd = -1;
+	pthread_mutex_init(&fb->fd_lock, NULL);
+
+	fb->state = FASTBOOT_STATE_START;
+
+	/* Prefer the host wide broker, fall back to a private udev monitor */
+	if (fastboot_hotplug_open(fb) < 0)
+		fastboot_udev_open(fb);
 
 	return fb;
 }
 
+/**
+ * fastboot_close() - stop monitoring for the device and close it
+ * @fb:		fastboot context, freed
+ *
+ * Must not race a transfer, see device_close().
+ */
+void fastboot_close(struct fastboot *fb)
+{
+	struct udev *udev;
+
+	if (fb->hotplug_fd >= 0) {
+		watch_del(fb->hotplug_fd);
+		close(fb->hotplug_fd);
+	}
+
+	if (fb->mon) {
+		udev = udev_monitor_get_udev(fb->mon);
+		watch_del(udev_monitor_get_fd(fb->mon));
+		udev_monitor_unref(fb->mon);
+		udev_unref(udev);
+	}
+
+	if (fb->fd >= 0)
+		close(fb->fd);
+
+	free((void *)fb->dev_path);
+	free(fb->msgs);
+	pthread_mutex_destroy(&fb->fd_lock);
+	free(fb);
+}
+
 int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len)
 {
 	char cmd[128];
@@ -404,11 +648,17 @@ int fastboot_download(struct fastboot *fb, const void *data, size_t len)
 
 	n = fastboot_read(fb, buf, MAX_USBFS_BULK_SIZE);
 	if (n < 0) {
-		fprintf(stderr, "remote rejected download request\n");
+		fastboot_report(fb, "remote rejected download request");
+		free(buf);
 		return -1;
 	}
 
 	while (len > 0) {
+		if (__atomic_load_n(&fb->aborted, __ATOMIC_ACQUIRE)) {
+			ret = -ECANCELED;
+			goto out;
+		}
+
 		xfer = MIN(len, MAX_USBFS_BULK_SIZE);
 
 		ret = fastboot_write(fb, data + offset, xfer);
@@ -426,6 +676,18 @@ out:
 	return ret;
 }
 
+/**
+ * fastboot_abort() - abort, or stop aborting, downloads to a device
+ * @fb:		fastboot device
+ * @abort:	whether a download in progress, or started later, is aborted
+ *
+ * Safe to call while another thread is running fastboot_download().
+ */
+void fastboot_abort(struct fastboot *fb, bool abort)
+{
+	__atomic_store_n(&fb->aborted, abort, __ATOMIC_RELEASE);
+}
+
 int fastboot_boot(struct fastboot *fb)
 {
 	char buf[80];
@@ -435,7 +697,7 @@ int fastboot_boot(struct fastboot *fb)
 
 	n = fastboot_read(fb, buf, sizeof(buf));
 	if (n >= 0)
-		fprintf(stderr, "%s\n", buf);
+		fastboot_report(fb, buf);
 
 	return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef __FASTBOOT_H__
 #define __FASTBOOT_H__
 
+#include <stdbool.h>
+
 struct fastboot;
 
 struct fastboot_ops {
@@ -10,8 +12,11 @@ struct fastboot_ops {
 };
 
 struct fastboot *fastboot_open(const char *serial, struct fastboot_ops *ops, void *);
+void fastboot_close(struct fastboot *fb);
 int fastboot_getvar(struct fastboot *fb, const char *var, char *buf, size_t len);
 int fastboot_download(struct fastboot *fb, const void *data, size_t len);
+void fastboot_abort(struct fastboot *fb, bool abort);
+void fastboot_defer(struct fastboot *fb, bool defer);
 int fastboot_boot(struct fastboot *fb);
 int fastboot_erase(struct fastboot *fb, const char *partition);
 int fastboot_set_active(struct fastboot *fb, const char *active);
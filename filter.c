@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdba.h"
+#include "filter.h"
+
+/* Longer lines are matched in pieces of this size */
+#define FILTER_LINE_MAX	4096
+
+struct filter_line {
+	char *data;
+	size_t len;
+};
+
+struct filter {
+	int mode;
+	unsigned int context;
+
+	regex_t *res;
+	unsigned int nres;
+
+	/* Line being received */
+	char line[FILTER_LINE_MAX + 1];
+	size_t len;
+
+	/* The line is forwarded as it comes in, sent bytes of it so far */
+	bool forwarding;
+	bool matched;
+	size_t sent;
+
+	/* Lines preceding the next match, a ring of up to context lines */
+	struct filter_line *before;
+	unsigned int before_head;
+	unsigned int before_count;
+
+	/* Lines still to forward after the last match */
+	unsigned int after;
+
+	/* The complete console output is written here, -1 if not recording */
+	int record_fd;
+};
+
+/**
+ * filter_new() - set up a console filter
+ * @mode:	FILTER_FULL, FILTER_MATCHED or FILTER_CONTEXT
+ * @context:	lines to forward before and after each match in FILTER_CONTEXT
+ * @patterns:	NUL terminated regular expressions, back to back
+ * @len:	length of @patterns
+ * @errbuf:	filled with a description of the failure
+ * @errlen:	size of @errbuf
+ *
+ * Return: the new filter, NULL on failure
+ */
+struct filter *filter_new(int mode, unsigned int context, const char *patterns,
+			  size_t len, char *errbuf, size_t errlen)
+{
+	struct filter *filter;
+	const char *end = patterns + len;
+	const char *p;
+	regex_t *res;
+	int ret;
+
+	if (mode != FILTER_FULL && mode != FILTER_MATCHED && mode != FILTER_CONTEXT) {
+		snprintf(errbuf, errlen, "unknown filter mode %d", mode);
+		return NULL;
+	}
+
+	filter = calloc(1, sizeof(*filter));
+	if (!filter)
+		err(1, "failed to allocate console filter");
+
+	filter->mode = mode;
+	filter->context = mode == FILTER_CONTEXT ? context : 0;
+	filter->record_fd = -1;
+
+	if (filter->context) {
+		filter->before = calloc(filter->context, sizeof(*filter->before));
+		if (!filter->before)
+			err(1, "failed to allocate console filter");
+	}
+
+	for (p = patterns; p < end; p += strlen(p) + 1) {
+		if (!memchr(p, '\0', end - p)) {
+			snprintf(errbuf, errlen, "unterminated pattern");
+			goto err;
+		}
+
+		res = realloc(filter->res, (filter->nres + 1) * sizeof(*res));
+		if (!res)
+			err(1, "failed to allocate console filter");
+		filter->res = res;
+
+		ret = regcomp(&filter->res[filter->nres], p, REG_EXTENDED | REG_NOSUB);
+		if (ret) {
+			regerror(ret, &filter->res[filter->nres], errbuf, errlen);
+			goto err;
+		}
+
+		filter->nres++;
+	}
+
+	return filter;
+
+err:
+	filter_free(filter);
+	return NULL;
+}
+
+/**
+ * filter_record() - write the complete console output to a file
+ * @filter:	filter to record the input of
+ * @fd:		file to write to, owned by the filter from here
+ */
+void filter_record(struct filter *filter, int fd)
+{
+	if (filter->record_fd >= 0)
+		close(filter->record_fd);
+
+	filter->record_fd = fd;
+}
+
+static bool filter_match(struct filter *filter)
+{
+	size_t end = filter->len;
+	bool match = false;
+	unsigned int i;
+	char c;
+
+	while (end && (filter->line[end - 1] == '\n' || filter->line[end - 1] == '\r'))
+		end--;
+
+	c = filter->line[end];
+	filter->line[end] = '\0';
+
+	for (i = 0; i < filter->nres && !match; i++)
+		match = !regexec(&filter->res[i], filter->line, 0, NULL, 0);
+
+	filter->line[end] = c;
+
+	return match;
+}
+
+static void filter_flush_before(struct filter *filter, filter_emit_t emit, void *ctx)
+{
+	struct filter_line *line;
+
+	while (filter->before_count) {
+		line = &filter->before[filter->before_head];
+
+		emit(line->data, line->len, ctx);
+		free(line->data);
+		line->data = NULL;
+
+		filter->before_head = (filter->before_head + 1) % filter->context;
+		filter->before_count--;
+	}
+}
+
+static void filter_keep_before(struct filter *filter)
+{
+	struct filter_line *line;
+	unsigned int idx;
+
+	if (!filter->context)
+		return;
+
+	/* Evict the oldest line when full */
+	if (filter->before_count == filter->context) {
+		free(filter->before[filter->before_head].data);
+		filter->before_head = (filter->before_head + 1) % filter->context;
+		filter->before_count--;
+	}
+
+	idx = (filter->before_head + filter->before_count) % filter->context;
+	line = &filter->before[idx];
+
+	line->data = malloc(filter->len);
+	if (!line->data)
+		err(1, "failed to allocate console filter line");
+	memcpy(line->data, filter->line, filter->len);
+	line->len = filter->len;
+
+	filter->before_count++;
+}
+
+/* Decide on the line received so far, once matched it's forwarded right away */
+static void filter_start(struct filter *filter, filter_emit_t emit, void *ctx)
+{
+	if (filter->forwarding)
+		return;
+
+	if (filter_match(filter)) {
+		filter_flush_before(filter, emit, ctx);
+		filter->forwarding = true;
+		filter->matched = true;
+	} else if (filter->after) {
+		filter->forwarding = true;
+	}
+}
+
+static void filter_line_end(struct filter *filter, filter_emit_t emit, void *ctx)
+{
+	filter_start(filter, emit, ctx);
+
+	if (filter->forwarding) {
+		emit(filter->line + filter->sent, filter->len - filter->sent, ctx);
+
+		if (filter->matched)
+			filter->after = filter->context;
+		else
+			filter->after--;
+	} else {
+		filter_keep_before(filter);
+	}
+
+	filter->len = 0;
+	filter->sent = 0;
+	filter->forwarding = false;
+	filter->matched = false;
+}
+
+/**
+ * filter_feed() - pass console output through the filter
+ * @filter:	filter to apply
+ * @data:	console output
+ * @len:	length of @data
+ * @emit:	invoked with the parts of @data to forward to the client
+ * @ctx:	context passed to @emit
+ */
+void filter_feed(struct filter *filter, const void *data, size_t len,
+		 filter_emit_t emit, void *ctx)
+{
+	const char *p = data;
+	const char *nl;
+	size_t chunk;
+	ssize_t n;
+
+	if (filter->record_fd >= 0) {
+		n = write(filter->record_fd, data, len);
+		if (n != len) {
+			warn("failed to record console output");
+			close(filter->record_fd);
+			filter->record_fd = -1;
+		}
+	}
+
+	if (filter->mode == FILTER_FULL) {
+		emit(data, len, ctx);
+		return;
+	}
+
+	while (len) {
+		nl = memchr(p, '\n', len);
+		chunk = nl ? nl - p + 1 : len;
+		chunk = MIN(chunk, FILTER_LINE_MAX - filter->len);
+
+		memcpy(filter->line + filter->len, p, chunk);
+		filter->len += chunk;
+		p += chunk;
+		len -= chunk;
+
+		if (filter->line[filter->len - 1] == '\n' ||
+		    filter->len == FILTER_LINE_MAX)
+			filter_line_end(filter, emit, ctx);
+	}
+
+	/* Prompts, e.g. "login: ", don't end in a newline */
+	if (filter->len) {
+		filter_start(filter, emit, ctx);
+
+		if (filter->forwarding) {
+			emit(filter->line + filter->sent, filter->len - filter->sent, ctx);
+			filter->sent = filter->len;
+		}
+	}
+}
+
+void filter_free(struct filter *filter)
+{
+	unsigned int i;
+
+	for (i = 0; i < filter->nres; i++)
+		regfree(&filter->res[i]);
+	free(filter->res);
+
+	for (i = 0; i < filter->context; i++)
+		free(filter->before[i].data);
+	free(filter->before);
+
+	if (filter->record_fd >= 0)
+		close(filter->record_fd);
+
+	free(filter);
+}
@@ -0,0 +1,22 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+
+/*
+ * Console output of a session may be filtered down to the lines matching any
+ * of a set of POSIX extended regular expressions, optionally with a number of
+ * lines of context around each match.
+ */
+struct filter;
+
+typedef void (*filter_emit_t)(const void *data, size_t len, void *ctx);
+
+struct filter *filter_new(int mode, unsigned int context, const char *patterns,
+			  size_t len, char *errbuf, size_t errlen);
+void filter_record(struct filter *filter, int fd);
+void filter_feed(struct filter *filter, const void *data, size_t len,
+		 filter_emit_t emit, void *ctx);
+void filter_free(struct filter *filter);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __HOTPLUG_H__
+#define __HOTPLUG_H__
+
+/*
+ * cdba-hotplug keeps a single udev monitor for the host and forwards USB
+ * add/remove events to the cdba-server instance that registered interest in
+ * the device's serial number.
+ *
+ * A client connects to the socket and sends "<serial>\n", the broker replies
+ * with one line per event:
+ *
+ *   add <devpath> <devnode>
+ *   remove <devpath>
+ *
+ * The socket's directory is only writable by the broker, which clients only
+ * trust when running as root or as the same user as themselves.
+ */
+#define CDBA_HOTPLUG_SOCKET "/tmp/cdba-hotplug/hotplug.sock"
+
+#define HOTPLUG_LINE_MAX 512
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "cdba.h"
+#include "msg_queue.h"
+#include "watch.h"
+
+#define MSG_QUEUE_IOV_MAX	64
+
+#define MSG_QUEUE_CONTROL_LIMIT	(64 * 1024)
+#define MSG_QUEUE_CONSOLE_LIMIT	(1024 * 1024)
+
+/* Must comfortably fit in the client's receive buffer */
+#define MSG_QUEUE_BATCH_SIZE	4096
+#define MSG_QUEUE_BATCH_LATENCY	2
+
+/* Small control messages, e.g. download acks, are recycled by the queue */
+#define MSG_QUEUE_SPARE_SIZE	64
+#define MSG_QUEUE_SPARE_MAX	8
+
+struct qmsg {
+	struct list_head node;
+	int class;
+
+	size_t len;
+	size_t offset;
+
+	/* Room in @buf */
+	size_t size;
+
+	/* struct msg header followed by the payload */
+	uint8_t buf[];
+};
+
+static int msg_queue_class(int type)
+{
+	switch (type) {
+	case MSG_CONSOLE:
+		return MSG_CLASS_CONSOLE;
+	default:
+		return MSG_CLASS_CONTROL;
+	}
+}
+
+static struct qmsg *msg_queue_alloc(struct msg_queue *q, size_t size)
+{
+	struct qmsg *qm;
+
+	if (size <= MSG_QUEUE_SPARE_SIZE) {
+		if (!list_empty(&q->spare)) {
+			qm = list_entry_first(&q->spare, struct qmsg, node);
+			list_del(&qm->node);
+			q->spare_count--;
+			return qm;
+		}
+
+		size = MSG_QUEUE_SPARE_SIZE;
+	}
+
+	qm = malloc(sizeof(*qm) + size);
+	if (!qm)
+		err(1, "failed to allocate message");
+
+	qm->size = size;
+
+	return qm;
+}
+
+static void msg_queue_free(struct msg_queue *q, struct qmsg *qm)
+{
+	if (qm->size == MSG_QUEUE_SPARE_SIZE &&
+	    q->spare_count < MSG_QUEUE_SPARE_MAX) {
+		list_add(&q->spare, &qm->node);
+		q->spare_count++;
+		return;
+	}
+
+	free(qm);
+}
+
+static void msg_queue_discard(struct msg_queue *q)
+{
+	struct qmsg *tmp;
+	struct qmsg *qm;
+	int i;
+
+	for (i = 0; i < MSG_CLASS_COUNT; i++) {
+		list_for_each_entry_safe(qm, tmp, &q->class[i].msgs, node) {
+			list_del(&qm->node);
+			msg_queue_free(q, qm);
+		}
+
+		q->class[i].bytes = 0;
+	}
+
+	q->partial = NULL;
+	q->batch = NULL;
+}
+
+/* Must be the last use of @q, it's likely released by the callback */
+static void msg_queue_closed(struct msg_queue *q)
+{
+	void (*closed)(void *data) = q->closed;
+
+	if (!closed)
+		return;
+
+	q->closed = NULL;
+	closed(q->closed_data);
+}
+
+static void msg_queue_close_expired(void *data)
+{
+	struct msg_queue *q = data;
+
+	q->close_timer = NULL;
+	msg_queue_closed(q);
+}
+
+static int msg_queue_writable(int fd, unsigned int revents, void *data)
+{
+	struct msg_queue *q = data;
+
+	/* Only write interest is ever requested, so this is an error/hangup */
+	if (!(revents & WATCH_READ))
+		return msg_queue_flush(q);
+
+	q->broken = true;
+	msg_queue_discard(q);
+	watch_mod(q->fd, 0);
+
+	msg_queue_closed(q);
+
+	return 0;
+}
+
+/**
+ * msg_queue_init() - initialize a queue of outgoing messages
+ * @q:		queue to initialize
+ * @fd:		file descriptor to write messages to, made non-blocking
+ */
+void msg_queue_init(struct msg_queue *q, int fd)
+{
+	int flags;
+	int i;
+
+	memset(q, 0, sizeof(*q));
+	q->fd = fd;
+
+	for (i = 0; i < MSG_CLASS_COUNT; i++)
+		list_init(&q->class[i].msgs);
+	list_init(&q->spare);
+
+	q->class[MSG_CLASS_CONTROL].limit = MSG_QUEUE_CONTROL_LIMIT;
+	q->class[MSG_CLASS_CONSOLE].limit = MSG_QUEUE_CONSOLE_LIMIT;
+	q->batch_latency_ms = MSG_QUEUE_BATCH_LATENCY;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	watch_add(fd, 0, msg_queue_writable, q);
+}
+
+bool msg_queue_empty(struct msg_queue *q)
+{
+	int i;
+
+	for (i = 0; i < MSG_CLASS_COUNT; i++) {
+		if (!list_empty(&q->class[i].msgs))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * msg_queue_set_latency() - set the deadline for batching console data
+ * @q:		queue to configure
+ * @latency_ms:	longest time console data is held back, 0 to disable batching
+ */
+void msg_queue_set_latency(struct msg_queue *q, unsigned int latency_ms)
+{
+	q->batch_latency_ms = latency_ms;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * msg_queue_compress() - compress console frames from here on
+ * @q:		queue to configure
+ *
+ * Console frames are deflated into one stream as they are sealed, flushing
+ * the stream with each frame. Frames are only ever dropped before that, so
+ * the client always receives the complete stream.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int msg_queue_compress(struct msg_queue *q)
+{
+	z_stream *zs;
+
+	if (q->deflate)
+		return 0;
+
+	zs = calloc(1, sizeof(*zs));
+	if (!zs)
+		err(1, "failed to allocate deflate stream");
+
+	/* Console output is repetitive enough, keep the CPU for the other boards */
+	if (deflateInit(zs, Z_BEST_SPEED) != Z_OK) {
+		free(zs);
+		return -ENOMEM;
+	}
+
+	q->deflate = zs;
+
+	return 0;
+}
+
+static void msg_queue_deflate(struct msg_queue *q, struct qmsg *qm)
+{
+	struct msg_queue_class *class = &q->class[MSG_CLASS_CONSOLE];
+	struct msg *hdr = (struct msg *)qm->buf;
+	z_stream *zs = q->deflate;
+	struct qmsg *zqm = NULL;
+	size_t size = sizeof(*hdr) + deflateBound(zs, hdr->len) + 16;
+	size_t used = sizeof(*hdr);
+
+	zs->next_in = hdr->data;
+	zs->avail_in = hdr->len;
+
+	/* A flush may take more than deflateBound(), grow until it's done */
+	do {
+		zqm = realloc(zqm, sizeof(*zqm) + size);
+		if (!zqm)
+			err(1, "failed to allocate message");
+
+		zs->next_out = zqm->buf + used;
+		zs->avail_out = size - used;
+		deflate(zs, Z_SYNC_FLUSH);
+
+		used = size - zs->avail_out;
+		size *= 2;
+	} while (!zs->avail_out);
+
+	zqm->class = MSG_CLASS_CONSOLE;
+	zqm->len = used;
+	zqm->offset = 0;
+	zqm->size = size / 2;
+
+	hdr = (struct msg *)zqm->buf;
+	hdr->type = MSG_CONSOLE_DEFLATE;
+	hdr->len = used - sizeof(*hdr);
+
+	/* The open batch is always last in its class */
+	list_del(&qm->node);
+	list_add(&class->msgs, &zqm->node);
+	class->bytes += zqm->len;
+	class->bytes -= qm->len;
+
+	msg_queue_free(q, qm);
+}
+
+static void msg_queue_deflate_end(struct msg_queue *q)
+{
+	if (!q->deflate)
+		return;
+
+	deflateEnd(q->deflate);
+	free(q->deflate);
+	q->deflate = NULL;
+}
+#else
+int msg_queue_compress(struct msg_queue *q)
+{
+	return -EOPNOTSUPP;
+}
+
+static void msg_queue_deflate(struct msg_queue *q, struct qmsg *qm)
+{
+}
+
+static void msg_queue_deflate_end(struct msg_queue *q)
+{
+}
+#endif
+
+static void msg_queue_seal(struct msg_queue *q)
+{
+	if (q->batch_timer) {
+		watch_timer_cancel(q->batch_timer);
+		q->batch_timer = NULL;
+	}
+
+	if (q->batch) {
+		if (q->deflate)
+			msg_queue_deflate(q, q->batch);
+
+		q->batch = NULL;
+		watch_mod(q->fd, WATCH_WRITE);
+	}
+}
+
+static void msg_queue_batch_expired(void *data)
+{
+	struct msg_queue *q = data;
+
+	q->batch_timer = NULL;
+	msg_queue_seal(q);
+}
+
+/*
+ * Console data is gathered into frames of up to MSG_QUEUE_BATCH_SIZE bytes,
+ * which are sent once full or batch_latency_ms after their first byte.
+ */
+static int msg_queue_push_console(struct msg_queue *q, const void *data, size_t len)
+{
+	struct msg_queue_class *class = &q->class[MSG_CLASS_CONSOLE];
+	struct qmsg *qm;
+	struct msg *hdr;
+	size_t chunk;
+
+	if (class->bytes + len > class->limit) {
+		class->dropped += len;
+		return -ENOBUFS;
+	}
+
+	while (len) {
+		if (!q->batch) {
+			qm = msg_queue_alloc(q, sizeof(*hdr) + MSG_QUEUE_BATCH_SIZE);
+			qm->class = MSG_CLASS_CONSOLE;
+			qm->len = sizeof(*hdr);
+			qm->offset = 0;
+
+			hdr = (struct msg *)qm->buf;
+			hdr->type = MSG_CONSOLE;
+			hdr->len = 0;
+
+			list_add(&class->msgs, &qm->node);
+			class->bytes += qm->len;
+
+			q->batch = qm;
+		}
+
+		qm = q->batch;
+		hdr = (struct msg *)qm->buf;
+
+		chunk = MIN(len, MSG_QUEUE_BATCH_SIZE - hdr->len);
+		memcpy(qm->buf + qm->len, data, chunk);
+		hdr->len += chunk;
+		qm->len += chunk;
+		class->bytes += chunk;
+
+		data += chunk;
+		len -= chunk;
+
+		if (hdr->len == MSG_QUEUE_BATCH_SIZE || !q->batch_latency_ms)
+			msg_queue_seal(q);
+		else if (!q->batch_timer)
+			q->batch_timer = watch_timer_add(q->batch_latency_ms,
+							 msg_queue_batch_expired, q);
+	}
+
+	return 0;
+}
+
+/**
+ * msg_queue_push() - frame and queue a message
+ * @q:		queue to append the message to
+ * @type:	message type
+ * @data:	payload
+ * @len:	length of @data
+ *
+ * The message is written out once @q's file descriptor is writable. If the
+ * message's class is already holding its limit worth of data the message is
+ * dropped, this is reported once the queue has drained.
+ *
+ * Return: 0 on success, -ENOBUFS if the message was dropped
+ */
+int msg_queue_push(struct msg_queue *q, int type, const void *data, size_t len)
+{
+	int idx = msg_queue_class(type);
+	struct msg_queue_class *class = &q->class[idx];
+	struct qmsg *qm;
+	struct msg *hdr;
+
+	if (q->broken)
+		return -EPIPE;
+
+	if (type == MSG_CONSOLE)
+		return msg_queue_push_console(q, data, len);
+
+	if (class->bytes + sizeof(*hdr) + len > class->limit) {
+		class->dropped += len;
+		return -ENOBUFS;
+	}
+
+	qm = msg_queue_alloc(q, sizeof(*hdr) + len);
+	qm->class = idx;
+	qm->len = sizeof(*hdr) + len;
+	qm->offset = 0;
+
+	hdr = (struct msg *)qm->buf;
+	hdr->type = type;
+	hdr->len = len;
+	if (len)
+		memcpy(hdr->data, data, len);
+
+	list_add(&class->msgs, &qm->node);
+	class->bytes += qm->len;
+
+	/* Coalesce everything queued during this iteration into one writev */
+	watch_mod(q->fd, WATCH_WRITE);
+
+	return 0;
+}
+
+static void msg_queue_report_drops(struct msg_queue *q)
+{
+	struct msg_queue_class *class;
+	int i;
+
+	for (i = 0; i < MSG_CLASS_COUNT; i++) {
+		class = &q->class[i];
+		if (!class->dropped)
+			continue;
+
+		warnx("client too slow, dropped %zu bytes of %s messages",
+		      class->dropped, i == MSG_CLASS_CONSOLE ? "console" : "control");
+		class->dropped = 0;
+	}
+}
+
+/**
+ * msg_queue_flush() - write out as much of the queue as possible
+ * @q:		queue to flush
+ *
+ * Return: 0 on success, negative on failure to write
+ */
+int msg_queue_flush(struct msg_queue *q)
+{
+	struct iovec iov[MSG_QUEUE_IOV_MAX];
+	struct msg_queue_class *class;
+	struct qmsg *tmp;
+	struct qmsg *qm;
+	ssize_t n;
+	size_t chunk;
+	int iovcnt = 0;
+	int i;
+
+	if (q->partial) {
+		qm = q->partial;
+		iov[iovcnt].iov_base = qm->buf + qm->offset;
+		iov[iovcnt].iov_len = qm->len - qm->offset;
+		iovcnt++;
+	}
+
+	for (i = 0; i < MSG_CLASS_COUNT && iovcnt < MSG_QUEUE_IOV_MAX; i++) {
+		list_for_each_entry(qm, &q->class[i].msgs, node) {
+			if (qm == q->partial)
+				continue;
+
+			/* The open batch is always last in its class */
+			if (qm == q->batch)
+				break;
+
+			if (iovcnt == MSG_QUEUE_IOV_MAX)
+				break;
+
+			iov[iovcnt].iov_base = qm->buf;
+			iov[iovcnt].iov_len = qm->len;
+			iovcnt++;
+		}
+	}
+
+	if (!iovcnt) {
+		watch_mod(q->fd, 0);
+		return 0;
+	}
+
+	n = writev(q->fd, iov, iovcnt);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	else if (n < 0)
+		return msg_queue_writable(q->fd, WATCH_READ, q);
+
+	/* Retire messages in the same order as they were gathered */
+	if (q->partial) {
+		qm = q->partial;
+		chunk = MIN((size_t)n, qm->len - qm->offset);
+		qm->offset += chunk;
+		n -= chunk;
+
+		if (qm->offset < qm->len)
+			return 0;
+
+		q->partial = NULL;
+		q->class[qm->class].bytes -= qm->len;
+		list_del(&qm->node);
+		msg_queue_free(q, qm);
+	}
+
+	for (i = 0; i < MSG_CLASS_COUNT && n > 0; i++) {
+		class = &q->class[i];
+
+		list_for_each_entry_safe(qm, tmp, &class->msgs, node) {
+			if (!n)
+				break;
+
+			chunk = MIN((size_t)n, qm->len);
+			n -= chunk;
+
+			if (chunk < qm->len) {
+				qm->offset = chunk;
+				q->partial = qm;
+				break;
+			}
+
+			class->bytes -= qm->len;
+			list_del(&qm->node);
+			msg_queue_free(q, qm);
+		}
+	}
+
+	if (msg_queue_empty(q)) {
+		watch_mod(q->fd, 0);
+		msg_queue_report_drops(q);
+
+		msg_queue_closed(q);
+	}
+
+	return 0;
+}
+
+/**
+ * msg_queue_close() - write out what's queued, then notify the owner
+ * @q:		queue to close
+ * @closed:	invoked once everything is written, or the write side failed
+ * @data:	context passed to @closed
+ *
+ * @closed is always invoked from the event loop, never from within this call.
+ */
+void msg_queue_close(struct msg_queue *q, void (*closed)(void *data), void *data)
+{
+	q->closed = closed;
+	q->closed_data = data;
+
+	msg_queue_seal(q);
+
+	if (q->broken || msg_queue_empty(q))
+		q->close_timer = watch_timer_add(0, msg_queue_close_expired, q);
+	else
+		watch_mod(q->fd, WATCH_WRITE);
+}
+
+/**
+ * msg_queue_abort() - give up on the peer, discarding all queued messages
+ * @q:		queue to abort
+ *
+ * Used when the peer is known to be gone, but the fd hasn't reported so. A
+ * msg_queue_close() waiting for the queue to drain completes right away.
+ */
+void msg_queue_abort(struct msg_queue *q)
+{
+	if (q->batch_timer) {
+		watch_timer_cancel(q->batch_timer);
+		q->batch_timer = NULL;
+	}
+
+	q->broken = true;
+	msg_queue_discard(q);
+	watch_mod(q->fd, 0);
+
+	if (q->closed && !q->close_timer)
+		q->close_timer = watch_timer_add(0, msg_queue_close_expired, q);
+}
+
+/**
+ * msg_queue_detach() - remove the queue from the calling thread's event loop
+ * @q:		queue to detach
+ *
+ * Any open console frame is sealed, the queue must be attached to another
+ * event loop with msg_queue_attach() before messages are pushed again.
+ */
+void msg_queue_detach(struct msg_queue *q)
+{
+	msg_queue_seal(q);
+	watch_del(q->fd);
+}
+
+/**
+ * msg_queue_attach() - add a detached queue to the calling thread's event loop
+ * @q:		queue to attach
+ */
+void msg_queue_attach(struct msg_queue *q)
+{
+	watch_add(q->fd, msg_queue_empty(q) ? 0 : WATCH_WRITE,
+		  msg_queue_writable, q);
+}
+
+/**
+ * msg_queue_release() - discard all messages and stop watching the fd
+ * @q:		queue to release
+ */
+void msg_queue_release(struct msg_queue *q)
+{
+	struct qmsg *tmp;
+	struct qmsg *qm;
+
+	if (q->batch_timer) {
+		watch_timer_cancel(q->batch_timer);
+		q->batch_timer = NULL;
+	}
+
+	if (q->close_timer) {
+		watch_timer_cancel(q->close_timer);
+		q->close_timer = NULL;
+	}
+
+	msg_queue_discard(q);
+	msg_queue_deflate_end(q);
+	watch_del(q->fd);
+
+	list_for_each_entry_safe(qm, tmp, &q->spare, node)
+		free(qm);
+	list_init(&q->spare);
+	q->spare_count = 0;
+}
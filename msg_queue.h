@@ -0,0 +1,65 @@
+#ifndef __MSG_QUEUE_H__
+#define __MSG_QUEUE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+
+enum {
+	MSG_CLASS_CONTROL,
+	MSG_CLASS_CONSOLE,
+	MSG_CLASS_COUNT,
+};
+
+struct msg_queue_class {
+	struct list_head msgs;
+	size_t bytes;
+	size_t limit;
+	size_t dropped;
+};
+
+struct msg_queue {
+	int fd;
+
+	/* Flushed in order of priority, i.e. control before console */
+	struct msg_queue_class class[MSG_CLASS_COUNT];
+
+	/* Message partially written, it must be completed before any other */
+	struct qmsg *partial;
+
+	/* Console frame still accumulating data, not yet eligible for writing */
+	struct qmsg *batch;
+	struct timer *batch_timer;
+	unsigned int batch_latency_ms;
+
+	/* Deflate stream of the console frames, see msg_queue_compress() */
+	void *deflate;
+
+	/* Write side failed, everything queued is discarded */
+	bool broken;
+
+	/* Invoked once the queue has drained, after msg_queue_close() */
+	void (*closed)(void *data);
+	void *closed_data;
+	struct timer *close_timer;
+
+	/* Recycled small messages, see msg_queue_alloc() */
+	struct list_head spare;
+	unsigned int spare_count;
+};
+
+void msg_queue_init(struct msg_queue *q, int fd);
+int msg_queue_push(struct msg_queue *q, int type, const void *data, size_t len);
+bool msg_queue_empty(struct msg_queue *q);
+int msg_queue_flush(struct msg_queue *q);
+void msg_queue_close(struct msg_queue *q, void (*closed)(void *data), void *data);
+void msg_queue_release(struct msg_queue *q);
+void msg_queue_abort(struct msg_queue *q);
+void msg_queue_detach(struct msg_queue *q);
+void msg_queue_attach(struct msg_queue *q);
+
+void msg_queue_set_latency(struct msg_queue *q, unsigned int latency_ms);
+int msg_queue_compress(struct msg_queue *q);
+
+#endif
@@ -0,0 +1,686 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cdba.h"
+#include "circ_buf.h"
+#include "mux.h"
+#include "watch.h"
+
+/* Largest chunk of a channel's stream carried in one frame */
+#define MUX_CHUNK	4096
+
+/* Frame header, struct msg followed by the channel number */
+#define MUX_HDR		(sizeof(struct msg) + 1)
+
+#define MUX_RECV_SIZE	(128 * 1024)
+#define MUX_SEND_SIZE	(64 * 1024)
+#define MUX_CHAN_SIZE	(64 * 1024)
+
+/* Room kept in the send buffer for a close frame of every channel */
+#define MUX_CLOSE_RESERVE	(MUX_CHANNELS * MUX_HDR)
+
+struct mux_channel {
+	struct mux *mux;
+
+	/* Local end of the channel, -1 when not open; may be the same fd */
+	int in_fd;
+	int out_fd;
+
+	/* Received from the connection, not yet written to out_fd */
+	struct circ_buf in;
+
+	/*
+	 * Diagnostics of the session serving the channel, read here if it was
+	 * opened by the remote end, otherwise written. -1 if there is none.
+	 */
+	int err_fd;
+	bool accepted;
+
+	bool sent_close;
+	bool got_close;
+};
+
+struct mux {
+	int in_fd;
+	int out_fd;
+
+	struct circ_buf recv;
+	struct circ_buf send;
+
+	struct mux_channel channels[MUX_CHANNELS];
+
+	/* Channel whose buffer is full, holding up the connection's input */
+	struct mux_channel *stalled;
+
+	/* Channels are only read while the send buffer has room for a chunk */
+	bool send_full;
+
+	bool dead;
+	struct timer *dead_timer;
+
+	const struct mux_ops *ops;
+	void *data;
+};
+
+static bool mux_channel_used(struct mux_channel *ch)
+{
+	return ch->in_fd >= 0 || ch->sent_close || ch->got_close;
+}
+
+static void mux_update_conn(struct mux *mux)
+{
+	unsigned int in_events = 0;
+	unsigned int out_events = 0;
+
+	if (mux->dead)
+		return;
+
+	if (!mux->stalled)
+		in_events = WATCH_READ;
+	if (CIRC_AVAIL(&mux->send))
+		out_events = WATCH_WRITE;
+
+	if (mux->in_fd == mux->out_fd) {
+		watch_mod(mux->in_fd, in_events | out_events);
+	} else {
+		watch_mod(mux->in_fd, in_events);
+		watch_mod(mux->out_fd, out_events);
+	}
+}
+
+static void mux_update_channel(struct mux *mux, struct mux_channel *ch)
+{
+	unsigned int in_events = 0;
+	unsigned int out_events = 0;
+
+	if (ch->in_fd < 0)
+		return;
+
+	if (!mux->send_full && !ch->sent_close && !ch->got_close)
+		in_events = WATCH_READ;
+	if (CIRC_AVAIL(&ch->in))
+		out_events = WATCH_WRITE;
+
+	if (ch->in_fd == ch->out_fd) {
+		watch_mod(ch->in_fd, in_events | out_events);
+	} else {
+		watch_mod(ch->in_fd, in_events);
+		watch_mod(ch->out_fd, out_events);
+	}
+
+	if (ch->accepted && ch->err_fd >= 0)
+		watch_mod(ch->err_fd, mux->send_full ? 0 : WATCH_READ);
+}
+
+static void mux_send(struct mux *mux, struct mux_channel *ch, int type,
+		     const void *data, size_t len)
+{
+	uint8_t hdr[MUX_HDR];
+	struct msg *msg = (struct msg *)hdr;
+
+	msg->type = type;
+	msg->len = len + 1;
+	msg->data[0] = ch - mux->channels;
+
+	circ_write(&mux->send, hdr, sizeof(hdr));
+	if (len)
+		circ_write(&mux->send, data, len);
+
+	mux_update_conn(mux);
+}
+
+static void mux_check_space(struct mux *mux)
+{
+	bool full = CIRC_SPACE(&mux->send) < MUX_HDR + MUX_CHUNK + MUX_CLOSE_RESERVE;
+	int i;
+
+	if (full == mux->send_full)
+		return;
+
+	mux->send_full = full;
+
+	for (i = 0; i < MUX_CHANNELS; i++)
+		mux_update_channel(mux, &mux->channels[i]);
+}
+
+static void mux_channel_err_close(struct mux_channel *ch)
+{
+	if (ch->err_fd < 0)
+		return;
+
+	if (ch->accepted)
+		watch_del(ch->err_fd);
+	close(ch->err_fd);
+	ch->err_fd = -1;
+}
+
+/*
+ * Send what the session wrote to stderr before hanging up, as far as the send
+ * buffer allows, so its last words aren't lost to the close.
+ */
+static void mux_channel_err_drain(struct mux *mux, struct mux_channel *ch)
+{
+	static __thread uint8_t buf[MUX_CHUNK];
+	size_t space;
+	ssize_t n;
+
+	if (!ch->accepted || ch->err_fd < 0)
+		return;
+
+	for (;;) {
+		space = CIRC_SPACE(&mux->send);
+		if (space < MUX_CLOSE_RESERVE + 2 * MUX_HDR + 1)
+			return;
+
+		space = MIN(space - MUX_CLOSE_RESERVE - 2 * MUX_HDR, sizeof(buf));
+
+		n = read(ch->err_fd, buf, space);
+		if (n <= 0)
+			return;
+
+		mux_send(mux, ch, MSG_CHANNEL_STDERR, buf, n);
+	}
+}
+
+static void mux_channel_release(struct mux *mux, struct mux_channel *ch)
+{
+	if (ch->in_fd < 0)
+		return;
+
+	mux_channel_err_close(ch);
+
+	watch_del(ch->in_fd);
+	close(ch->in_fd);
+	if (ch->out_fd != ch->in_fd) {
+		watch_del(ch->out_fd);
+		close(ch->out_fd);
+	}
+
+	ch->in_fd = -1;
+	ch->out_fd = -1;
+
+	circ_free(&ch->in);
+
+	if (mux->ops->hangup)
+		mux->ops->hangup(mux, ch - mux->channels, mux->data);
+}
+
+/* Forget the channel once both ends have closed it */
+static void mux_channel_reap(struct mux_channel *ch)
+{
+	if (ch->sent_close && ch->got_close) {
+		ch->sent_close = false;
+		ch->got_close = false;
+	}
+}
+
+static void mux_channel_hangup(struct mux *mux, struct mux_channel *ch)
+{
+	if (!ch->sent_close)
+		mux_channel_err_drain(mux, ch);
+
+	mux_channel_release(mux, ch);
+
+	if (!ch->sent_close) {
+		mux_send(mux, ch, MSG_CHANNEL, NULL, 0);
+		ch->sent_close = true;
+	}
+
+	mux_channel_reap(ch);
+}
+
+static void mux_process(struct mux *mux);
+
+static int mux_channel_flush(struct mux *mux, struct mux_channel *ch)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	while (CIRC_AVAIL(&ch->in)) {
+		circ_view(&ch->in, iov);
+
+		n = writev(ch->out_fd, iov, iov[1].iov_len ? 2 : 1);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+
+			mux_channel_hangup(mux, ch);
+			return -1;
+		}
+
+		circ_skip(&ch->in, n);
+	}
+
+	/* The remote end is done with the channel, once it has all been passed on */
+	if (ch->got_close && !CIRC_AVAIL(&ch->in)) {
+		mux_channel_hangup(mux, ch);
+		return -1;
+	}
+
+	mux_update_channel(mux, ch);
+
+	return 0;
+}
+
+static int mux_channel_io(int fd, unsigned int revents, void *data);
+
+static void mux_channel_add(struct mux *mux, struct mux_channel *ch,
+			    int in_fd, int out_fd, int err_fd, bool accepted)
+{
+	ch->in_fd = in_fd;
+	ch->out_fd = out_fd;
+	ch->err_fd = err_fd;
+	ch->accepted = accepted;
+	circ_init(&ch->in, MUX_CHAN_SIZE);
+
+	if (watch_add(in_fd, 0, mux_channel_io, ch) < 0)
+		errx(1, "unable to watch channel");
+	if (out_fd != in_fd && watch_add(out_fd, 0, mux_channel_io, ch) < 0)
+		errx(1, "unable to watch channel");
+	if (accepted && watch_add(err_fd, 0, mux_channel_io, ch) < 0)
+		errx(1, "unable to watch channel");
+
+	mux_update_channel(mux, ch);
+}
+
+static int mux_channel_io(int fd, unsigned int revents, void *data)
+{
+	static __thread uint8_t buf[MUX_CHUNK];
+	struct mux_channel *ch = data;
+	struct mux *mux = ch->mux;
+	ssize_t n;
+
+	if ((revents & WATCH_WRITE) && fd == ch->out_fd) {
+		if (mux_channel_flush(mux, ch) < 0)
+			goto out;
+	}
+
+	/*
+	 * A single chunk per wakeup, every other channel with data to send
+	 * gets its turn before this one is read again.
+	 */
+	if ((revents & WATCH_READ) && fd == ch->in_fd && !mux->send_full) {
+		n = read(ch->in_fd, buf, sizeof(buf));
+		if (n < 0 && errno == EAGAIN)
+			goto out;
+
+		if (n <= 0) {
+			mux_channel_hangup(mux, ch);
+			goto out;
+		}
+
+		mux_send(mux, ch, MSG_CHANNEL, buf, n);
+		mux_check_space(mux);
+	}
+
+	if ((revents & WATCH_READ) && fd == ch->err_fd && !mux->send_full) {
+		n = read(ch->err_fd, buf, sizeof(buf));
+		if (n < 0 && errno == EAGAIN)
+			goto out;
+
+		if (n <= 0) {
+			mux_channel_err_close(ch);
+			goto out;
+		}
+
+		mux_send(mux, ch, MSG_CHANNEL_STDERR, buf, n);
+		mux_check_space(mux);
+	}
+
+out:
+	/* Retry the frame holding up the connection, there may be room now */
+	if (mux->stalled == ch) {
+		mux->stalled = NULL;
+		mux_process(mux);
+		mux_update_conn(mux);
+	}
+
+	return 0;
+}
+
+static void mux_dead(void *data)
+{
+	struct mux *mux = data;
+
+	mux->ops->closed(mux, mux->data);
+
+	circ_free(&mux->recv);
+	circ_free(&mux->send);
+	free(mux);
+}
+
+/**
+ * mux_close() - close all channels and stop using the connection
+ * @mux:	mux to close
+ *
+ * The connection's file descriptors are left to the owner, which is told
+ * through the closed() operation that the mux has let go of them.
+ */
+void mux_close(struct mux *mux)
+{
+	int i;
+
+	if (mux->dead)
+		return;
+
+	mux->dead = true;
+
+	for (i = 0; i < MUX_CHANNELS; i++) {
+		if (mux_channel_used(&mux->channels[i]))
+			mux_channel_release(mux, &mux->channels[i]);
+	}
+
+	watch_del(mux->in_fd);
+	if (mux->out_fd != mux->in_fd)
+		watch_del(mux->out_fd);
+
+	mux->dead_timer = watch_timer_add(0, mux_dead, mux);
+}
+
+/* A channel opened by the remote end, served by the owner */
+static void mux_channel_accept(struct mux *mux, struct mux_channel *ch)
+{
+	int errs[2];
+	int fds[2];
+	int ret;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds);
+	if (ret < 0) {
+		warn("failed to create channel");
+		goto refuse;
+	}
+
+	ret = pipe2(errs, O_CLOEXEC);
+	if (ret < 0) {
+		warn("failed to create channel");
+		goto close_fds;
+	}
+
+	fcntl(errs[0], F_SETFL, O_NONBLOCK);
+
+	ret = mux->ops->open(mux, fds[1], errs[1], mux->data);
+	if (ret < 0)
+		goto close_errs;
+
+	mux_channel_add(mux, ch, fds[0], fds[0], errs[0], true);
+	return;
+
+close_errs:
+	close(errs[0]);
+	close(errs[1]);
+close_fds:
+	close(fds[0]);
+	close(fds[1]);
+refuse:
+	mux_send(mux, ch, MSG_CHANNEL, NULL, 0);
+	ch->sent_close = true;
+}
+
+static void mux_process(struct mux *mux)
+{
+	static __thread uint8_t buf[UINT16_MAX];
+	struct mux_channel *ch;
+	uint8_t hdr[MUX_HDR];
+	struct msg *msg = (struct msg *)hdr;
+	size_t len;
+
+	while (!mux->dead && !mux->stalled) {
+		if (!circ_peak(&mux->recv, hdr, sizeof(hdr)))
+			return;
+
+		if ((msg->type != MSG_CHANNEL && msg->type != MSG_CHANNEL_STDERR) ||
+		    !msg->len) {
+			warnx("unexpected message %d on multiplexed connection",
+			      msg->type);
+			mux_close(mux);
+			return;
+		}
+
+		if (CIRC_AVAIL(&mux->recv) < sizeof(*msg) + msg->len)
+			return;
+
+		ch = &mux->channels[msg->data[0]];
+		len = msg->len - 1;
+
+		/* Best effort, diagnostics must not hold up the connection */
+		if (msg->type == MSG_CHANNEL_STDERR) {
+			circ_skip(&mux->recv, sizeof(hdr));
+			circ_read(&mux->recv, buf, len);
+
+			if (ch->err_fd >= 0 && !ch->accepted)
+				write(ch->err_fd, buf, len);
+			continue;
+		}
+
+		if (!len) {
+			circ_skip(&mux->recv, sizeof(hdr));
+			if (!mux_channel_used(ch))
+				continue;
+
+			ch->got_close = true;
+			if (ch->in_fd >= 0)
+				mux_channel_flush(mux, ch);
+			mux_channel_reap(ch);
+			continue;
+		}
+
+		if (!mux_channel_used(ch))
+			mux_channel_accept(mux, ch);
+
+		/* Data racing our close of the channel is dropped */
+		if (ch->in_fd < 0 || ch->got_close) {
+			circ_skip(&mux->recv, sizeof(hdr) + len);
+			continue;
+		}
+
+		if (CIRC_SPACE(&ch->in) < len) {
+			mux->stalled = ch;
+			return;
+		}
+
+		circ_skip(&mux->recv, sizeof(hdr));
+		circ_read(&mux->recv, buf, len);
+		circ_write(&ch->in, buf, len);
+
+		mux_channel_flush(mux, ch);
+	}
+}
+
+static int mux_flush(struct mux *mux)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	while (CIRC_AVAIL(&mux->send)) {
+		circ_view(&mux->send, iov);
+
+		n = writev(mux->out_fd, iov, iov[1].iov_len ? 2 : 1);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+
+			return -1;
+		}
+
+		circ_skip(&mux->send, n);
+	}
+
+	mux_check_space(mux);
+	mux_update_conn(mux);
+
+	return 0;
+}
+
+static int mux_conn_io(int fd, unsigned int revents, void *data)
+{
+	struct mux *mux = data;
+	int ret;
+
+	if ((revents & WATCH_WRITE) && fd == mux->out_fd) {
+		if (mux_flush(mux) < 0) {
+			mux_close(mux);
+			return 0;
+		}
+	}
+
+	if ((revents & WATCH_READ) && fd == mux->in_fd && !mux->stalled) {
+		ret = circ_fill(fd, &mux->recv);
+		if (ret < 0 && errno != EAGAIN) {
+			mux_close(mux);
+			return 0;
+		}
+
+		mux_process(mux);
+		mux_update_conn(mux);
+	}
+
+	return 0;
+}
+
+/**
+ * mux_new() - carry channels over a connection
+ * @in_fd:	connection to read frames from, made non-blocking
+ * @out_fd:	connection to write frames to, may equal @in_fd
+ * @ops:	callbacks for channels opened by the remote end and for the
+ *		connection going away
+ * @data:	passed to @ops
+ *
+ * Return: the new mux
+ */
+struct mux *mux_new(int in_fd, int out_fd, const struct mux_ops *ops, void *data)
+{
+	struct mux *mux;
+	int flags;
+	int i;
+
+	mux = calloc(1, sizeof(*mux));
+	if (!mux)
+		err(1, "failed to allocate mux");
+
+	mux->in_fd = in_fd;
+	mux->out_fd = out_fd;
+	mux->ops = ops;
+	mux->data = data;
+
+	circ_init(&mux->recv, MUX_RECV_SIZE);
+	circ_init(&mux->send, MUX_SEND_SIZE);
+
+	for (i = 0; i < MUX_CHANNELS; i++) {
+		mux->channels[i].mux = mux;
+		mux->channels[i].in_fd = -1;
+		mux->channels[i].out_fd = -1;
+		mux->channels[i].err_fd = -1;
+	}
+
+	flags = fcntl(in_fd, F_GETFL, 0);
+	fcntl(in_fd, F_SETFL, flags | O_NONBLOCK);
+	flags = fcntl(out_fd, F_GETFL, 0);
+	fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
+
+	if (watch_add(in_fd, 0, mux_conn_io, mux) < 0)
+		errx(1, "unable to watch multiplexed connection");
+	if (out_fd != in_fd && watch_add(out_fd, 0, mux_conn_io, mux) < 0)
+		errx(1, "unable to watch multiplexed connection");
+
+	mux_update_conn(mux);
+
+	return mux;
+}
+
+/**
+ * mux_feed() - process frames already read from the connection
+ * @mux:	mux to feed
+ * @buf:	received data
+ * @len:	length of @buf
+ *
+ * Return: 0 on success, -ENOBUFS if @buf doesn't fit the receive buffer
+ */
+int mux_feed(struct mux *mux, const void *buf, size_t len)
+{
+	if (CIRC_SPACE(&mux->recv) < len)
+		return -ENOBUFS;
+
+	circ_write(&mux->recv, buf, len);
+
+	mux_process(mux);
+	mux_update_conn(mux);
+
+	return 0;
+}
+
+/**
+ * mux_channel_open() - open a channel to the remote end
+ * @mux:	mux to open the channel on
+ * @in_fd:	local stream carried to the remote end, owned by the mux from here
+ * @out_fd:	where the remote end's stream is written, may equal @in_fd
+ * @err_fd:	where the remote end's diagnostics are written, or -1
+ *
+ * Return: the channel number, negative errno on failure
+ */
+int mux_channel_open(struct mux *mux, int in_fd, int out_fd, int err_fd)
+{
+	int flags;
+	int i;
+
+	if (mux->dead)
+		return -ENOTCONN;
+
+	for (i = 0; i < MUX_CHANNELS; i++) {
+		if (!mux_channel_used(&mux->channels[i]))
+			break;
+	}
+	if (i == MUX_CHANNELS)
+		return -EBUSY;
+
+	flags = fcntl(in_fd, F_GETFL, 0);
+	fcntl(in_fd, F_SETFL, flags | O_NONBLOCK);
+	flags = fcntl(out_fd, F_GETFL, 0);
+	fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
+	if (err_fd >= 0) {
+		flags = fcntl(err_fd, F_GETFL, 0);
+		fcntl(err_fd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	mux_channel_add(mux, &mux->channels[i], in_fd, out_fd, err_fd, false);
+
+	return i;
+}
@@ -0,0 +1,34 @@
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <stddef.h>
+
+/*
+ * A connection may carry a number of channels, each an independent stream of
+ * cdba messages. The streams are cut into MSG_CHANNEL frames, holding the
+ * channel number followed by a chunk of the stream; a frame without data
+ * closes the channel. A channel number is reused once both ends have sent
+ * their close.
+ *
+ * The end serving a channel sends the session's stderr in MSG_CHANNEL_STDERR
+ * frames, laid out the same way.
+ */
+#define MUX_CHANNELS	256
+
+struct mux;
+
+struct mux_ops {
+	/* The remote end opened a channel, to be served on @fd and @err_fd */
+	int (*open)(struct mux *mux, int fd, int err_fd, void *data);
+	/* Optional, the local end of @channel was closed */
+	void (*hangup)(struct mux *mux, int channel, void *data);
+	/* The connection is gone, invoked from the event loop once all is closed */
+	void (*closed)(struct mux *mux, void *data);
+};
+
+struct mux *mux_new(int in_fd, int out_fd, const struct mux_ops *ops, void *data);
+int mux_feed(struct mux *mux, const void *buf, size_t len);
+int mux_channel_open(struct mux *mux, int in_fd, int out_fd, int err_fd);
+void mux_close(struct mux *mux);
+
+#endif
@@ -59,8 +59,10 @@ void *qcomlt_dbg_open(struct device *dev)
 	dbg = calloc(1, sizeof(*dbg));
 
 	dbg->fd = tty_open(dev->control_dev, &dbg->orig_tios);
-	if (dbg->fd < 0)
-		err(1, "failed to open %s", dev->control_dev);
+	if (dbg->fd < 0) {
+		free(dbg);
+		return NULL;
+	}
 
 	// fprintf(stderr, "qcomlt_dbg_open()\n");
 	write(dbg->fd, "brpu", 4);
@@ -68,6 +70,16 @@ void *qcomlt_dbg_open(struct device *dev)
 	return dbg;
 }
 
+void qcomlt_dbg_close(struct device *dev)
+{
+	struct qcomlt_dbg *dbg = dev->cdb;
+
+	tcsetattr(dbg->fd, TCSAFLUSH, &dbg->orig_tios);
+	close(dbg->fd);
+	free(dbg);
+	dev->cdb = NULL;
+}
+
 int qcomlt_dbg_power(struct device *dev, bool on)
 {
 	struct qcomlt_dbg *dbg = dev->cdb;	
@@ -4,6 +4,7 @@
 #include "device.h"
 
 void *qcomlt_dbg_open(struct device *dev);
+void qcomlt_dbg_close(struct device *dev);
 int qcomlt_dbg_power(struct device *dev, bool on);
 void qcomlt_dbg_usb(struct device *dev, bool on);
 void qcomlt_dbg_key(struct device *dev, int key, bool asserted);
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2016-2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "relay.h"
+#include "watch.h"
+
+static void (*relay_attach)(int conn, int fds[3]);
+
+static int relay_sockaddr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+/**
+ * relay_socket_path() - default path of the daemon's socket
+ * @path:	buffer to fill
+ * @len:	size of @path
+ *
+ * The socket is placed in /tmp/cdba-<uid>, created if missing, which only the
+ * user serving the boards may access.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int relay_socket_path(char *path, size_t len)
+{
+	char dir[PATH_MAX];
+	struct stat st;
+	int n;
+
+	snprintf(dir, sizeof(dir), "/tmp/cdba-%lu", (unsigned long)getuid());
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -errno;
+
+	if (lstat(dir, &st) < 0)
+		return -errno;
+
+	/* Anyone could have created it first, only trust our own */
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+		warnx("%s is not a private directory of ours", dir);
+		return -EPERM;
+	}
+
+	n = snprintf(path, len, "%s/server.sock", dir);
+
+	return n < len ? 0 : -ENAMETOOLONG;
+}
+
+/* Sessions are only exchanged between processes of the same user */
+static int relay_check_peer(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return -errno;
+
+	return cred.uid == getuid() ? 0 : -EPERM;
+}
+
+/**
+ * relay_run() - hand stdio over to the cdba-server daemon
+ * @path:	path of the daemon's socket
+ *
+ * Return: negative errno if no daemon is listening on @path, otherwise the
+ * function waits for the daemon to end the session and does not return
+ */
+int relay_run(const char *path)
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	char byte = 0;
+	ssize_t n;
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	int ret;
+	int fd;
+
+	ret = relay_sockaddr(path, &addr);
+	if (ret < 0)
+		return ret;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	/* The daemon gets the session, boot images included */
+	ret = relay_check_peer(fd);
+	if (ret < 0) {
+		warnx("%s isn't served by a daemon of ours, ignoring it", path);
+		close(fd);
+		return ret;
+	}
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	n = sendmsg(fd, &msg, 0);
+	if (n < 0)
+		err(1, "failed to hand over session to daemon");
+
+	/* The daemon holds the client's pipes now, don't keep them alive */
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+
+	/* The daemon hangs up once the session has ended */
+	do {
+		n = read(fd, &byte, 1);
+	} while (n > 0 || (n < 0 && errno == EINTR));
+
+	exit(0);
+}
+
+static int relay_recv_fds(int conn, int fds[3])
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	char byte;
+	ssize_t n;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	if (n <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		warnx("relay didn't provide stdio");
+		return -1;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+	return 0;
+}
+
+static int relay_handshake(int conn, unsigned int revents, void *data)
+{
+	int fds[3];
+	int ret;
+
+	/* The connection is watched by the session from here on */
+	watch_del(conn);
+
+	ret = relay_recv_fds(conn, fds);
+	if (ret < 0) {
+		close(conn);
+		return 0;
+	}
+
+	relay_attach(conn, fds);
+
+	return 0;
+}
+
+static int relay_accept(int fd, unsigned int revents, void *data)
+{
+	int flags;
+	int conn;
+
+	conn = accept(fd, NULL, NULL);
+	if (conn < 0)
+		return 0;
+
+	if (relay_check_peer(conn) < 0) {
+		close(conn);
+		return 0;
+	}
+
+	flags = fcntl(conn, F_GETFL, 0);
+	fcntl(conn, F_SETFL, flags | O_NONBLOCK);
+	fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+	watch_add(conn, WATCH_READ, relay_handshake, NULL);
+
+	return 0;
+}
+
+/**
+ * relay_listen() - accept sessions handed over by relays
+ * @path:	path of the socket to listen on
+ * @attach:	invoked with the connection and the relay's stdio for each
+ *		new session, the connection should be closed to end the session
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int relay_listen(const char *path, void (*attach)(int conn, int fds[3]))
+{
+	struct sockaddr_un addr;
+	int ret;
+	int fd;
+
+	ret = relay_sockaddr(path, &addr);
+	if (ret < 0)
+		return ret;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	unlink(path);
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0)
+		goto err_close;
+
+	ret = listen(fd, 16);
+	if (ret < 0)
+		goto err_close;
+
+	relay_attach = attach;
+
+	return watch_add(fd, WATCH_READ, relay_accept, NULL);
+
+err_close:
+	ret = -errno;
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+/*
+ * cdba-server may run as a persistent daemon, owning all boards of the host.
+ * The cdba-server instance spawned by ssh then acts as a relay: it connects
+ * to the daemon's socket, hands over its stdin, stdout and stderr using
+ * SCM_RIGHTS and waits for the daemon to hang up the connection once the
+ * session is over. Both ends must run as the same user.
+ */
+int relay_socket_path(char *path, size_t len);
+int relay_run(const char *path);
+int relay_listen(const char *path, void (*attach)(int conn, int fds[3]));
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <err.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "device_parser.h"
+#include "list.h"
+#include "reload.h"
+#include "watch.h"
+
+/* Editors tend to write a file in several steps, let them finish */
+#define RELOAD_SETTLE_MS	200
+
+static char reload_path[PATH_MAX];
+static char reload_dir[PATH_MAX];
+static char reload_base[NAME_MAX + 1];
+
+static void (*reload_retire)(struct device *device);
+
+/* Written by reload_request(), which may run in a signal handler */
+static int reload_request_fd = -1;
+static int reload_inotify_fd = -1;
+
+static struct timer *reload_timer;
+
+/* State of the parser thread */
+static pthread_t reload_thread;
+static int reload_done_fd = -1;
+static bool reload_running;
+static bool reload_again;
+static int reload_result;
+static struct list_head reload_devices = LIST_INIT(reload_devices);
+
+static void *reload_parse(void *data)
+{
+	const uint64_t one = 1;
+
+	reload_result = device_parser_read(reload_path, &reload_devices);
+
+	write(reload_done_fd, &one, sizeof(one));
+
+	return NULL;
+}
+
+static void reload_start(void)
+{
+	sigset_t blocked;
+	sigset_t old;
+	int ret;
+
+	if (reload_running) {
+		reload_again = true;
+		return;
+	}
+
+	/* Signals are left to the main thread */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_BLOCK, &blocked, &old);
+
+	ret = pthread_create(&reload_thread, NULL, reload_parse, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		warnx("failed to start parsing %s", reload_path);
+		return;
+	}
+
+	reload_running = true;
+}
+
+static int reload_done(int fd, unsigned int revents, void *data)
+{
+	uint64_t count;
+
+	read(fd, &count, sizeof(count));
+
+	pthread_join(reload_thread, NULL);
+	reload_running = false;
+
+	if (reload_result < 0) {
+		warnx("failed to reload %s, keeping the current boards", reload_path);
+	} else {
+		device_update(&reload_devices, reload_retire);
+		warnx("reloaded %s", reload_path);
+	}
+
+	list_init(&reload_devices);
+
+	/* The file changed again while it was being parsed */
+	if (reload_again) {
+		reload_again = false;
+		reload_start();
+	}
+
+	return 0;
+}
+
+static void reload_settled(void *data)
+{
+	reload_timer = NULL;
+
+	reload_start();
+}
+
+static void reload_schedule(void)
+{
+	if (reload_timer)
+		watch_timer_cancel(reload_timer);
+
+	reload_timer = watch_timer_add(RELOAD_SETTLE_MS, reload_settled, NULL);
+}
+
+static int reload_requested(int fd, unsigned int revents, void *data)
+{
+	uint64_t count;
+
+	read(fd, &count, sizeof(count));
+
+	reload_schedule();
+
+	return 0;
+}
+
+static int reload_changed(int fd, unsigned int revents, void *data)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false;
+	ssize_t n;
+	char *p;
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (ev->len && !strcmp(ev->name, reload_base))
+				changed = true;
+		}
+	}
+
+	if (changed)
+		reload_schedule();
+
+	return 0;
+}
+
+/**
+ * reload_init() - reload the board database as it changes
+ * @path:	path of the YAML file the boards were loaded from
+ * @retire:	invoked for boards removed by a reload, see device_update()
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int reload_init(const char *path, void (*retire)(struct device *device))
+{
+	char tmp[PATH_MAX];
+	int ret;
+
+	if (strlen(path) >= sizeof(reload_path))
+		return -ENAMETOOLONG;
+
+	strcpy(reload_path, path);
+	reload_retire = retire;
+
+	/* dirname() and basename() may modify their argument */
+	strcpy(tmp, path);
+	strcpy(reload_dir, dirname(tmp));
+	strcpy(tmp, path);
+	snprintf(reload_base, sizeof(reload_base), "%s", basename(tmp));
+
+	reload_request_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	reload_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reload_request_fd < 0 || reload_done_fd < 0)
+		return -errno;
+
+	watch_add(reload_request_fd, WATCH_READ, reload_requested, NULL);
+	watch_add(reload_done_fd, WATCH_READ, reload_done, NULL);
+
+	/* The file is commonly replaced, so watch the directory holding it */
+	reload_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (reload_inotify_fd < 0) {
+		warn("unable to watch %s, reload with SIGHUP", reload_path);
+		return 0;
+	}
+
+	ret = inotify_add_watch(reload_inotify_fd, reload_dir,
+				IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (ret < 0) {
+		warn("unable to watch %s, reload with SIGHUP", reload_dir);
+		close(reload_inotify_fd);
+		reload_inotify_fd = -1;
+		return 0;
+	}
+
+	watch_add(reload_inotify_fd, WATCH_READ, reload_changed, NULL);
+
+	return 0;
+}
+
+/**
+ * reload_request() - reload the board database
+ *
+ * Safe to call from a signal handler.
+ */
+void reload_request(void)
+{
+	const uint64_t one = 1;
+
+	if (reload_request_fd >= 0)
+		write(reload_request_fd, &one, sizeof(one));
+}
@@ -0,0 +1,13 @@
+#ifndef __RELOAD_H__
+#define __RELOAD_H__
+
+struct device;
+
+/*
+ * The daemon reloads the board database when the file changes, or on SIGHUP.
+ * Parsing happens on a separate thread, so the event loops never wait for it.
+ */
+int reload_init(const char *path, void (*retire)(struct device *device));
+void reload_request(void);
+
+#endif
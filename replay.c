@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdba.h"
+#include "replay.h"
+
+struct replay {
+	size_t size;
+
+	/* Offset in the stream of the first byte written */
+	uint64_t start;
+
+	/* Offset in the stream of the next byte written */
+	uint64_t end;
+
+	char data[];
+};
+
+/**
+ * replay_new() - allocate a replay buffer
+ * @size:	number of bytes to keep
+ * @offset:	stream offset of the first byte to be written
+ *
+ * Return: the new replay buffer
+ */
+struct replay *replay_new(size_t size, uint64_t offset)
+{
+	struct replay *replay;
+
+	replay = calloc(1, sizeof(*replay) + size);
+	if (!replay)
+		err(1, "failed to allocate replay buffer");
+
+	replay->size = size;
+	replay->start = offset;
+	replay->end = offset;
+
+	return replay;
+}
+
+/**
+ * replay_write() - append to the stream, dropping the oldest data
+ * @replay:	replay buffer
+ * @data:	data to append
+ * @len:	length of @data
+ */
+void replay_write(struct replay *replay, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t pos;
+	size_t n;
+
+	/* Of a write larger than the buffer only the tail is kept */
+	if (len > replay->size) {
+		replay->end += len - replay->size;
+		p += len - replay->size;
+		len = replay->size;
+	}
+
+	while (len) {
+		pos = replay->end % replay->size;
+		n = MIN(len, replay->size - pos);
+
+		memcpy(replay->data + pos, p, n);
+		replay->end += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* Return: offset of the oldest byte still held */
+uint64_t replay_start(struct replay *replay)
+{
+	return MAX(replay->start, replay->end > replay->size ? replay->end - replay->size : 0);
+}
+
+/* Return: offset of the next byte to be written */
+uint64_t replay_end(struct replay *replay)
+{
+	return replay->end;
+}
+
+/**
+ * replay_read() - copy out part of the stream
+ * @replay:	replay buffer
+ * @offset:	stream offset to read from, no older than replay_start()
+ * @buf:	buffer to fill
+ * @len:	size of @buf
+ *
+ * Return: number of bytes copied, 0 once @offset reaches the end
+ */
+size_t replay_read(struct replay *replay, uint64_t offset, void *buf, size_t len)
+{
+	size_t pos;
+
+	if (offset < replay_start(replay) || offset >= replay->end)
+		return 0;
+
+	pos = offset % replay->size;
+	len = MIN(len, replay->end - offset);
+	len = MIN(len, replay->size - pos);
+
+	memcpy(buf, replay->data + pos, len);
+
+	return len;
+}
+
+void replay_free(struct replay *replay)
+{
+	free(replay);
+}
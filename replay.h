@@ -0,0 +1,20 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded history of a byte stream, addressed by the offset of each byte in
+ * the stream. Only the last size bytes written are kept.
+ */
+struct replay;
+
+struct replay *replay_new(size_t size, uint64_t offset);
+void replay_write(struct replay *replay, const void *data, size_t len);
+uint64_t replay_start(struct replay *replay);
+uint64_t replay_end(struct replay *replay);
+size_t replay_read(struct replay *replay, uint64_t offset, void *buf, size_t len);
+void replay_free(struct replay *replay);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2016-2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "circ_buf.h"
+#include "shard.h"
+#include "watch.h"
+
+/* Room for a few hundred items in flight to each shard */
+#define SHARD_RING_SIZE	4096
+
+/* Function to run in the shard's thread, NULL asks the thread to quit */
+struct shard_work {
+	void (*fn)(void *data);
+	void *data;
+};
+
+struct shard {
+	unsigned int index;
+	pthread_t thread;
+
+	/* Items from the main thread, the ring's only producer */
+	struct circ_buf ring;
+	int efd;
+};
+
+static struct shard *shards;
+static unsigned int shard_count;
+
+static void (*shard_exit)(void);
+
+static __thread unsigned int shard_index;
+
+/**
+ * shard_self() - index of the calling thread's shard
+ *
+ * Return: index of the shard, 0 for the main thread
+ */
+unsigned int shard_self(void)
+{
+	return shard_index;
+}
+
+static int shard_wakeup(int fd, unsigned int revents, void *data)
+{
+	struct shard *shard = data;
+	struct shard_work work;
+	uint64_t count;
+
+	read(fd, &count, sizeof(count));
+
+	while (circ_read(&shard->ring, &work, sizeof(work))) {
+		/* Queued by shard_stop() */
+		if (!work.fn) {
+			watch_quit();
+			continue;
+		}
+
+		work.fn(work.data);
+	}
+
+	return 0;
+}
+
+static void *shard_thread(void *data)
+{
+	struct shard *shard = data;
+
+	shard_index = shard->index;
+
+	watch_add(shard->efd, WATCH_READ, shard_wakeup, shard);
+
+	watch_run();
+
+	if (shard_exit)
+		shard_exit();
+
+	return NULL;
+}
+
+static void shard_pin(struct shard *shard)
+{
+	cpu_set_t available;
+	cpu_set_t cpus;
+	int ncpus;
+	int nth;
+	int cpu;
+	int ret;
+
+	ret = sched_getaffinity(0, sizeof(available), &available);
+	if (ret < 0)
+		return;
+
+	ncpus = CPU_COUNT(&available);
+	nth = (shard->index - 1) % ncpus;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &available) && !nth--)
+			break;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+
+	ret = pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus);
+	if (ret)
+		warnx("failed to pin shard %u to cpu %d", shard->index, cpu);
+}
+
+/**
+ * shard_init() - start the shard threads
+ * @count:	number of threads to start
+ * @affinity:	pin each thread to its own CPU
+ * @stop:	invoked in each shard's thread as it stops
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int shard_init(unsigned int count, bool affinity, void (*stop)(void))
+{
+	struct shard *shard;
+	sigset_t blocked;
+	sigset_t old;
+	unsigned int i;
+	int ret;
+
+	shards = calloc(count, sizeof(*shards));
+	if (!shards)
+		err(1, "failed to allocate shards");
+
+	shard_count = count;
+	shard_exit = stop;
+
+	/* Signals are left to the main thread */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_BLOCK, &blocked, &old);
+
+	for (i = 0; i < count; i++) {
+		shard = &shards[i];
+		shard->index = i + 1;
+
+		circ_init(&shard->ring, SHARD_RING_SIZE);
+
+		shard->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (shard->efd < 0)
+			err(1, "failed to create eventfd");
+
+		ret = pthread_create(&shard->thread, NULL, shard_thread, shard);
+		if (ret)
+			errx(1, "failed to start shard %u", shard->index);
+
+		if (affinity)
+			shard_pin(shard);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return 0;
+}
+
+/**
+ * shard_submit() - run a function in a shard's thread
+ * @index:	index of the shard, as returned by shard_self()
+ * @fn:		function to invoke
+ * @data:	argument to @fn
+ *
+ * Must only be called from the main thread, the shards' rings have a single
+ * producer. Ownership of @data passes to the shard on success.
+ *
+ * Return: 0 on success, -ENOBUFS if the shard is backlogged
+ */
+int shard_submit(unsigned int index, void (*fn)(void *data), void *data)
+{
+	struct shard *shard = &shards[index - 1];
+	struct shard_work work = { fn, data };
+	const uint64_t one = 1;
+
+	assert(shard_self() == 0);
+
+	if (!circ_write(&shard->ring, &work, sizeof(work)))
+		return -ENOBUFS;
+
+	write(shard->efd, &one, sizeof(one));
+
+	return 0;
+}
+
+/**
+ * shard_stop() - stop all shard threads and wait for them to exit
+ */
+void shard_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < shard_count; i++) {
+		while (shard_submit(i + 1, NULL, NULL) < 0)
+			sched_yield();
+	}
+
+	for (i = 0; i < shard_count; i++)
+		pthread_join(shards[i].thread, NULL);
+}
@@ -0,0 +1,15 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stdbool.h>
+
+/*
+ * Boards may be spread over a number of event loop threads, or shards,
+ * numbered from 1. Shard 0 is the main thread's event loop.
+ */
+int shard_init(unsigned int count, bool affinity, void (*stop)(void));
+int shard_submit(unsigned int index, void (*fn)(void *data), void *data);
+unsigned int shard_self(void);
+void shard_stop(void);
+
+#endif
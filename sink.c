@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "circ_buf.h"
+#include "sink.h"
+
+/* Write right away once this much is buffered */
+#define SINK_FLUSH_SIZE	4096
+
+struct sink {
+	int fd;
+	unsigned int latency_ms;
+
+	/* Filled by the caller, drained by the thread */
+	struct circ_buf buf;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool closing;
+
+	/* Made readable as room is freed, for callers waiting on sink_wait() */
+	int wake[2];
+	bool waiting;
+	size_t wait_space;
+};
+
+static void sink_deadline(struct sink *sink, struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+
+	ts->tv_sec += sink->latency_ms / 1000;
+	ts->tv_nsec += (sink->latency_ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void *sink_thread(void *data)
+{
+	struct sink *sink = data;
+	struct iovec iov[2];
+	struct timespec ts;
+	ssize_t n;
+	int iovcnt;
+
+	pthread_mutex_lock(&sink->lock);
+
+	for (;;) {
+		while (!CIRC_AVAIL(&sink->buf) && !sink->closing)
+			pthread_cond_wait(&sink->cond, &sink->lock);
+
+		if (!CIRC_AVAIL(&sink->buf))
+			break;
+
+		/* Give the caller a chance to add to the write */
+		sink_deadline(sink, &ts);
+		while (CIRC_AVAIL(&sink->buf) < SINK_FLUSH_SIZE && !sink->closing) {
+			if (pthread_cond_timedwait(&sink->cond, &sink->lock, &ts) == ETIMEDOUT)
+				break;
+		}
+
+		pthread_mutex_unlock(&sink->lock);
+
+		circ_view(&sink->buf, iov);
+		iovcnt = iov[1].iov_len ? 2 : 1;
+
+		n = writev(sink->fd, iov, iovcnt);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+
+		if (n < 0) {
+			/* Nowhere to write to, discard the rest */
+			warn("sink write failed");
+			n = CIRC_AVAIL(&sink->buf);
+		}
+
+		circ_skip(&sink->buf, n);
+
+		pthread_mutex_lock(&sink->lock);
+
+		if (sink->waiting && CIRC_SPACE(&sink->buf) >= sink->wait_space) {
+			sink->waiting = false;
+			write(sink->wake[1], "", 1);
+		}
+	}
+
+	pthread_mutex_unlock(&sink->lock);
+
+	return NULL;
+}
+
+/**
+ * sink_open() - start an asynchronous writer
+ * @fd:		file descriptor to write to, left open by sink_close()
+ * @size:	bytes to buffer
+ * @latency_ms:	maximum time data is held back to gather larger writes
+ *
+ * Return: the sink
+ */
+struct sink *sink_open(int fd, size_t size, unsigned int latency_ms)
+{
+	pthread_condattr_t attr;
+	struct sink *sink;
+	int ret;
+
+	sink = calloc(1, sizeof(*sink));
+	if (!sink)
+		err(1, "failed to allocate sink");
+
+	sink->fd = fd;
+	sink->latency_ms = latency_ms;
+
+	circ_init(&sink->buf, size);
+
+	pthread_mutex_init(&sink->lock, NULL);
+
+	/* Deadlines are computed on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sink->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pipe(sink->wake) < 0)
+		err(1, "failed to create sink wakeup pipe");
+
+	fcntl(sink->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(sink->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sink->wake[1], F_SETFD, FD_CLOEXEC);
+
+	ret = pthread_create(&sink->thread, NULL, sink_thread, sink);
+	if (ret)
+		errx(1, "failed to start sink thread");
+
+	return sink;
+}
+
+/**
+ * sink_space() - room left in the sink's buffer
+ * @sink:	sink to query
+ *
+ * Return: number of bytes sink_write() will accept
+ */
+size_t sink_space(struct sink *sink)
+{
+	return CIRC_SPACE(&sink->buf);
+}
+
+/**
+ * sink_write() - queue data for writing
+ * @sink:	sink to write to
+ * @data:	data to write
+ * @len:	length of @data
+ *
+ * Return: true if @data was queued, false if there's no room for all of it
+ */
+bool sink_write(struct sink *sink, const void *data, size_t len)
+{
+	if (!len)
+		return true;
+
+	if (!circ_write(&sink->buf, data, len))
+		return false;
+
+	pthread_mutex_lock(&sink->lock);
+	pthread_cond_signal(&sink->cond);
+	pthread_mutex_unlock(&sink->lock);
+
+	return true;
+}
+
+/**
+ * sink_wait_fd() - file descriptor signalling room in the sink
+ * @sink:	sink to wait on
+ *
+ * Becomes readable after sink_wait(), as soon as the requested room is
+ * available.
+ *
+ * Return: file descriptor to poll for reading
+ */
+int sink_wait_fd(struct sink *sink)
+{
+	return sink->wake[0];
+}
+
+/**
+ * sink_wait() - ask to be woken up as room is freed in the sink
+ * @sink:	sink to wait on
+ * @space:	room needed
+ */
+void sink_wait(struct sink *sink, size_t space)
+{
+	char buf[16];
+
+	while (read(sink->wake[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&sink->lock);
+
+	sink->waiting = true;
+	sink->wait_space = space;
+
+	/* Room may have been freed since the caller looked */
+	if (CIRC_SPACE(&sink->buf) >= space) {
+		sink->waiting = false;
+		write(sink->wake[1], "", 1);
+	}
+
+	pthread_mutex_unlock(&sink->lock);
+}
+
+/**
+ * sink_close() - write out all buffered data and stop the sink
+ * @sink:	sink to close
+ */
+void sink_close(struct sink *sink)
+{
+	pthread_mutex_lock(&sink->lock);
+	sink->closing = true;
+	pthread_cond_signal(&sink->cond);
+	pthread_mutex_unlock(&sink->lock);
+
+	pthread_join(sink->thread, NULL);
+
+	close(sink->wake[0]);
+	close(sink->wake[1]);
+	pthread_cond_destroy(&sink->cond);
+	pthread_mutex_destroy(&sink->lock);
+	circ_free(&sink->buf);
+	free(sink);
+}
@@ -0,0 +1,21 @@
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct sink;
+
+/*
+ * Asynchronous writer, data is buffered and written out by a thread of its
+ * own, so a slow terminal or disk never stalls the caller. Writes are
+ * gathered for up to the given latency, or until a page worth is buffered.
+ */
+struct sink *sink_open(int fd, size_t size, unsigned int latency_ms);
+size_t sink_space(struct sink *sink);
+bool sink_write(struct sink *sink, const void *data, size_t len);
+int sink_wait_fd(struct sink *sink);
+void sink_wait(struct sink *sink, size_t space);
+void sink_close(struct sink *sink);
+
+#endif
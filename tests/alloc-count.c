@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * LD_PRELOAD library counting heap allocations of the process it's loaded
+ * into. It's controlled over the socket passed in $ALLOC_COUNT_FD: 'a' starts
+ * counting and is answered with "armed", 'r' stops counting and is answered
+ * with "count <n>".
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static atomic_bool armed;
+static atomic_ulong count;
+
+static void account(void)
+{
+	if (atomic_load(&armed))
+		atomic_fetch_add(&count, 1);
+}
+
+void *malloc(size_t size)
+{
+	account();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	account();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	account();
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	account();
+	ptr = __libc_memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	account();
+	return __libc_memalign(alignment, size);
+}
+
+/* Formatting happens while disarmed, the stack buffer keeps it off the heap */
+static void *alloc_count_control(void *data)
+{
+	int fd = (intptr_t)data;
+	char buf[32];
+	char cmd;
+	int len;
+
+	while (read(fd, &cmd, 1) == 1) {
+		switch (cmd) {
+		case 'a':
+			len = snprintf(buf, sizeof(buf), "armed\n");
+			atomic_store(&count, 0);
+			atomic_store(&armed, true);
+			break;
+		case 'r':
+			atomic_store(&armed, false);
+			len = snprintf(buf, sizeof(buf), "count %lu\n",
+				       atomic_load(&count));
+			break;
+		default:
+			continue;
+		}
+
+		write(fd, buf, len);
+	}
+
+	return NULL;
+}
+
+static void __attribute__((constructor)) alloc_count_init(void)
+{
+	const char *env = getenv("ALLOC_COUNT_FD");
+	pthread_t thread;
+	int fd;
+
+	if (!env)
+		return;
+
+	/* Only the process under test counts, not what it spawns */
+	fd = atoi(env);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	unsetenv("LD_PRELOAD");
+	unsetenv("ALLOC_COUNT_FD");
+
+	pthread_create(&thread, NULL, alloc_count_control, (void *)(intptr_t)fd);
+	pthread_detach(thread);
+}
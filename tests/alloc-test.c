@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Verifies that cdba-server and cdba dispatch received console and fastboot
+ * download messages without heap allocations, once warmed up. Both run with
+ * alloc-count.so preloaded, see there.
+ *
+ * usage: alloc-test <cdba-server> <cdba> <alloc-count.so>
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../cdba.h"
+
+#define TEST_BOARD		"alloc0"
+#define TEST_TIMEOUT_MS		5000
+#define TEST_FRAMES		200
+#define TEST_CHUNK		2048
+#define TEST_ACK_INTERVAL	(16 * 1024)
+/* Larger than cdba's idle bulk window, so the download outlasts the warm-up */
+#define TEST_IMAGE_SIZE		(4 * 1024 * 1024)
+
+/* Everything received from a peer, searched for the expected output */
+struct stream {
+	char data[256 * 1024];
+	size_t len;
+};
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(1, "failed to write");
+
+		buf += n;
+		len -= n;
+	}
+}
+
+static void send_msg(int fd, int type, const void *data, size_t len)
+{
+	struct msg hdr = { .type = type, .len = len };
+
+	write_all(fd, &hdr, sizeof(hdr));
+	write_all(fd, data, len);
+}
+
+static bool stream_read(int fd, struct stream *s)
+{
+	ssize_t n;
+
+	if (s->len == sizeof(s->data))
+		errx(1, "too much output");
+
+	n = read(fd, s->data + s->len, sizeof(s->data) - s->len);
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+
+	s->len += n;
+
+	return true;
+}
+
+static bool stream_has(struct stream *s, const char *str)
+{
+	return memmem(s->data, s->len, str, strlen(str)) != NULL;
+}
+
+/* Number of download acks among the messages received in @s */
+static unsigned int stream_acks(struct stream *s)
+{
+	unsigned int acks = 0;
+	struct msg hdr;
+	size_t offset = 0;
+
+	while (offset + sizeof(hdr) <= s->len) {
+		memcpy(&hdr, s->data + offset, sizeof(hdr));
+		if (offset + sizeof(hdr) + hdr.len > s->len)
+			break;
+
+		if (hdr.type == MSG_FASTBOOT_DOWNLOAD && hdr.len == sizeof(uint32_t))
+			acks++;
+
+		offset += sizeof(hdr) + hdr.len;
+	}
+
+	return acks;
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Read @a and, optionally, @b until @a_str shows up in @a's output, @b_str in
+ * @b's and @b carries @acks download acks.
+ */
+static void wait_for(int a_fd, struct stream *a, const char *a_str,
+		     int b_fd, struct stream *b, const char *b_str,
+		     unsigned int acks)
+{
+	int64_t deadline = now_ms() + TEST_TIMEOUT_MS;
+	struct pollfd pfd[2];
+	int nfds = 1;
+	int ret;
+
+	pfd[0].fd = a_fd;
+	pfd[0].events = POLLIN;
+	if (b) {
+		pfd[1].fd = b_fd;
+		pfd[1].events = POLLIN;
+		nfds++;
+	}
+
+	for (;;) {
+		if ((!a_str || stream_has(a, a_str)) &&
+		    (!b || ((!b_str || stream_has(b, b_str)) &&
+			    stream_acks(b) >= acks)))
+			return;
+
+		ret = poll(pfd, nfds, MAX(deadline - now_ms(), 0));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			err(1, "failed to poll");
+		if (!ret)
+			errx(1, "timeout waiting for \"%s\"", a_str ? a_str : b_str);
+
+		if ((pfd[0].revents & (POLLIN | POLLHUP)) && !stream_read(a_fd, a))
+			errx(1, "unexpected end of output");
+		if (b && (pfd[1].revents & (POLLIN | POLLHUP)) && !stream_read(b_fd, b))
+			errx(1, "unexpected end of output");
+	}
+}
+
+static void alloc_count_request(int fd, char cmd, char *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t n;
+
+	write_all(fd, &cmd, 1);
+
+	if (poll(&pfd, 1, TEST_TIMEOUT_MS) <= 0)
+		errx(1, "no response from the allocation counter");
+
+	n = read(fd, buf, len - 1);
+	if (n <= 0)
+		errx(1, "no response from the allocation counter");
+
+	buf[n] = '\0';
+}
+
+static void alloc_count_start(int fd)
+{
+	char buf[64];
+
+	alloc_count_request(fd, 'a', buf, sizeof(buf));
+}
+
+static unsigned long alloc_count_stop(int fd)
+{
+	char buf[64];
+
+	alloc_count_request(fd, 'r', buf, sizeof(buf));
+	if (strncmp(buf, "count ", 6))
+		errx(1, "unexpected response from the allocation counter");
+
+	return strtoul(buf + 6, NULL, 10);
+}
+
+/* Runs @argv with alloc-count.so, the returned @count_fd controls it */
+static pid_t spawn(char * const argv[], const char *dir, const char *preload,
+		   int in_fd, int out_fd, int *count_fd)
+{
+	char env[16];
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		err(1, "failed to create socket pair");
+
+	pid = fork();
+	if (pid < 0)
+		err(1, "failed to fork");
+
+	if (pid) {
+		close(sv[1]);
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		*count_fd = sv[0];
+		return pid;
+	}
+
+	if (chdir(dir) < 0)
+		err(1, "failed to enter \"%s\"", dir);
+
+	dup2(in_fd, STDIN_FILENO);
+	dup2(out_fd, STDOUT_FILENO);
+	close(sv[0]);
+
+	snprintf(env, sizeof(env), "%d", sv[1]);
+	setenv("HOME", dir, 1);
+	setenv("LD_PRELOAD", preload, 1);
+	setenv("ALLOC_COUNT_FD", env, 1);
+
+	execv(argv[0], argv);
+	err(1, "failed to execute \"%s\"", argv[0]);
+}
+static void reap(pid_t pid)
+{
+	int64_t deadline = now_ms() + TEST_TIMEOUT_MS;
+
+	while (waitpid(pid, NULL, WNOHANG) == 0) {
+		if (now_ms() > deadline) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			return;
+		}
+
+		usleep(1000);
+	}
+}
+
+static void cleanup(const char *dir)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	system(cmd);
+}
+
+/* Messages from a client are dispatched by session_process() */
+static unsigned long test_server(const char *server, const char *preload)
+{
+	char dir[] = "/tmp/cdba-alloc-test-XXXXXX";
+	static uint8_t chunk[TEST_CHUNK];
+	static struct stream console;
+	static struct stream out;
+	char path[PATH_MAX];
+	char line[32];
+	struct termios tios;
+	char *argv[] = { (char *)server, NULL };
+	unsigned long count;
+	size_t sent = 0;
+	int count_fd;
+	int to_server[2];
+	int from_server[2];
+	int master;
+	int slave;
+	pid_t pid;
+	FILE *fp;
+	int i;
+
+	if (!mkdtemp(dir))
+		err(1, "failed to create test directory");
+
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+		err(1, "failed to allocate pty");
+
+	tcgetattr(slave, &tios);
+	cfmakeraw(&tios);
+	tcsetattr(slave, TCSANOW, &tios);
+
+	snprintf(path, sizeof(path), "%s/.cdba", dir);
+	fp = fopen(path, "w");
+	if (!fp)
+		err(1, "failed to write \"%s\"", path);
+
+	fprintf(fp, "devices:\n"
+		    "  - board: " TEST_BOARD "\n"
+		    "    console: %s\n"
+		    "    fastboot: " TEST_BOARD "\n",
+		ttyname(slave));
+	fclose(fp);
+
+	if (pipe2(to_server, O_CLOEXEC) < 0 || pipe2(from_server, O_CLOEXEC) < 0)
+		err(1, "failed to create pipes");
+
+	pid = spawn(argv, dir, preload, to_server[0], from_server[1], &count_fd);
+	close(to_server[0]);
+	close(from_server[1]);
+
+	send_msg(to_server[1], MSG_SELECT_BOARD, TEST_BOARD, sizeof(TEST_BOARD));
+
+	/* Warm up, i.e. allocate the download buffer and the queue's spares */
+	for (i = 0; i < 2 * TEST_ACK_INTERVAL / TEST_CHUNK; i++) {
+		send_msg(to_server[1], MSG_FASTBOOT_DOWNLOAD, chunk, sizeof(chunk));
+		sent += sizeof(chunk);
+	}
+	send_msg(to_server[1], MSG_CONSOLE, "warm-up\n", 8);
+	wait_for(master, &console, "warm-up\n", from_server[0], &out, NULL,
+		 sent / TEST_ACK_INTERVAL);
+
+	alloc_count_start(count_fd);
+
+	for (i = 0; i < TEST_FRAMES; i++) {
+		snprintf(line, sizeof(line), "line %d\n", i);
+		send_msg(to_server[1], MSG_CONSOLE, line, strlen(line));
+
+		send_msg(to_server[1], MSG_FASTBOOT_DOWNLOAD, chunk, sizeof(chunk));
+		sent += sizeof(chunk);
+
+		/* Keep the client's side of the pipes drained */
+		if (i % 8 == 0)
+			wait_for(master, &console, line, from_server[0], &out, NULL, 0);
+	}
+	send_msg(to_server[1], MSG_CONSOLE, "done\n", 5);
+	wait_for(master, &console, "done\n", from_server[0], &out, NULL,
+		 sent / TEST_ACK_INTERVAL);
+
+	count = alloc_count_stop(count_fd);
+
+	close(to_server[1]);
+	reap(pid);
+
+	close(count_fd);
+	close(from_server[0]);
+	close(master);
+	close(slave);
+	cleanup(dir);
+
+	return count;
+}
+
+/*
+ * Stands in for cdba-server behind cdba -S, reading go-ahead from @ctl_fd
+ * after warming up the client.
+ */
+static void fake_server_ack(size_t received)
+{
+	uint32_t acked = received;
+
+	send_msg(STDOUT_FILENO, MSG_FASTBOOT_DOWNLOAD, &acked, sizeof(acked));
+}
+
+static int fake_server(int ctl_fd)
+{
+	static struct stream in;
+	char line[32];
+	struct pollfd pfd[2];
+	struct msg hdr;
+	size_t offset = 0;
+	size_t received = 0;
+	bool armed = false;
+	int frames = 0;
+	char c;
+
+	pfd[0].fd = STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctl_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "failed to poll");
+		}
+
+		/* Acks are held back during the warm-up, release the client */
+		if (pfd[1].revents) {
+			if (read(ctl_fd, &c, 1) != 1)
+				return 0;
+
+			armed = true;
+			pfd[1].fd = -1;
+
+			fake_server_ack(received);
+		}
+
+		if (!pfd[0].revents)
+			continue;
+
+		if (!stream_read(STDIN_FILENO, &in))
+			return 0;
+
+		while (offset + sizeof(hdr) <= in.len) {
+			memcpy(&hdr, in.data + offset, sizeof(hdr));
+			if (offset + sizeof(hdr) + hdr.len > in.len)
+				break;
+			offset += sizeof(hdr) + hdr.len;
+
+			switch (hdr.type) {
+			case MSG_SELECT_BOARD:
+				send_msg(STDOUT_FILENO, MSG_SELECT_BOARD, NULL, 0);
+				send_msg(STDOUT_FILENO, MSG_FASTBOOT_PRESENT, "\1", 1);
+				break;
+			case MSG_FASTBOOT_DOWNLOAD:
+				if (!hdr.len) {
+					send_msg(STDOUT_FILENO, MSG_CONSOLE, "done\n", 5);
+					break;
+				}
+
+				if (received < 2 * TEST_ACK_INTERVAL &&
+				    received + hdr.len >= 2 * TEST_ACK_INTERVAL)
+					send_msg(STDOUT_FILENO, MSG_CONSOLE, "warm-up\n", 8);
+
+				if ((armed || received < 2 * TEST_ACK_INTERVAL) &&
+				    (received + hdr.len) / TEST_ACK_INTERVAL !=
+				    received / TEST_ACK_INTERVAL)
+					fake_server_ack(received + hdr.len);
+
+				received += hdr.len;
+
+				if (armed) {
+					snprintf(line, sizeof(line), "line %d\n", frames++);
+					send_msg(STDOUT_FILENO, MSG_CONSOLE, line, strlen(line));
+				}
+				break;
+			}
+		}
+
+		/* Everything before offset is parsed, keep the buffer from filling */
+		memmove(in.data, in.data + offset, in.len - offset);
+		in.len -= offset;
+		offset = 0;
+	}
+}
+
+/* Messages from the server are dispatched by handle_message() */
+static unsigned long test_client(const char *client, const char *self,
+				 const char *preload)
+{
+	char dir[] = "/tmp/cdba-alloc-test-XXXXXX";
+	static struct stream out;
+	char image[PATH_MAX];
+	char cmd[PATH_MAX + 32];
+	unsigned long count;
+	int to_client[2];
+	int from_client[2];
+	int count_fd;
+	int ctl[2];
+	pid_t pid;
+	int fd;
+	char *argv[] = { (char *)client, "-h", "localhost", "-S", cmd,
+			 "-b", TEST_BOARD, image, NULL };
+
+	if (!mkdtemp(dir))
+		err(1, "failed to create test directory");
+
+	snprintf(image, sizeof(image), "%s/boot.img", dir);
+	fd = open(image, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate(fd, TEST_IMAGE_SIZE) < 0)
+		err(1, "failed to create \"%s\"", image);
+	close(fd);
+
+	/* The read end is inherited by the fake server */
+	if (pipe(ctl) < 0 || fcntl(ctl[1], F_SETFD, FD_CLOEXEC) < 0)
+		err(1, "failed to create pipe");
+	if (pipe2(to_client, O_CLOEXEC) < 0 || pipe2(from_client, O_CLOEXEC) < 0)
+		err(1, "failed to create pipes");
+
+	snprintf(cmd, sizeof(cmd), "%s --fake-server %d", self, ctl[0]);
+
+	pid = spawn(argv, dir, preload, to_client[0], from_client[1], &count_fd);
+	close(ctl[0]);
+	close(to_client[0]);
+	close(from_client[1]);
+
+	wait_for(from_client[0], &out, "warm-up\n", -1, NULL, NULL, 0);
+
+	alloc_count_start(count_fd);
+	write_all(ctl[1], "", 1);
+
+	wait_for(from_client[0], &out, "done\n", -1, NULL, NULL, 0);
+
+	count = alloc_count_stop(count_fd);
+
+	kill(pid, SIGTERM);
+	reap(pid);
+
+	close(count_fd);
+	close(ctl[1]);
+	close(to_client[1]);
+	close(from_client[0]);
+	cleanup(dir);
+
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	char preload[PATH_MAX];
+	char server[PATH_MAX];
+	char client[PATH_MAX];
+	char self[PATH_MAX];
+	unsigned long count;
+	int ret = 0;
+
+	if (argc == 3 && !strcmp(argv[1], "--fake-server"))
+		return fake_server(atoi(argv[2]));
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s <cdba-server> <cdba> <alloc-count.so>\n",
+			argv[0]);
+		return 1;
+	}
+
+	/* The client runs its server from $HOME, like ssh would */
+	if (!realpath(argv[1], server) || !realpath(argv[2], client) ||
+	    !realpath(argv[3], preload) || !realpath("/proc/self/exe", self))
+		err(1, "failed to resolve paths");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	count = test_server(server, preload);
+	printf("cdba-server: %lu allocations\n", count);
+	if (count)
+		ret = 1;
+
+	count = test_client(client, self, preload);
+	printf("cdba: %lu allocations\n", count);
+	if (count)
+		ret = 1;
+
+	return ret;
+}
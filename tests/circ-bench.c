@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Times circ_read(), circ_peak() and circ_fill() against the byte at a time
+ * implementation they replaced, which is kept below as old_circ_*().
+ *
+ * usage: circ-bench [megabytes]
+ */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../circ_buf.h"
+
+struct old_circ_buf {
+	char buf[CIRC_BUF_SIZE];
+	size_t head;
+	size_t tail;
+};
+
+#define OLD_CIRC_AVAIL(circ) (((circ)->head - (circ)->tail) & (CIRC_BUF_SIZE - 1))
+#define OLD_CIRC_SPACE(circ) (((circ)->tail - (circ)->head - 1) & (CIRC_BUF_SIZE - 1))
+
+#define OLD_CIRC_SPACE_TO_END(circ) MIN(OLD_CIRC_SPACE(circ), CIRC_BUF_SIZE - (circ)->head)
+
+static __attribute__((noinline))
+ssize_t old_circ_fill(int fd, struct old_circ_buf *circ)
+{
+	size_t space;
+	size_t count = 0;
+	ssize_t n = 0;
+
+	do {
+		space = OLD_CIRC_SPACE_TO_END(circ);
+		if (!space) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		n = read(fd, circ->buf + circ->head, space);
+		if (n == 0) {
+			errno = EPIPE;
+			return -1;
+		} else if (n < 0)
+			return -1;
+
+		count += n;
+
+		circ->head = (circ->head + n) & (CIRC_BUF_SIZE - 1);
+	} while (n != space);
+
+	return 0;
+}
+
+static __attribute__((noinline))
+size_t old_circ_peak(struct old_circ_buf *circ, void *buf, size_t len)
+{
+	size_t tail = circ->tail;
+	char *p = buf;
+
+	while (len--) {
+		if (tail == circ->head)
+			return 0;
+
+		*p++ = circ->buf[tail];
+
+		tail = (tail + 1) & (CIRC_BUF_SIZE - 1);
+	}
+
+	return (void*)p - buf;
+}
+
+static __attribute__((noinline))
+size_t old_circ_read(struct old_circ_buf *circ, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len--) {
+		if (circ->tail == circ->head)
+			return 0;
+
+		*p++ = circ->buf[circ->tail];
+
+		circ->tail = (circ->tail + 1) & (CIRC_BUF_SIZE - 1);
+	}
+
+	return (void*)p - buf;
+}
+
+static __attribute__((noinline))
+void old_circ_skip(struct old_circ_buf *circ, size_t len)
+{
+	circ->tail = (circ->tail + len) & (CIRC_BUF_SIZE - 1);
+}
+
+/* Message sizes: a keystroke with header, a short line, a download chunk */
+static const size_t msg_sizes[] = { 4, 64, 2051, 4099 };
+
+/* Bytes moved per case */
+static size_t total = 256 * 1024 * 1024;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *op, size_t len, uint64_t old_ns, uint64_t new_ns)
+{
+	printf("%-10s %6zu %12.1f %12.1f %8.2fx\n", op, len,
+	       total * 1e3 / old_ns, total * 1e3 / new_ns,
+	       (double)old_ns / new_ns);
+}
+
+/*
+ * The ring is topped up by moving head alone, only the copies out of it are
+ * timed. Message sizes don't divide the ring, so wrapped reads are included.
+ */
+static void bench_copy(size_t len, int peak)
+{
+	static struct old_circ_buf old;
+	struct circ_buf circ;
+	uint64_t old_ns = 0;
+	uint64_t new_ns = 0;
+	uint64_t start;
+	size_t done;
+	size_t n;
+	char buf[8192];
+
+	circ_init(&circ, CIRC_BUF_SIZE);
+
+	for (done = 0; done < total; done += n * len) {
+		n = OLD_CIRC_SPACE(&old) / len;
+		old.head = (old.head + n * len) & (CIRC_BUF_SIZE - 1);
+
+		start = now_ns();
+		for (size_t i = 0; i < n; i++) {
+			if (peak) {
+				old_circ_peak(&old, buf, len);
+				old_circ_skip(&old, len);
+			} else {
+				old_circ_read(&old, buf, len);
+			}
+		}
+		old_ns += now_ns() - start;
+	}
+
+	for (done = 0; done < total; done += n * len) {
+		n = CIRC_SPACE(&circ) / len;
+		circ.head = (circ.head + n * len) & (circ.size - 1);
+
+		start = now_ns();
+		for (size_t i = 0; i < n; i++) {
+			if (peak) {
+				circ_peak(&circ, buf, len);
+				circ_skip(&circ, len);
+			} else {
+				circ_read(&circ, buf, len);
+			}
+		}
+		new_ns += now_ns() - start;
+	}
+
+	circ_free(&circ);
+
+	report(peak ? "circ_peak" : "circ_read", len, old_ns, new_ns);
+}
+
+/*
+ * A pipe is refilled with @len bytes, which are then read with as many
+ * circ_fill() calls as it takes, like the event loop would while the pipe
+ * stays readable. The ring is drained in between, only the fills are timed.
+ */
+static void bench_fill(size_t len)
+{
+	static struct old_circ_buf old;
+	static char data[CIRC_BUF_SIZE];
+	struct circ_buf circ;
+	uint64_t old_ns = 0;
+	uint64_t new_ns = 0;
+	uint64_t start;
+	size_t done;
+	size_t left;
+	size_t head;
+	int fds[2];
+
+	if (pipe(fds) < 0)
+		err(1, "failed to create pipe");
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	circ_init(&circ, CIRC_BUF_SIZE);
+
+	for (done = 0; done < total; done += len) {
+		if (write(fds[1], data, len) != len)
+			err(1, "failed to write pipe");
+
+		for (left = len; left; left -= (old.head - head) & (CIRC_BUF_SIZE - 1)) {
+			head = old.head;
+
+			start = now_ns();
+			old_circ_fill(fds[0], &old);
+			old_ns += now_ns() - start;
+
+			old.tail = old.head;
+		}
+	}
+
+	for (done = 0; done < total; done += len) {
+		if (write(fds[1], data, len) != len)
+			err(1, "failed to write pipe");
+
+		for (left = len; left; left -= (circ.head - head) & (circ.size - 1)) {
+			head = circ.head;
+
+			start = now_ns();
+			circ_fill(fds[0], &circ);
+			new_ns += now_ns() - start;
+
+			circ.tail = circ.head;
+		}
+	}
+
+	circ_free(&circ);
+	close(fds[0]);
+	close(fds[1]);
+
+	report("circ_fill", len, old_ns, new_ns);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	if (argc > 1)
+		total = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+
+	printf("%-10s %6s %12s %12s %9s\n", "", "bytes", "old MB/s", "new MB/s", "speedup");
+
+	for (i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); i++)
+		bench_copy(msg_sizes[i], 0);
+
+	for (i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); i++)
+		bench_copy(msg_sizes[i], 1);
+
+	/* Data wrapping the end of the ring takes two old_circ_fill() calls */
+	bench_fill(4099);
+	bench_fill(12289);
+
+	return 0;
+}
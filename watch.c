@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2016-2018, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "watch.h"
+
+#define WATCH_MAX_EVENTS 32
+
+struct watch {
+	int fd;
+	unsigned int events;
+	watch_cb_t cb;
+	void *data;
+
+	bool removed;
+	struct list_head node;
+};
+
+struct timer {
+	uint64_t expires;
+	int index;
+
+	void (*cb)(void *);
+	void *data;
+};
+
+/*
+ * Each thread runs its own event loop, watches and timers belong to the
+ * thread that registered them.
+ */
+static __thread int epoll_fd = -1;
+
+/* Watches indexed by fd, for modification and removal */
+static __thread struct watch **watches;
+static __thread int watches_size;
+
+/* Watches removed while events referencing them may still be pending */
+static __thread struct list_head removed_watches;
+
+/* Binary min-heap of pending timers, ordered by expiry */
+static __thread struct timer **timer_heap;
+static __thread int timer_count;
+static __thread int timer_heap_size;
+
+static __thread int timer_fd = -1;
+static __thread uint64_t timer_armed;
+
+static __thread bool quit_invoked;
+
+static int watch_epoll_fd(void)
+{
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			err(1, "failed to create epoll instance");
+
+		list_init(&removed_watches);
+	}
+
+	return epoll_fd;
+}
+
+static uint32_t watch_to_epoll(unsigned int events)
+{
+	uint32_t ev = 0;
+
+	if (events & WATCH_READ)
+		ev |= EPOLLIN;
+	if (events & WATCH_WRITE)
+		ev |= EPOLLOUT;
+	if (events & WATCH_EDGE)
+		ev |= EPOLLET;
+
+	return ev;
+}
+
+static unsigned int epoll_to_watch(uint32_t ev)
+{
+	unsigned int revents = 0;
+
+	/* Report errors and hangups as readable, so that read() reports them */
+	if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		revents |= WATCH_READ;
+	if (ev & (EPOLLOUT | EPOLLERR))
+		revents |= WATCH_WRITE;
+
+	return revents;
+}
+
+/**
+ * watch_add() - register a file descriptor with the event loop
+ * @fd:		file descriptor to watch
+ * @events:	mask of WATCH_READ, WATCH_WRITE and WATCH_EDGE
+ * @cb:		callback invoked with the ready subset of @events
+ * @data:	context passed to @cb
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int watch_add(int fd, unsigned int events, watch_cb_t cb, void *data)
+{
+	struct epoll_event ev = {};
+	struct watch **new_watches;
+	struct watch *w;
+	int new_size;
+	int ret;
+
+	if (fd < 0)
+		return -EBADF;
+
+	if (fd >= watches_size) {
+		new_size = watches_size ? watches_size * 2 : 64;
+		if (new_size <= fd)
+			new_size = fd + 1;
+		new_watches = realloc(watches, new_size * sizeof(*watches));
+		if (!new_watches)
+			err(1, "failed to grow watch table");
+
+		memset(new_watches + watches_size, 0,
+		       (new_size - watches_size) * sizeof(*watches));
+
+		watches = new_watches;
+		watches_size = new_size;
+	}
+
+	if (watches[fd])
+		return -EEXIST;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		err(1, "failed to allocate watch");
+
+	w->fd = fd;
+	w->events = events;
+	w->cb = cb;
+	w->data = data;
+
+	ev.events = watch_to_epoll(events);
+	ev.data.ptr = w;
+
+	ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD, fd, &ev);
+	if (ret < 0) {
+		ret = -errno;
+		free(w);
+		return ret;
+	}
+
+	watches[fd] = w;
+
+	return 0;
+}
+
+/**
+ * watch_mod() - change the events of interest for a watched file descriptor
+ * @fd:		file descriptor previously passed to watch_add()
+ * @events:	new mask of WATCH_READ, WATCH_WRITE and WATCH_EDGE
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int watch_mod(int fd, unsigned int events)
+{
+	struct epoll_event ev = {};
+	struct watch *w;
+	int ret;
+
+	if (fd < 0 || fd >= watches_size || !watches[fd])
+		return -ENOENT;
+
+	w = watches[fd];
+	if (w->events == events)
+		return 0;
+
+	ev.events = watch_to_epoll(events);
+	ev.data.ptr = w;
+
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	if (ret < 0)
+		return -errno;
+
+	w->events = events;
+
+	return 0;
+}
+
+/**
+ * watch_del() - stop watching a file descriptor
+ * @fd:		file descriptor previously passed to watch_add()
+ *
+ * Must be called before @fd is closed. Safe to call from within callbacks.
+ */
+void watch_del(int fd)
+{
+	struct watch *w;
+
+	if (fd < 0 || fd >= watches_size || !watches[fd])
+		return;
+
+	w = watches[fd];
+	watches[fd] = NULL;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+	/* Pending events in the current batch may still refer to w */
+	w->removed = true;
+	list_add(&removed_watches, &w->node);
+}
+
+static uint64_t watch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void timer_heap_set(int index, struct timer *t)
+{
+	timer_heap[index] = t;
+	t->index = index;
+}
+
+static void timer_heap_up(int index)
+{
+	struct timer *t = timer_heap[index];
+	int parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (timer_heap[parent]->expires <= t->expires)
+			break;
+
+		timer_heap_set(index, timer_heap[parent]);
+		index = parent;
+	}
+
+	timer_heap_set(index, t);
+}
+
+static void timer_heap_down(int index)
+{
+	struct timer *t = timer_heap[index];
+	int child;
+
+	for (;;) {
+		child = 2 * index + 1;
+		if (child >= timer_count)
+			break;
+
+		if (child + 1 < timer_count &&
+		    timer_heap[child + 1]->expires < timer_heap[child]->expires)
+			child++;
+
+		if (t->expires <= timer_heap[child]->expires)
+			break;
+
+		timer_heap_set(index, timer_heap[child]);
+		index = child;
+	}
+
+	timer_heap_set(index, t);
+}
+
+static void timer_heap_remove(struct timer *t)
+{
+	int index = t->index;
+	struct timer *last;
+
+	last = timer_heap[--timer_count];
+	t->index = -1;
+
+	if (last == t)
+		return;
+
+	timer_heap_set(index, last);
+	timer_heap_up(index);
+	timer_heap_down(last->index);
+}
+
+/* Program the timerfd for the earliest pending timer, if it changed */
+static void watch_timer_arm(void)
+{
+	struct itimerspec its = {};
+	uint64_t expires;
+	int ret;
+
+	expires = timer_count ? timer_heap[0]->expires : 0;
+	if (expires == timer_armed)
+		return;
+
+	its.it_value.tv_sec = expires / 1000000000ull;
+	its.it_value.tv_nsec = expires % 1000000000ull;
+
+	ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	if (ret < 0)
+		err(1, "failed to arm timer");
+
+	timer_armed = expires;
+}
+
+static int watch_timer_fired(int fd, unsigned int revents, void *data)
+{
+	uint64_t expirations;
+	struct timer *t;
+	uint64_t now;
+
+	read(fd, &expirations, sizeof(expirations));
+
+	/* The timerfd is one-shot, so it is disarmed by now */
+	timer_armed = 0;
+
+	now = watch_now();
+	while (timer_count && timer_heap[0]->expires <= now) {
+		t = timer_heap[0];
+		timer_heap_remove(t);
+
+		t->cb(t->data);
+		free(t);
+	}
+
+	watch_timer_arm();
+
+	return 0;
+}
+
+/**
+ * watch_timer_add() - schedule a one-shot timer
+ * @timeout_ms:	delay, in milliseconds, before @cb is invoked
+ * @cb:		callback
+ * @data:	context passed to @cb
+ *
+ * Return: handle for watch_timer_cancel(), valid until @cb is invoked
+ */
+struct timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data)
+{
+	struct timer **new_heap;
+	struct timer *t;
+	int ret;
+
+	if (timer_fd < 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			err(1, "failed to create timerfd");
+
+		ret = watch_add(timer_fd, WATCH_READ, watch_timer_fired, NULL);
+		if (ret < 0)
+			errx(1, "failed to watch timerfd");
+	}
+
+	if (timer_count == timer_heap_size) {
+		timer_heap_size = timer_heap_size ? timer_heap_size * 2 : 16;
+		new_heap = realloc(timer_heap, timer_heap_size * sizeof(*timer_heap));
+		if (!new_heap)
+			err(1, "failed to grow timer heap");
+
+		timer_heap = new_heap;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		err(1, "failed to allocate timer");
+
+	t->expires = watch_now() + (uint64_t)timeout_ms * 1000000ull;
+	t->cb = cb;
+	t->data = data;
+
+	timer_heap_set(timer_count++, t);
+	timer_heap_up(t->index);
+
+	if (t->index == 0)
+		watch_timer_arm();
+
+	return t;
+}
+
+/**
+ * watch_timer_cancel() - cancel a pending timer
+ * @t:		handle returned by watch_timer_add()
+ *
+ * The handle must not be used after its callback has been invoked, but a
+ * callback may cancel its own timer.
+ */
+void watch_timer_cancel(struct timer *t)
+{
+	bool first;
+
+	/* Called from its own callback, freed once the callback returns */
+	if (t->index < 0)
+		return;
+
+	first = t->index == 0;
+
+	timer_heap_remove(t);
+	free(t);
+
+	if (first)
+		watch_timer_arm();
+}
+
+static void watch_free_removed(void)
+{
+	struct watch *tmp;
+	struct watch *w;
+
+	list_for_each_entry_safe(w, tmp, &removed_watches, node) {
+		list_del(&w->node);
+		free(w);
+	}
+}
+
+void watch_quit(void)
+{
+	quit_invoked = true;
+}
+
+/**
+ * watch_run() - run the calling thread's event loop until watch_quit()
+ *
+ * Return: 0 when asked to quit, negative on failure of a callback
+ */
+int watch_run(void)
+{
+	struct epoll_event events[WATCH_MAX_EVENTS];
+	struct watch *w;
+	int ret;
+	int n;
+	int i;
+
+	while (!quit_invoked) {
+		n = epoll_wait(watch_epoll_fd(), events, WATCH_MAX_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return -errno;
+
+		for (i = 0; i < n; i++) {
+			w = events[i].data.ptr;
+			if (w->removed)
+				continue;
+
+			ret = w->cb(w->fd, epoll_to_watch(events[i].events), w->data);
+			if (ret < 0) {
+				fprintf(stderr, "cb returned %d\n", ret);
+				watch_free_removed();
+				return ret;
+			}
+		}
+
+		watch_free_removed();
+	}
+
+	return 0;
+}
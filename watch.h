@@ -0,0 +1,24 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+enum {
+	WATCH_READ = 1 << 0,
+	WATCH_WRITE = 1 << 1,
+	WATCH_EDGE = 1 << 2,
+};
+
+struct timer;
+
+typedef int (*watch_cb_t)(int fd, unsigned int revents, void *data);
+
+int watch_add(int fd, unsigned int events, watch_cb_t cb, void *data);
+int watch_mod(int fd, unsigned int events);
+void watch_del(int fd);
+
+struct timer *watch_timer_add(int timeout_ms, void (*cb)(void *), void *data);
+void watch_timer_cancel(struct timer *t);
+
+void watch_quit(void);
+int watch_run(void);
+
+#endif